@@ -0,0 +1,9 @@
+-- reads the sentinel table in batches through a cursor
+BEGIN;
+DECLARE c CURSOR FOR SELECT * FROM bench_sentinel;
+FETCH 1000 FROM c;
+FETCH 1000 FROM c;
+FETCH 1000 FROM c;
+FETCH 1000 FROM c;
+CLOSE c;
+COMMIT;
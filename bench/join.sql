@@ -0,0 +1,5 @@
+-- join of a range of another table with the sentinel table
+\set lo random(1, :rows - 1000)
+SELECT o.id, o.amount, s.token
+  FROM bench_orders o JOIN bench_sentinel s ON s.id = o.sentinel_id
+ WHERE o.id BETWEEN :lo AND :lo + 1000;
@@ -0,0 +1,108 @@
+#!/bin/sh
+#
+# micro.sh
+#
+# Microbenchmark of the check kernel of pg_sentinel.
+#
+# Sets up a throwaway cluster with the module loaded and runs
+# pg_sentinel_bench() over every combination of the given value lengths,
+# storages, NULL fractions, sentinel counts and matches. Prints one CSV line
+# per combination with the time per tuple in nanoseconds and the share of
+# tuples whose check allocated memory, so results of two builds can be
+# compared mechanically.
+#
+# The module and the benchmark module must be installed into the PostgreSQL
+# used, see "make install" and "make bench-micro".
+#
+# Settings, all optional, taken from the environment:
+#
+#   PG_BINDIR            directory of initdb, pg_ctl and psql
+#   BENCH_DIR            work directory, a temporary one by default
+#   BENCH_PORT           port of the benchmark cluster (5499)
+#   BENCH_TUPLES         tuples checked per combination (1000000)
+#   BENCH_LENGTHS        value lengths in bytes (64 1024 8192)
+#   BENCH_STORAGES       value storages (inline compressed external)
+#   BENCH_NULL_FRACTIONS fractions of NULL values (0 0.5)
+#   BENCH_SENTINELS      numbers of sentinel values (1 100 10000)
+#   BENCH_MATCHES        matches (prefix contains like regex)
+#
+# Copyright 2016, 2022 Ernst-Georg Schmid
+#
+# Distributed under The PostgreSQL License
+# see License file for terms
+#
+
+set -eu
+
+BENCH_SRC=$(cd "$(dirname "$0")" && pwd)
+
+PG_BINDIR=${PG_BINDIR:-$(pg_config --bindir)}
+BENCH_PORT=${BENCH_PORT:-5499}
+BENCH_TUPLES=${BENCH_TUPLES:-1000000}
+BENCH_LENGTHS=${BENCH_LENGTHS:-64 1024 8192}
+BENCH_STORAGES=${BENCH_STORAGES:-inline compressed external}
+BENCH_NULL_FRACTIONS=${BENCH_NULL_FRACTIONS:-0 0.5}
+BENCH_SENTINELS=${BENCH_SENTINELS:-1 100 10000}
+BENCH_MATCHES=${BENCH_MATCHES:-prefix contains like regex}
+
+if [ -z "${BENCH_DIR:-}" ]; then
+    BENCH_DIR=$(mktemp -d "${TMPDIR:-/tmp}/pg_sentinel_micro.XXXXXX")
+    REMOVE_BENCH_DIR=1
+else
+    mkdir -p "$BENCH_DIR"
+    REMOVE_BENCH_DIR=0
+fi
+
+PGDATA=$BENCH_DIR/data
+PGHOST=$BENCH_DIR
+PGPORT=$BENCH_PORT
+PGDATABASE=postgres
+export PGHOST PGPORT PGDATABASE
+
+cleanup()
+{
+    "$PG_BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop >/dev/null 2>&1 || true
+    if [ "$REMOVE_BENCH_DIR" = 1 ]; then
+        rm -rf "$BENCH_DIR"
+    fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+log()
+{
+    echo "$@" >&2
+}
+
+log "setting up cluster in $BENCH_DIR"
+
+"$PG_BINDIR/initdb" -D "$PGDATA" -A trust -N >/dev/null
+cat >> "$PGDATA/postgresql.conf" <<CONF
+port = $BENCH_PORT
+listen_addresses = ''
+unix_socket_directories = '$BENCH_DIR'
+shared_preload_libraries = 'pg_sentinel'
+CONF
+
+"$PG_BINDIR/pg_ctl" -D "$PGDATA" -l "$BENCH_DIR/server.log" -w \
+    start >/dev/null 2>&1
+"$PG_BINDIR/psql" -X -q -v ON_ERROR_STOP=1 -f "$BENCH_SRC/micro.sql"
+
+echo "value_length,storage,null_fraction,sentinels,match,tuples,ns_per_tuple,allocating_tuples"
+
+for length in $BENCH_LENGTHS; do
+    for storage in $BENCH_STORAGES; do
+        for null_fraction in $BENCH_NULL_FRACTIONS; do
+            for sentinels in $BENCH_SENTINELS; do
+                for match in $BENCH_MATCHES; do
+                    log "running $length $storage $null_fraction $sentinels $match"
+                    result=$("$PG_BINDIR/psql" -X -A -t -F , -v ON_ERROR_STOP=1 -c \
+                        "SELECT round(ns_per_tuple::numeric, 2), round(allocating_tuples::numeric, 4)
+                           FROM pg_sentinel_bench($length, '$storage', $null_fraction,
+                                                  $sentinels, '$match', $BENCH_TUPLES)")
+                    echo "$length,$storage,$null_fraction,$sentinels,$match,$BENCH_TUPLES,$result"
+                done
+            done
+        done
+    done
+done
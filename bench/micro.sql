@@ -0,0 +1,15 @@
+-- Microbenchmark of the check kernel, see pg_sentinel_bench.c. The function
+-- is not part of the extension, it only exists in the benchmark cluster.
+CREATE FUNCTION pg_sentinel_bench(
+    value_length int,
+    storage text,
+    null_fraction float8,
+    sentinels int,
+    match text,
+    tuples bigint DEFAULT 1000000,
+    OUT ns_per_tuple float8,
+    OUT allocating_tuples float8
+)
+RETURNS record
+AS '$libdir/pg_sentinel_bench', 'pg_sentinel_bench'
+LANGUAGE C STRICT;
@@ -0,0 +1,2 @@
+-- parallel scan of the sentinel table, see run.sh for the settings used
+SELECT id, token FROM bench_sentinel WHERE id % 10 = 0;
@@ -0,0 +1,309 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_sentinel_bench.c
+ *
+ * Microbenchmark of the check kernel.
+ *
+ * pg_sentinel_bench() drives sentinel_check_slot(), the check executor and
+ * dest mode run on each output tuple, over synthetic heap tuples with a
+ * single text column, and reports the time and the allocations it takes
+ * per tuple. The function is not part of the extension, but a module of
+ * its own, built by bench/Makefile. It calls into pg_sentinel, which must
+ * be loaded first; bench/micro.sh creates it in a throwaway cluster with
+ * pg_sentinel preloaded.
+ *
+ * The values are of a given length, stored inline, compressed inline or
+ * out of line. Out-of-line values are indirect TOAST pointers to memory,
+ * so detoasting them costs a copy but no TOAST table access. A given
+ * fraction of the values is NULL. None of the values is a sentinel value,
+ * so each check runs to completion.
+ *
+ * The time of storing the tuples in the slot is measured separately and
+ * subtracted. PostgreSQL has no allocation counter, so for allocations,
+ * the number of tuples whose check allocated memory at all is reported.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/toast_internals.h"
+#include "catalog/pg_type.h"
+#include "funcapi.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+#if PG_VERSION_NUM >= 160000
+#include "varatt.h"
+#endif
+
+#include "pg_sentinel.h"
+
+/* Distinct tuples the benchmark cycles through */
+#define BENCH_POOL_SIZE		1024
+
+PG_MODULE_MAGIC;
+
+PG_FUNCTION_INFO_V1(pg_sentinel_bench);
+
+/* xorshift64, so runs are reproducible */
+static uint64
+bench_random(uint64 *state)
+{
+    uint64		x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+
+    return x;
+}
+
+/*
+ * A value of the given length and storage. The text repeats a random run of
+ * 16 lowercase letters, so it compresses, but never holds a sentinel value.
+ */
+static Datum
+make_value(int length, const char *storage, uint64 *seed)
+{
+    char		run[16];
+    text	   *value;
+    char	   *p;
+    int			i;
+
+    for (i = 0; i < lengthof(run); i++)
+        run[i] = 'a' + bench_random(seed) % 26;
+
+    value = (text *) palloc(VARHDRSZ + length);
+    SET_VARSIZE(value, VARHDRSZ + length);
+    p = VARDATA(value);
+    for (i = 0; i < length; i++)
+        p[i] = run[i % lengthof(run)];
+
+    if (strcmp(storage, "inline") == 0)
+        return PointerGetDatum(value);
+
+    if (strcmp(storage, "compressed") == 0)
+    {
+        Datum		compressed;
+
+#if PG_VERSION_NUM >= 140000
+        compressed = toast_compress_datum(PointerGetDatum(value),
+                                          TOAST_PGLZ_COMPRESSION);
+#else
+        compressed = toast_compress_datum(PointerGetDatum(value));
+#endif
+        if (DatumGetPointer(compressed) == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("values of length %d do not compress", length)));
+
+        return compressed;
+    }
+
+    if (strcmp(storage, "external") == 0)
+    {
+        struct varatt_indirect redirect;
+        struct varlena *pointer;
+
+        redirect.pointer = (struct varlena *) value;
+        pointer = (struct varlena *) palloc(INDIRECT_POINTER_SIZE);
+        SET_VARTAG_EXTERNAL(pointer, VARTAG_INDIRECT);
+        memcpy(VARDATA_EXTERNAL(pointer), &redirect, sizeof(redirect));
+
+        return PointerGetDatum(pointer);
+    }
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("invalid storage \"%s\"", storage),
+             errhint("Valid storages are \"inline\", \"compressed\" and \"external\".")));
+    return (Datum) 0;			/* keep compiler quiet */
+}
+
+/*
+ * Set up the sentinel column with the given number of sentinel values, the
+ * way the registry does for a text column.
+ */
+static void
+make_column(SentinelColumn *column, int nsentinels, const char *match)
+{
+    List	   *values = NIL;
+    int			flags;
+    int			i;
+
+    if (strcmp(match, "prefix") == 0)
+        flags = 0;
+    else if (strcmp(match, "contains") == 0)
+        flags = SENTINEL_SET_CONTAINS;
+    else if (strcmp(match, "like") == 0)
+        flags = SENTINEL_MATCH_LIKE;
+    else if (strcmp(match, "regex") == 0)
+        flags = SENTINEL_MATCH_REGEX;
+    else
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid match \"%s\"", match),
+                 errhint("Valid matches are \"prefix\", \"contains\", \"like\" and \"regex\".")));
+
+    for (i = 0; i < nsentinels; i++)
+    {
+        if (flags & SENTINEL_MATCH_LIKE)
+            values = lappend(values, cstring_to_text(psprintf("SENTINEL-%d%%", i)));
+        else
+            values = lappend(values, cstring_to_text(psprintf("SENTINEL-%d", i)));
+    }
+
+    memset(column, 0, sizeof(SentinelColumn));
+    column->attnum = 1;
+    column->elevel = ERROR;
+
+    if (flags & SENTINEL_MATCH_PATTERN)
+    {
+        column->compare = SENTINEL_COMPARE_PATTERN;
+        column->typid = TEXTOID;
+        column->typlen = -1;
+        column->pattern = sentinel_pattern_compile(values,
+                                                   (flags & SENTINEL_MATCH_LIKE) != 0,
+                                                   true, CurrentMemoryContext);
+        return;
+    }
+
+    /* large sets are shared, and get a Bloom filter then */
+    if (sentinel_shared_set_threshold > 0 &&
+        nsentinels >= sentinel_shared_set_threshold)
+        flags |= SENTINEL_SET_BLOOM;
+
+    column->compare = SENTINEL_COMPARE_BYTES;
+    column->values = sentinel_set_build(values, flags);
+    column->text_values = column->values;
+}
+
+static double
+elapsed_ns(instr_time start)
+{
+    instr_time	duration;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+
+    return INSTR_TIME_GET_DOUBLE(duration) * 1e9;
+}
+
+/*
+ * pg_sentinel_bench(value_length, storage, null_fraction, sentinels, match,
+ *                   tuples, OUT ns_per_tuple, OUT allocating_tuples)
+ */
+Datum
+pg_sentinel_bench(PG_FUNCTION_ARGS)
+{
+    int			length = PG_GETARG_INT32(0);
+    char	   *storage = text_to_cstring(PG_GETARG_TEXT_PP(1));
+    double		null_fraction = PG_GETARG_FLOAT8(2);
+    int			nsentinels = PG_GETARG_INT32(3);
+    char	   *match = text_to_cstring(PG_GETARG_TEXT_PP(4));
+    int64		ntuples = PG_GETARG_INT64(5);
+    TupleDesc	result_desc;
+    TupleDesc	desc;
+    SentinelColumn column;
+    SentinelRelation relation;
+    HeapTuple	pool[BENCH_POOL_SIZE];
+    TupleTableSlot *slot;
+    MemoryContext bench_cxt;
+    MemoryContext oldcxt;
+    uint64		seed = UINT64CONST(0x9E3779B97F4A7C15);
+    instr_time	start;
+    double		base_ns;
+    double		check_ns;
+    int64		allocating = 0;
+    int64		i;
+    Datum		values[2];
+    bool		nulls[2] = {false, false};
+
+    if (length < 0 || nsentinels < 1 || ntuples < 1 ||
+        null_fraction < 0.0 || null_fraction > 1.0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid benchmark parameters")));
+
+    if (get_call_result_type(fcinfo, NULL, &result_desc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    make_column(&column, nsentinels, match);
+    memset(&relation, 0, sizeof(relation));
+    relation.relid = InvalidOid;
+    relation.ncolumns = 1;
+    relation.columns = &column;
+
+    desc = CreateTemplateTupleDesc(1);
+    TupleDescInitEntry(desc, (AttrNumber) 1, "value", TEXTOID, -1, 0);
+
+    for (i = 0; i < BENCH_POOL_SIZE; i++)
+    {
+        Datum		value = (Datum) 0;
+        bool		isnull;
+
+        isnull = (double) (bench_random(&seed) % 1000000) / 1000000.0 <
+            null_fraction;
+        if (!isnull)
+            value = make_value(length, storage, &seed);
+        pool[i] = heap_form_tuple(desc, &value, &isnull);
+    }
+
+    slot = MakeSingleTupleTableSlot(desc, &TTSOpsHeapTuple);
+    bench_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                      "pg_sentinel bench",
+                                      ALLOCSET_SMALL_SIZES);
+    oldcxt = MemoryContextSwitchTo(bench_cxt);
+
+    /*
+     * Storing every tuple, without the check. The context is reset per
+     * tuple here as well, so its cost is subtracted along with the store.
+     */
+    INSTR_TIME_SET_CURRENT(start);
+    for (i = 0; i < ntuples; i++)
+    {
+        MemoryContextReset(bench_cxt);
+        ExecStoreHeapTuple(pool[i % BENCH_POOL_SIZE], slot, false);
+    }
+    base_ns = elapsed_ns(start);
+
+    /*
+     * The same, with the check. The executor resets the per-tuple context
+     * of a tuple, so what a check leaves behind does not pile up here
+     * either.
+     */
+    INSTR_TIME_SET_CURRENT(start);
+    for (i = 0; i < ntuples; i++)
+    {
+        MemoryContextReset(bench_cxt);
+        ExecStoreHeapTuple(pool[i % BENCH_POOL_SIZE], slot, false);
+        sentinel_check_slot(&relation, slot);
+    }
+    check_ns = elapsed_ns(start);
+
+    /* a check that allocates anything marks the context as no longer reset */
+    for (i = 0; i < ntuples; i++)
+    {
+        MemoryContextReset(bench_cxt);
+        ExecStoreHeapTuple(pool[i % BENCH_POOL_SIZE], slot, false);
+        sentinel_check_slot(&relation, slot);
+        if (!bench_cxt->isReset)
+            allocating++;
+    }
+
+    MemoryContextSwitchTo(oldcxt);
+    MemoryContextDelete(bench_cxt);
+    ExecDropSingleTupleTableSlot(slot);
+
+    values[0] = Float8GetDatum(Max(check_ns - base_ns, 0.0) / ntuples);
+    values[1] = Float8GetDatum((double) allocating / ntuples);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(result_desc, values,
+                                                      nulls)));
+}
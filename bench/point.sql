@@ -0,0 +1,3 @@
+-- point lookup of a single sentinel table row
+\set id random(1, :rows)
+SELECT * FROM bench_sentinel WHERE id = :id;
@@ -0,0 +1,180 @@
+#!/bin/sh
+#
+# run.sh
+#
+# End-to-end overhead benchmark of pg_sentinel, driven by pgbench.
+#
+# Sets up a throwaway cluster and runs every workload with the module not
+# loaded, loaded but without a sentinel configured, and active in each of
+# the given modes. Prints one CSV line per run, so results of two builds can
+# be compared mechanically.
+#
+# The module must be installed into the PostgreSQL used, see "make install".
+#
+# Settings, all optional, taken from the environment:
+#
+#   PG_BINDIR          directory of initdb, pg_ctl, psql and pgbench
+#   BENCH_DIR          work directory, a temporary one by default
+#   BENCH_PORT         port of the benchmark cluster (5499)
+#   BENCH_ROWS         rows in the sentinel table (100000)
+#   BENCH_CLIENTS      pgbench clients (4)
+#   BENCH_DURATION     seconds per run (30)
+#   BENCH_MODES        pg_sentinel.mode values to run active (executor dest scan)
+#   BENCH_WORKLOADS    workloads to run (point seqscan join cursor parallel)
+#
+# Copyright 2016, 2022 Ernst-Georg Schmid
+#
+# Distributed under The PostgreSQL License
+# see License file for terms
+#
+
+set -eu
+
+BENCH_SRC=$(cd "$(dirname "$0")" && pwd)
+
+PG_BINDIR=${PG_BINDIR:-$(pg_config --bindir)}
+BENCH_PORT=${BENCH_PORT:-5499}
+BENCH_ROWS=${BENCH_ROWS:-100000}
+BENCH_CLIENTS=${BENCH_CLIENTS:-4}
+BENCH_DURATION=${BENCH_DURATION:-30}
+BENCH_MODES=${BENCH_MODES:-executor dest scan}
+BENCH_WORKLOADS=${BENCH_WORKLOADS:-point seqscan join cursor parallel}
+
+if [ -z "${BENCH_DIR:-}" ]; then
+    BENCH_DIR=$(mktemp -d "${TMPDIR:-/tmp}/pg_sentinel_bench.XXXXXX")
+    REMOVE_BENCH_DIR=1
+else
+    mkdir -p "$BENCH_DIR"
+    REMOVE_BENCH_DIR=0
+fi
+
+PGDATA=$BENCH_DIR/data
+PGHOST=$BENCH_DIR
+PGPORT=$BENCH_PORT
+PGDATABASE=postgres
+export PGHOST PGPORT PGDATABASE
+
+cleanup()
+{
+    "$PG_BINDIR/pg_ctl" -D "$PGDATA" -m immediate stop >/dev/null 2>&1 || true
+    if [ "$REMOVE_BENCH_DIR" = 1 ]; then
+        rm -rf "$BENCH_DIR"
+    fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+log()
+{
+    echo "$@" >&2
+}
+
+# restart the cluster with the given pg_sentinel settings
+restart()
+{
+    printf '%s\n' "$@" > "$PGDATA/sentinel.conf"
+    "$PG_BINDIR/pg_ctl" -D "$PGDATA" -l "$BENCH_DIR/server.log" -w \
+        restart >/dev/null 2>&1
+}
+
+# settings of a workload, passed to its sessions
+workload_options()
+{
+    case $1 in
+        parallel)
+            echo "-c max_parallel_workers_per_gather=2" \
+                 "-c parallel_setup_cost=0 -c parallel_tuple_cost=0" \
+                 "-c min_parallel_table_scan_size=0"
+            ;;
+        *)
+            echo "-c max_parallel_workers_per_gather=0"
+            ;;
+    esac
+}
+
+# run one workload and print its CSV line
+run_workload()
+{
+    config=$1
+    mode=$2
+    workload=$3
+    logdir=$BENCH_DIR/log/$config-$mode-$workload
+
+    rm -rf "$logdir"
+    mkdir -p "$logdir"
+
+    log "running $workload with $config $mode"
+
+    PGOPTIONS=$(workload_options "$workload") \
+        "$PG_BINDIR/pgbench" -n -M prepared -c "$BENCH_CLIENTS" \
+        -j "$BENCH_CLIENTS" -T "$BENCH_DURATION" -D rows="$BENCH_ROWS" \
+        -f "$BENCH_SRC/$workload.sql" -l --log-prefix="$logdir/txn" \
+        > "$logdir/summary.txt" 2>&1
+
+    # the latency in microseconds is the third field of each log line
+    tps=$(sed -n 's/^tps = \([0-9.]*\).*/\1/p' "$logdir/summary.txt" | tail -n 1)
+    cat "$logdir"/txn* | awk '{ print $3 }' | sort -n > "$logdir/latency.txt"
+
+    awk -v config="$config" -v mode="$mode" -v workload="$workload" \
+        -v clients="$BENCH_CLIENTS" -v duration="$BENCH_DURATION" \
+        -v tps="$tps" '
+        { latency[NR] = $1 }
+        END {
+            if (NR == 0)
+                p50 = p99 = "";
+            else
+            {
+                p50 = sprintf("%.3f", latency[int((NR - 1) * 0.50) + 1] / 1000);
+                p99 = sprintf("%.3f", latency[int((NR - 1) * 0.99) + 1] / 1000);
+            }
+            printf "%s,%s,%s,%d,%d,%d,%s,%s,%s\n", config, mode, workload,
+                clients, duration, NR, tps, p50, p99;
+        }' "$logdir/latency.txt"
+}
+
+run_config()
+{
+    config=$1
+    mode=$2
+
+    for workload in $BENCH_WORKLOADS; do
+        run_workload "$config" "$mode" "$workload"
+    done
+}
+
+log "setting up cluster in $BENCH_DIR"
+
+"$PG_BINDIR/initdb" -D "$PGDATA" -A trust -N >/dev/null
+cat >> "$PGDATA/postgresql.conf" <<EOF
+port = $BENCH_PORT
+listen_addresses = ''
+unix_socket_directories = '$BENCH_DIR'
+max_connections = $((BENCH_CLIENTS + 10))
+include 'sentinel.conf'
+EOF
+
+restart ""
+"$PG_BINDIR/psql" -X -q -v ON_ERROR_STOP=1 -v rows="$BENCH_ROWS" \
+    -f "$BENCH_SRC/setup.sql"
+
+relid=$("$PG_BINDIR/psql" -X -A -t -c "SELECT 'bench_sentinel'::regclass::oid")
+column=$("$PG_BINDIR/psql" -X -A -t -c \
+    "SELECT attnum FROM pg_attribute WHERE attrelid = $relid AND attname = 'token'")
+
+echo "config,mode,workload,clients,duration,transactions,tps,latency_p50_ms,latency_p99_ms"
+
+restart ""
+run_config unloaded none
+
+restart "shared_preload_libraries = 'pg_sentinel'"
+run_config loaded none
+
+for mode in $BENCH_MODES; do
+    restart "shared_preload_libraries = 'pg_sentinel'" \
+        "pg_sentinel.relation_oid = $relid" \
+        "pg_sentinel.column_no = $column" \
+        "pg_sentinel.sentinel_value = 'SENTINEL-BENCH'" \
+        "pg_sentinel.abort_statement_only = true" \
+        "pg_sentinel.mode = '$mode'"
+    run_config active "$mode"
+done
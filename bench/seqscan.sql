@@ -0,0 +1,2 @@
+-- returns every row of the sentinel table
+SELECT * FROM bench_sentinel;
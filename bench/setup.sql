@@ -0,0 +1,29 @@
+-- Benchmark schema. No row holds a sentinel value, so every query runs to
+-- completion and the measurement shows the pure cost of checking.
+DROP TABLE IF EXISTS bench_orders;
+DROP TABLE IF EXISTS bench_sentinel;
+
+CREATE TABLE bench_sentinel (
+    id int PRIMARY KEY,
+    token text NOT NULL,
+    note text
+);
+
+INSERT INTO bench_sentinel
+SELECT i, 'token-' || i, repeat(md5(i::text), 4)
+  FROM generate_series(1, :rows) i;
+
+CREATE TABLE bench_orders (
+    id int PRIMARY KEY,
+    sentinel_id int NOT NULL,
+    amount numeric NOT NULL
+);
+
+INSERT INTO bench_orders
+SELECT i, 1 + (i * 7919) % :rows, i % 1000
+  FROM generate_series(1, :rows) i;
+
+CREATE EXTENSION IF NOT EXISTS pg_sentinel;
+
+VACUUM ANALYZE bench_sentinel;
+VACUUM ANALYZE bench_orders;
@@ -0,0 +1,110 @@
+/* pg_sentinel--1.0.sql */
+
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pg_sentinel" to load this file. \quit
+
+-- Registry of sentinel columns, read by every backend into its own cache
+CREATE TABLE sentinels (
+    relid regclass NOT NULL,
+    attnum int2 NOT NULL CHECK (attnum > 0),
+    sentinel_values text[] NOT NULL,
+    action text NOT NULL DEFAULT 'fatal'
+        CHECK (action IN ('warning', 'error', 'fatal')),
+    match text NOT NULL DEFAULT 'prefix'
+        CHECK (match IN ('prefix', 'contains', 'like', 'regex')),
+    -- check the rows found by the values at the last map rebuild by tid
+    by_tid bool NOT NULL DEFAULT false,
+    -- maintained by pg_sentinel_rebuild_map()
+    block_map int8[],
+    block_map_relfilenode oid,
+    row_map tid[],
+    PRIMARY KEY (relid, attnum)
+);
+
+SELECT pg_catalog.pg_extension_config_dump('sentinels', '');
+
+-- The sentinel values must stay secret
+REVOKE ALL ON sentinels FROM PUBLIC;
+
+CREATE FUNCTION registry_changed()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_sentinel_registry_changed'
+LANGUAGE C;
+
+CREATE TRIGGER sentinels_changed
+    AFTER INSERT OR UPDATE OR DELETE ON sentinels
+    FOR EACH ROW EXECUTE FUNCTION registry_changed();
+
+CREATE TRIGGER sentinels_truncated
+    AFTER TRUNCATE ON sentinels
+    FOR EACH STATEMENT EXECUTE FUNCTION registry_changed();
+
+-- Scan-level check injected into the plans of sentinel relations. It always
+-- returns true, including for NULL, so it must not be STRICT. The defensive
+-- action tells whether a value is a sentinel value, so it is not LEAKPROOF,
+-- and queries must not call it themselves. A COST well above plain operators
+-- orders it behind the other quals of a scan.
+CREATE FUNCTION sentinel_check(value anyelement, relid oid, attnum int2, tid tid)
+RETURNS bool
+AS 'MODULE_PATHNAME', 'pg_sentinel_check'
+LANGUAGE C PARALLEL SAFE COST 100;
+
+-- Block maps, so only the blocks holding sentinel rows are checked
+CREATE FUNCTION pg_sentinel_rebuild_map(rel regclass)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'pg_sentinel_rebuild_map'
+LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION pg_sentinel_rebuild_map(regclass) FROM PUBLIC;
+
+-- Fired by writes of any role, hence SECURITY DEFINER to update the registry,
+-- with a search_path those roles cannot put their own operators on
+CREATE FUNCTION block_map_maintain()
+RETURNS trigger
+AS 'MODULE_PATHNAME', 'pg_sentinel_block_map_maintain'
+LANGUAGE C SECURITY DEFINER
+SET search_path = pg_catalog, pg_temp;
+
+-- Statistics, summed up over all backends
+CREATE FUNCTION pg_sentinel_stats(
+    OUT statements_inspected bigint,
+    OUT statements_skipped bigint,
+    OUT tuples_checked bigint,
+    OUT hits bigint,
+    OUT tuples_filtered bigint,
+    OUT rows_emitted bigint,
+    OUT check_time float8
+)
+RETURNS record
+AS 'MODULE_PATHNAME', 'pg_sentinel_stats'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+CREATE VIEW stats AS
+    SELECT * FROM pg_sentinel_stats();
+
+CREATE FUNCTION pg_sentinel_stats_reset()
+RETURNS void
+AS 'MODULE_PATHNAME', 'pg_sentinel_stats_reset'
+LANGUAGE C STRICT VOLATILE PARALLEL SAFE;
+
+REVOKE ALL ON FUNCTION pg_sentinel_stats() FROM PUBLIC;
+REVOKE ALL ON FUNCTION pg_sentinel_stats_reset() FROM PUBLIC;
+REVOKE ALL ON stats FROM PUBLIC;
+
+-- Hit records, written by the hit reporter in pg_sentinel.hit_database
+CREATE TABLE hits (
+    hit_time timestamptz NOT NULL,
+    pid int4 NOT NULL,
+    action text NOT NULL,
+    role name NOT NULL,
+    database name NOT NULL,
+    relid oid NOT NULL,
+    relname name NOT NULL,
+    attnum int2 NOT NULL,
+    query_id int8,
+    client_addr text,
+    rows_before int8 NOT NULL,
+    query text NOT NULL
+);
+
+REVOKE ALL ON hits FROM PUBLIC;
@@ -13,32 +13,310 @@
  */
 
 #include "postgres.h"
+
+#include <ctype.h>
+#include <signal.h>
+
 #include "fmgr.h"
 #include "funcapi.h"
 #include "executor/executor.h"
+#include "optimizer/plancat.h"
+#include "optimizer/planner.h"
+#include "parser/analyze.h"
+#include "access/parallel.h"
 #include "access/xact.h"
 #include "utils/memutils.h"
 #include "utils/builtins.h"
 #include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "lib/ilist.h"
+#include "lib/stringinfo.h"
+
+#include "pg_sentinel.h"
 
 PG_MODULE_MAGIC;
 
+/* Where tuples are inspected */
+typedef enum SentinelMode
+{
+    SENTINEL_MODE_EXECUTOR,		/* output tuples, in the module's ExecutePlan() */
+    SENTINEL_MODE_DEST,			/* output tuples, ahead of the DestReceiver */
+    SENTINEL_MODE_SCAN,			/* tuples read by scans of sentinel relations */
+    SENTINEL_MODE_QUAL			/* same, through a qual the planner sees */
+} SentinelMode;
+
+/* How column values are compared to the sentinel values */
+static const struct config_enum_entry match_options[] = {
+    {"prefix", 0, false},
+    {"contains", SENTINEL_SET_CONTAINS, false},
+    {"like", SENTINEL_MATCH_LIKE, false},
+    {"regex", SENTINEL_MATCH_REGEX, false},
+    {NULL, 0, false}
+};
+
+static const struct config_enum_entry mode_options[] = {
+    {"executor", SENTINEL_MODE_EXECUTOR, false},
+    {"dest", SENTINEL_MODE_DEST, false},
+    {"scan", SENTINEL_MODE_SCAN, false},
+    {"qual", SENTINEL_MODE_QUAL, false},
+    {NULL, 0, false}
+};
+
+static int  sentinel_mode;
+static int  sentinel_match;
 static bool abort_statement_only;
+bool        sentinel_track_timing;
+bool        sentinel_check_copy;
 static int relation_oid;
 static int col_no;
 static int elevel;
 static char *sentinel_value;
 static char *sentinel_errmsg;
-static size_t  sentinel_value_len;
+static SentinelSet *sentinel_values;
+int         sentinel_shared_set_threshold;
+int         sentinel_hit_queue_size;
+int         sentinel_hit_query_size;
+char       *sentinel_hit_database;
+bool        sentinel_hit_log;
+int         sentinel_max_statement_rows;
+int         sentinel_max_session_rows;
+char       *sentinel_exempt_roles;
+char       *sentinel_exempt_databases;
+
+/*
+ * Per-plan inspection decision.
+ *
+ * Whether a plan can reach a sentinel relation depends on the plan alone.
+ * It is worked out at the first execution of a plan and remembered until
+ * the memory context holding the plan goes away, so the generic plan of a
+ * prepared statement is analyzed once, however often it runs. So are the
+ * check function and the kinds of scans that need hooking at execution. Registry
+ * changes invalidate the cached plans of the relations involved, which then
+ * get new plans and new decisions. The plan tree guards against a plan
+ * freed on its own and another one allocated at the same address.
+ */
+typedef struct SentinelPlanInfo
+{
+    PlannedStmt *plannedstmt;	/* hash key, must be first */
+    Plan	   *planTree;
+    bool		references_sentinel;
+    Oid			funcid;			/* check function, or InvalidOid */
+    int			scans;			/* SENTINEL_SCANS_* of the plan */
+} SentinelPlanInfo;
+
+typedef struct SentinelPlanCleanup
+{
+    MemoryContextCallback callback;
+    PlannedStmt *plannedstmt;
+    Plan	   *planTree;
+} SentinelPlanCleanup;
+
+static HTAB *plan_infos = NULL;
+
+/*
+ * DestReceiver that inspects each tuple before handing it on to the real
+ * destination, so a sentinel row never reaches the client.
+ */
+typedef struct SentinelReceiver
+{
+    DestReceiver pub;
+    DestReceiver *target;
+} SentinelReceiver;
+
+/*
+ * Per-query inspection state.
+ *
+ * Only queries whose plan can reach a sentinel relation are registered here,
+ * so ExecutorRun hands everything else straight to the regular executor.
+ * The entry lives in the query's es_query_cxt and unlinks itself when that
+ * context goes away, which covers both ExecutorEnd and error cleanup.
+ */
+typedef struct SentinelQueryState
+{
+    dlist_node  node;
+    QueryDesc  *queryDesc;
+    SentinelReceiver receiver;  /* used in dest mode */
+    MemoryContextCallback cleanup;
+} SentinelQueryState;
+
+static dlist_head inspected_queries = DLIST_STATIC_INIT(inspected_queries);
+
+/* The innermost query being run, for the row count of hit records */
+static QueryDesc *running_query = NULL;
 
+static post_parse_analyze_hook_type prev_post_parse_analyze_hook = NULL;
+static planner_hook_type prev_planner_hook = NULL;
+static get_relation_info_hook_type prev_get_relation_info_hook = NULL;
+static ExecutorStart_hook_type prev_ExecutorStart_hook = NULL;
 static ExecutorRun_hook_type prev_ExecutorRun_hook = NULL;
 
+#if PG_VERSION_NUM >= 140000
+static void sentinel_post_parse_analyze(ParseState *pstate, Query *query,
+                                        JumbleState *jstate);
+#else
+static void sentinel_post_parse_analyze(ParseState *pstate, Query *query);
+#endif
+static PlannedStmt *sentinel_planner(Query *parse, const char *query_string,
+                                     int cursorOptions, ParamListInfo boundParams);
+static void sentinel_get_relation_info(PlannerInfo *root, Oid relationObjectId,
+                                       bool inhparent, RelOptInfo *rel);
+static void sentinel_ExecutorStart(QueryDesc *queryDesc, int eflags);
+#if PG_VERSION_NUM >= 180000
+static void sentinel_ExecutorRun(QueryDesc *queryDesc,
+                                 ScanDirection direction, uint64 count);
+#else
 static void sentinel_ExecutorRun(QueryDesc *queryDesc,
                                  ScanDirection direction, uint64 count, bool execute_once);
+#endif
+static void sentinel_execute(QueryDesc *queryDesc,
+                             ScanDirection direction, uint64 count, bool execute_once);
+static void run_regular(QueryDesc *queryDesc,
+                        ScanDirection direction, uint64 count, bool execute_once);
+static bool plan_references_sentinel(PlannedStmt *plannedstmt);
+static SentinelPlanInfo *plan_needs_inspection(PlannedStmt *plannedstmt);
+static void release_plan_info(void *arg);
+static SentinelQueryState *lookup_query_state(QueryDesc *queryDesc);
+static void release_query_state(void *arg);
+static bool sentinel_receiveSlot(TupleTableSlot *slot, DestReceiver *self);
+static void sentinel_rStartup(DestReceiver *self, int operation, TupleDesc typeinfo);
+static void sentinel_rShutdown(DestReceiver *self);
+static void sentinel_rDestroy(DestReceiver *self);
+static List *parse_sentinel_values(const char *raw);
+static bool check_sentinel_value(char **newval, void **extra, GucSource source);
 
 void		_PG_init(void);
 void		_PG_fini(void);
 
+/*
+ * The number of rows the running query has produced so far, or 0 outside
+ * of the executor.
+ */
+uint64
+sentinel_rows_processed(void)
+{
+    if (running_query == NULL || running_query->estate == NULL)
+        return 0;
+
+    return running_query->estate->es_processed;
+}
+
+/*
+ * Trigger the defensive action, after handing a record of the hit to the
+ * hit reporter. rows is the number of rows the statement produced before.
+ */
+void
+sentinel_report(int level, Oid relid, AttrNumber attnum, uint64 rows)
+{
+    TRACE_PG_SENTINEL_HIT(relid, attnum, level);
+    sentinel_hit_push(level, relid, attnum, rows);
+
+    /*
+     * The leader rethrows a worker's FATAL as a mere ERROR, which would let
+     * the session live on. Terminate the leader first, as
+     * pg_terminate_backend() does.
+     */
+    if (level >= FATAL && IsParallelWorker())
+        kill(ParallelLeaderPid, SIGTERM);
+
+    ereport(level, (errmsg("%s",sentinel_errmsg))); /* ERROR - terminate the statement. FATAL - terminate the connection. */
+}
+
+/*
+ * Split the sentinel_value setting into its list of values.
+ *
+ * Values are separated by commas, surrounding whitespace is ignored. A value
+ * may be double-quoted to keep commas or whitespace, with "" standing for a
+ * literal double quote. Returns a list of text values.
+ */
+static List *
+parse_sentinel_values(const char *raw)
+{
+    List       *values = NIL;
+    const char *p = raw;
+    StringInfoData buf;
+
+    initStringInfo(&buf);
+
+    for (;;)
+    {
+        resetStringInfo(&buf);
+
+        while (isspace((unsigned char) *p))
+            p++;
+
+        if (*p == '"')
+        {
+            for (p++;; p++)
+            {
+                if (*p == '\0')
+                    ereport(ERROR,
+                            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                             errmsg("unterminated quoted value in pg_sentinel.sentinel_value")));
+                if (*p == '"')
+                {
+                    if (p[1] != '"')
+                        break;
+                    p++;
+                }
+                appendStringInfoChar(&buf, *p);
+            }
+            p++;
+            while (isspace((unsigned char) *p))
+                p++;
+        }
+        else
+        {
+            const char *start = p;
+            const char *end;
+
+            while (*p != '\0' && *p != ',')
+                p++;
+            end = p;
+            while (end > start && isspace((unsigned char) end[-1]))
+                end--;
+            appendBinaryStringInfo(&buf, start, end - start);
+        }
+
+        if (*p != '\0' && *p != ',')
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("invalid list syntax in pg_sentinel.sentinel_value")));
+
+        values = lappend(values, cstring_to_text_with_len(buf.data, buf.len));
+
+        if (*p == '\0')
+            break;
+        p++;
+    }
+
+    pfree(buf.data);
+
+    return values;
+}
+
+/*
+ * Check hook of pg_sentinel.sentinel_value: with pg_sentinel.match set to
+ * like or regex, the values are patterns, which must compile.
+ */
+static bool
+check_sentinel_value(char **newval, void **extra, GucSource source)
+{
+    char	   *error;
+
+    if ((sentinel_match & SENTINEL_MATCH_PATTERN) == 0)
+        return true;
+
+    error = sentinel_pattern_error(parse_sentinel_values(*newval),
+                                   (sentinel_match & SENTINEL_MATCH_LIKE) != 0);
+    if (error != NULL)
+    {
+        GUC_check_errdetail("Invalid sentinel pattern: %s", error);
+        return false;
+    }
+
+    return true;
+}
+
 static void
 ExecutePlan(EState *estate,
             PlanState *planstate,
@@ -50,18 +328,14 @@ ExecutePlan(EState *estate,
             DestReceiver *dest)
 {
     TupleTableSlot *slot;
-    char *col_val;
-    Datum datum;
+    SentinelRelation *sentinel;
     uint64 current_tuple_count;
-    int internal_col_no;
 
     /*
      * initialize local variables
      */
     current_tuple_count = 0;
 
-    internal_col_no = col_no - 1;
-
     /*
      * Set the direction.
      */
@@ -143,16 +417,12 @@ ExecutePlan(EState *estate,
              * trigger a defensive action.
              */
 
-            if(slot != NULL)
+            if(slot != NULL && OidIsValid(slot->tts_tableOid))
             {
-                if(slot->tts_tableOid == relation_oid)
-                {
-                    datum = slot->tts_values[internal_col_no];
-                    col_val = TextDatumGetCString(datum);
+                sentinel = sentinel_lookup_relation(slot->tts_tableOid);
 
-                    if(0 == strncmp(col_val, sentinel_value, sentinel_value_len))
-                        ereport(elevel, (errmsg("%s",sentinel_errmsg))); /* ERROR - terminate the statement. FATAL - terminate the connection. */
-                }
+                if(sentinel != NULL)
+                    sentinel_check_slot(sentinel, slot);
             }
 
             (estate->es_processed)++;
@@ -179,6 +449,9 @@ ExecutePlan(EState *estate,
 void
 _PG_init(void)
 {
+    MemoryContext oldcontext;
+    List       *values;
+
     /* Define custom GUC variable. */
     DefineCustomIntVariable("pg_sentinel.relation_oid",
                             "Selects the table by Oid "
@@ -207,16 +480,29 @@ _PG_init(void)
                             NULL,
                             NULL);
 
+    /* Define custom GUC variable, ahead of the values it applies to. */
+    DefineCustomEnumVariable("pg_sentinel.match",
+                             "Selects how column values are compared to the sentinel values.",
+                             "prefix: the value starts with a sentinel value, contains: the value has a sentinel value anywhere, like: the value matches a LIKE pattern, regex: the value matches a regular expression.",
+                             &sentinel_match,
+                             0,
+                             match_options,
+                             PGC_POSTMASTER,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
     /* Define custom GUC variable. */
     DefineCustomStringVariable("pg_sentinel.sentinel_value",
-                               "Sets the sentinel value that "
-                               "triggers abort.",
+                               "Sets the comma-separated list of sentinel "
+                               "values that trigger abort.",
                                "Default: 'SENTINEL'",
                                &sentinel_value,
                                "SENTINEL",
                                PGC_POSTMASTER,
-                               0, /* no flags required */
-                               NULL,
+                               GUC_LIST_INPUT,
+                               check_sentinel_value,
                                NULL,
                                NULL);
 
@@ -232,6 +518,19 @@ _PG_init(void)
                                NULL,
                                NULL);
 
+    /* Define custom GUC variable. */
+    DefineCustomEnumVariable("pg_sentinel.mode",
+                             "Selects where tuples are inspected.",
+                             "executor: tuples emitted by SELECT, dest: tuples emitted by SELECT, checked ahead of the client, scan: tuples read by scans of sentinel relations, qual: the same, checked by a qual the planner costs.",
+                             &sentinel_mode,
+                             SENTINEL_MODE_EXECUTOR,
+                             mode_options,
+                             PGC_POSTMASTER,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
     /* Define custom GUC variable. */
     DefineCustomBoolVariable("pg_sentinel.abort_statement_only",
                              "Controls if only the statement "
@@ -245,7 +544,164 @@ _PG_init(void)
                              NULL,
                              NULL);
 
-    /* install the hook */
+    /* Define custom GUC variable. */
+    DefineCustomBoolVariable("pg_sentinel.track_timing",
+                             "Collects the time spent checking tuples.",
+                             "Reported by pg_sentinel.pg_sentinel_stats(). Off by default, as it reads the clock twice per checked tuple.",
+                             &sentinel_track_timing,
+                             false,
+                             PGC_SUSET,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomBoolVariable("pg_sentinel.check_copy",
+                             "Checks the rows of COPY <table> TO STDOUT.",
+                             "On by default. A superuser may turn it off for a session, e.g. for pg_dump.",
+                             &sentinel_check_copy,
+                             true,
+                             PGC_SUSET,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_sentinel.shared_set_threshold",
+                            "Sets the number of values from which on a "
+                            "registered sentinel set is kept in shared memory.",
+                            "Such sets are built once, shared by all backends "
+                            "and get a Bloom filter. 0 disables shared sets.",
+                            &sentinel_shared_set_threshold,
+                            1000,
+                            0, INT_MAX,
+                            PGC_POSTMASTER,
+                            0, /* no flags required */
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_sentinel.hit_queue_size",
+                            "Sets the number of hit records queued for the hit reporter.",
+                            "Records of hits beyond that are dropped while the "
+                            "reporter catches up. 0 disables hit records.",
+                            &sentinel_hit_queue_size,
+                            1024,
+                            0, 65536,
+                            PGC_POSTMASTER,
+                            0, /* no flags required */
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_sentinel.hit_query_size",
+                            "Sets the number of bytes of the query text kept in a hit record.",
+                            NULL,
+                            &sentinel_hit_query_size,
+                            1024,
+                            100, 1048576,
+                            PGC_POSTMASTER,
+                            GUC_UNIT_BYTE,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomStringVariable("pg_sentinel.hit_database",
+                               "Sets the database the hit reporter stores hit records in.",
+                               "They go to the table pg_sentinel.hits. Empty: only log them.",
+                               &sentinel_hit_database,
+                               "",
+                               PGC_POSTMASTER,
+                               0, /* no flags required */
+                               NULL,
+                               NULL,
+                               NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomBoolVariable("pg_sentinel.hit_log",
+                             "Controls if the hit reporter writes hit records to the server log.",
+                             "Default: on.",
+                             &sentinel_hit_log,
+                             true,
+                             PGC_POSTMASTER,
+                             0, /* no flags required */
+                             NULL,
+                             NULL,
+                             NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_sentinel.max_statement_rows",
+                            "Sets the number of rows a statement may emit from a sentinel relation.",
+                            "More trigger the defensive action. 0 disables the limit. "
+                            "Can be set per role with ALTER ROLE ... SET.",
+                            &sentinel_max_statement_rows,
+                            0,
+                            0, INT_MAX,
+                            PGC_SUSET,
+                            0, /* no flags required */
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomIntVariable("pg_sentinel.max_session_rows",
+                            "Sets the number of rows a session may emit from a sentinel relation.",
+                            "More trigger the defensive action. 0 disables the limit. "
+                            "Can be set per role with ALTER ROLE ... SET.",
+                            &sentinel_max_session_rows,
+                            0,
+                            0, INT_MAX,
+                            PGC_SUSET,
+                            0, /* no flags required */
+                            NULL,
+                            NULL,
+                            NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomStringVariable("pg_sentinel.exempt_roles",
+                               "Sets the roles whose statements are not checked.",
+                               "Comma-separated list of role names. Members of these roles are exempt as well.",
+                               &sentinel_exempt_roles,
+                               "",
+                               PGC_POSTMASTER,
+                               GUC_LIST_INPUT,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    /* Define custom GUC variable. */
+    DefineCustomStringVariable("pg_sentinel.exempt_databases",
+                               "Sets the databases whose statements are not checked.",
+                               "Comma-separated list of database names.",
+                               &sentinel_exempt_databases,
+                               "",
+                               PGC_POSTMASTER,
+                               GUC_LIST_INPUT,
+                               NULL,
+                               NULL,
+                               NULL);
+
+    sentinel_shmem_init();
+    sentinel_exempt_init();
+    sentinel_hits_init();
+    sentinel_explain_init();
+    sentinel_copy_init();
+    sentinel_scan_init();
+
+    /* install the hooks */
+    prev_post_parse_analyze_hook = post_parse_analyze_hook;
+    post_parse_analyze_hook = sentinel_post_parse_analyze;
+    prev_planner_hook = planner_hook;
+    planner_hook = sentinel_planner;
+    prev_get_relation_info_hook = get_relation_info_hook;
+    get_relation_info_hook = sentinel_get_relation_info;
+    prev_ExecutorStart_hook = ExecutorStart_hook;
+    ExecutorStart_hook = sentinel_ExecutorStart;
     prev_ExecutorRun_hook = ExecutorRun_hook;
     ExecutorRun_hook = sentinel_ExecutorRun;
 
@@ -258,7 +714,20 @@ _PG_init(void)
         elevel = FATAL;
     }
 
-    sentinel_value_len = strlen(sentinel_value);
+    /*
+     * Build the sentinel value set once for the whole lifetime of the
+     * process, so the per-tuple check never has to prepare anything. The
+     * values themselves are kept too, since a column of another type than
+     * text has them parsed with its type once the registry is loaded.
+     */
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    values = parse_sentinel_values(sentinel_value);
+    sentinel_values = sentinel_set_build(values,
+                                         sentinel_match & ~SENTINEL_MATCH_PATTERN);
+    MemoryContextSwitchTo(oldcontext);
+
+    sentinel_registry_init((Oid) relation_oid, (AttrNumber) col_no, elevel,
+                           values, sentinel_match, sentinel_values);
 }
 
 /*
@@ -267,23 +736,490 @@ _PG_init(void)
 void
 _PG_fini(void)
 {
-    /* Uninstall hook. */
+    /* Uninstall hooks. */
+    post_parse_analyze_hook = prev_post_parse_analyze_hook;
+    planner_hook = prev_planner_hook;
+    get_relation_info_hook = prev_get_relation_info_hook;
+    ExecutorStart_hook = prev_ExecutorStart_hook;
     ExecutorRun_hook = prev_ExecutorRun_hook;
+    sentinel_copy_fini();
+    sentinel_explain_fini();
 }
 
-void
+/*
+ * Check whether the plan can emit tuples of the sentinel relation.
+ *
+ * relationOids covers every relation the plan depends on, including those
+ * referenced through views and partition children, while the range table
+ * covers the relations scanned directly. Both are walked once per query,
+ * with a single registry cache probe per relation.
+ */
+static bool
+plan_references_sentinel(PlannedStmt *plannedstmt)
+{
+    ListCell   *lc;
+
+    foreach(lc, plannedstmt->rtable)
+    {
+        RangeTblEntry *rte = (RangeTblEntry *) lfirst(lc);
+
+        if (rte->rtekind == RTE_RELATION &&
+            sentinel_lookup_relation(rte->relid) != NULL)
+            return true;
+    }
+
+    foreach(lc, plannedstmt->relationOids)
+    {
+        if (sentinel_lookup_relation(lfirst_oid(lc)) != NULL)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Look up the decision of plan_references_sentinel() for a plan, making it
+ * on the first call. Returns the plan's info if it needs inspection, or
+ * NULL.
+ */
+static SentinelPlanInfo *
+plan_needs_inspection(PlannedStmt *plannedstmt)
+{
+    SentinelPlanInfo *info;
+    bool		found;
+
+    if (plan_infos == NULL)
+    {
+        HASHCTL		ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(PlannedStmt *);
+        ctl.entrysize = sizeof(SentinelPlanInfo);
+        ctl.hcxt = TopMemoryContext;
+        plan_infos = hash_create("pg_sentinel plans", 64, &ctl,
+                                 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    info = (SentinelPlanInfo *) hash_search(plan_infos, &plannedstmt,
+                                            HASH_ENTER, &found);
+
+    if (!found || info->planTree != plannedstmt->planTree)
+    {
+        SentinelPlanCleanup *cleanup;
+
+        info->references_sentinel = plan_references_sentinel(plannedstmt);
+        info->funcid = InvalidOid;
+        info->scans = 0;
+        if (info->references_sentinel)
+        {
+            info->funcid = sentinel_check_function();
+            info->scans = sentinel_plan_scans(plannedstmt);
+        }
+        info->planTree = plannedstmt->planTree;
+
+        cleanup = (SentinelPlanCleanup *)
+            MemoryContextAlloc(GetMemoryChunkContext(plannedstmt),
+                               sizeof(SentinelPlanCleanup));
+        cleanup->callback.func = release_plan_info;
+        cleanup->callback.arg = cleanup;
+        cleanup->plannedstmt = plannedstmt;
+        cleanup->planTree = plannedstmt->planTree;
+        MemoryContextRegisterResetCallback(GetMemoryChunkContext(plannedstmt),
+                                           &cleanup->callback);
+    }
+
+    return info->references_sentinel ? info : NULL;
+}
+
+static void
+release_plan_info(void *arg)
+{
+    SentinelPlanCleanup *cleanup = (SentinelPlanCleanup *) arg;
+    SentinelPlanInfo *info;
+
+    info = (SentinelPlanInfo *) hash_search(plan_infos, &cleanup->plannedstmt,
+                                            HASH_FIND, NULL);
+    if (info != NULL && info->planTree == cleanup->planTree)
+        hash_search(plan_infos, &cleanup->plannedstmt, HASH_REMOVE, NULL);
+}
+
+static SentinelQueryState *
+lookup_query_state(QueryDesc *queryDesc)
+{
+    dlist_iter  iter;
+
+    dlist_foreach(iter, &inspected_queries)
+    {
+        SentinelQueryState *state = dlist_container(SentinelQueryState, node, iter.cur);
+
+        if (state->queryDesc == queryDesc)
+            return state;
+    }
+
+    return NULL;
+}
+
+static void
+release_query_state(void *arg)
+{
+    SentinelQueryState *state = (SentinelQueryState *) arg;
+
+    dlist_delete(&state->node);
+}
+
+static bool
+sentinel_receiveSlot(TupleTableSlot *slot, DestReceiver *self)
+{
+    SentinelReceiver *receiver = (SentinelReceiver *) self;
+    SentinelRelation *sentinel;
+
+    if (OidIsValid(slot->tts_tableOid))
+    {
+        sentinel = sentinel_lookup_relation(slot->tts_tableOid);
+
+        if (sentinel != NULL)
+            sentinel_check_slot(sentinel, slot);
+    }
+
+    return receiver->target->receiveSlot(slot, receiver->target);
+}
+
+static void
+sentinel_rStartup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+    SentinelReceiver *receiver = (SentinelReceiver *) self;
+
+    receiver->target->rStartup(receiver->target, operation, typeinfo);
+}
+
+static void
+sentinel_rShutdown(DestReceiver *self)
+{
+    SentinelReceiver *receiver = (SentinelReceiver *) self;
+
+    receiver->target->rShutdown(receiver->target);
+}
+
+static void
+sentinel_rDestroy(DestReceiver *self)
+{
+    /* the receiver is part of the query state, the target is not ours */
+}
+
+/*
+ * post_parse_analyze hook: reject queries that call the check function.
+ */
+#if PG_VERSION_NUM >= 140000
+static void
+sentinel_post_parse_analyze(ParseState *pstate, Query *query,
+                            JumbleState *jstate)
+{
+    if (prev_post_parse_analyze_hook)
+        prev_post_parse_analyze_hook(pstate, query, jstate);
+
+    sentinel_reject_check_calls(query);
+}
+#else
+static void
+sentinel_post_parse_analyze(ParseState *pstate, Query *query)
+{
+    if (prev_post_parse_analyze_hook)
+        prev_post_parse_analyze_hook(pstate, query);
+
+    sentinel_reject_check_calls(query);
+}
+#endif
+
+/*
+ * Planner hook: in scan mode, inject the checks into the plan.
+ *
+ * In qual mode, scans that did not get their checks while being planned,
+ * e.g. of the members of a UNION ALL or for the columns registered for a
+ * partition itself, get them here, like in scan mode.
+ *
+ * In executor and dest mode, the checks are injected into the parallel part of the
+ * plan only. Tuples that reach the leader through a tuple queue have lost
+ * the identity of their relation, so they have to be checked by the worker
+ * that scans them.
+ *
+ * The checks become part of the plan, so cached plans carry them along and
+ * are replanned with the plan cache's own invalidation.
+ *
+ * Any call of the check function in the query handed to the planner comes
+ * from somewhere else than this hook, so the query is rejected.
+ */
+static PlannedStmt *
+sentinel_planner(Query *parse, const char *query_string,
+                 int cursorOptions, ParamListInfo boundParams)
+{
+    PlannedStmt *result;
+    Oid         funcid;
+
+    sentinel_reject_check_calls(parse);
+
+    if (prev_planner_hook)
+        result = prev_planner_hook(parse, query_string, cursorOptions,
+                                   boundParams);
+    else
+        result = standard_planner(parse, query_string, cursorOptions,
+                                  boundParams);
+
+    if (result->commandType == CMD_SELECT &&
+        (sentinel_mode == SENTINEL_MODE_SCAN ||
+         sentinel_mode == SENTINEL_MODE_QUAL || result->parallelModeNeeded) &&
+        plan_references_sentinel(result) &&
+        OidIsValid(funcid = sentinel_check_function()))
+        sentinel_protect_plan(result, funcid,
+                              sentinel_mode != SENTINEL_MODE_SCAN &&
+                              sentinel_mode != SENTINEL_MODE_QUAL);
+
+    return result;
+}
+
+/*
+ * get_relation_info hook: in qual mode, add the checks to the restriction
+ * clauses of every sentinel relation the planner adds to a SELECT.
+ *
+ * This happens before the paths are built, so the planner costs the checks
+ * like any other qual, orders them among the scan's quals, and hands them to
+ * parallel workers and the JIT compiler like any other parallel safe
+ * expression.
+ *
+ * The planner replaces the restriction clauses of partitions, inheritance
+ * children and UNION ALL members with the translated ones of their parent,
+ * so children cannot get checks here. Instead, an inheritance parent gets
+ * the checks of its columns, which then reach all of its children; the
+ * planner hook adds whatever is still missing to the finished plan.
+ *
+ * Foreign tables get the checks in every mode. Their tuples carry no
+ * relation, and the FDW only fetches the columns the query needs, so the
+ * other modes could not check them. As a condition the FDW cannot send to
+ * the remote server, the check makes it fetch the sentinel column and
+ * evaluate the check on the ForeignScan node, and rules out pushing joins
+ * and aggregates over the table down to the remote server. For foreign
+ * partitions, this takes the checks on their parent, so a parent with
+ * foreign descendants gets them in every mode, and its local partitions
+ * then pay for them as well.
+ */
+static void
+sentinel_get_relation_info(PlannerInfo *root, Oid relationObjectId,
+                           bool inhparent, RelOptInfo *rel)
+{
+    Oid         funcid;
+
+    if (prev_get_relation_info_hook)
+        prev_get_relation_info_hook(root, relationObjectId, inhparent, rel);
+
+    if (root->parse->commandType != CMD_SELECT ||
+        sentinel_lookup_relation(relationObjectId) == NULL)
+        return;
+
+    if (inhparent)
+    {
+        if ((sentinel_mode == SENTINEL_MODE_QUAL ||
+             sentinel_has_foreign_children(relationObjectId)) &&
+            OidIsValid(funcid = sentinel_check_function()))
+            sentinel_protect_rel(root, rel, relationObjectId, funcid, true);
+    }
+    else if (rel->reloptkind == RELOPT_BASEREL &&
+             (sentinel_mode == SENTINEL_MODE_QUAL || OidIsValid(rel->serverid)) &&
+             OidIsValid(funcid = sentinel_check_function()))
+        sentinel_protect_rel(root, rel, relationObjectId, funcid, false);
+}
+
+/*
+ * ExecutorStart hook: register the query for inspection if its plan needs
+ * it, as decided once per plan.
+ *
+ * In scan and qual mode, the plan does its own checking. Only if the extension is
+ * missing in the current database, or the plan scans a sentinel relation
+ * through a custom scan, the output tuples are inspected instead.
+ * Statements of exempt users and databases are never inspected.
+ */
+static void
+sentinel_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+    SentinelPlanInfo *info;
+
+    if (prev_ExecutorStart_hook)
+        prev_ExecutorStart_hook(queryDesc, eflags);
+    else
+        standard_ExecutorStart(queryDesc, eflags);
+
+    if (queryDesc->operation != CMD_SELECT ||
+        (eflags & EXEC_FLAG_EXPLAIN_ONLY))
+        return;
+
+    if (sentinel_session_exempt() ||
+        (info = plan_needs_inspection(queryDesc->plannedstmt)) == NULL)
+    {
+        sentinel_count(SENTINEL_STAT_SKIPPED, 1);
+        TRACE_PG_SENTINEL_FAST_PATH(queryDesc->plannedstmt->queryId);
+        return;
+    }
+
+    sentinel_count(SENTINEL_STAT_INSPECTED, 1);
+
+    /* the checks must not pass over blocks by an outdated map */
+    sentinel_registry_accept_invalidations();
+
+    /* EXPLAIN ANALYZE and the like can report what the checks cost */
+    if (queryDesc->instrument_options != 0)
+        sentinel_explain_begin(queryDesc);
+
+    /*
+     * Index-only scans return tuples without their relation. Their tuples
+     * are checked as they are read, like in the plan, so in executor and
+     * dest mode only in the parallel part of the plan.
+     */
+    if (info->scans & SENTINEL_SCANS_INDEX_ONLY)
+        sentinel_protect_index_scans(queryDesc, info->funcid,
+                                     sentinel_mode != SENTINEL_MODE_SCAN &&
+                                     sentinel_mode != SENTINEL_MODE_QUAL &&
+                                     !IsParallelWorker());
+
+    /* the rows of the scans count towards the row limits, in every mode */
+    if ((info->scans & SENTINEL_SCANS_RELATION) &&
+        (sentinel_max_statement_rows > 0 || sentinel_max_session_rows > 0))
+        sentinel_rows_hook_scans(queryDesc);
+
+    if ((sentinel_mode != SENTINEL_MODE_SCAN &&
+         sentinel_mode != SENTINEL_MODE_QUAL) ||
+        (info->scans & SENTINEL_SCANS_CUSTOM) || !OidIsValid(info->funcid))
+    {
+        EState     *estate = queryDesc->estate;
+        SentinelQueryState *state;
+
+        state = (SentinelQueryState *) MemoryContextAlloc(estate->es_query_cxt,
+                                                          sizeof(SentinelQueryState));
+        state->queryDesc = queryDesc;
+        state->receiver.pub.receiveSlot = sentinel_receiveSlot;
+        state->receiver.pub.rStartup = sentinel_rStartup;
+        state->receiver.pub.rShutdown = sentinel_rShutdown;
+        state->receiver.pub.rDestroy = sentinel_rDestroy;
+        state->receiver.target = NULL;
+        state->cleanup.func = release_query_state;
+        state->cleanup.arg = state;
+        MemoryContextRegisterResetCallback(estate->es_query_cxt, &state->cleanup);
+        dlist_push_head(&inspected_queries, &state->node);
+    }
+}
+
+/*
+ * ExecutorRun hook: remember the running query, so hit records can tell how
+ * many rows it produced and EXPLAIN can tell what its checks cost.
+ *
+ * Once the plan has run, the parallel workers are done with their part, so
+ * the rows they read count towards the row limits of the statement.
+ */
+#if PG_VERSION_NUM >= 180000
+static void
+sentinel_ExecutorRun(QueryDesc *queryDesc,
+                     ScanDirection direction, uint64 count)
+{
+    bool		execute_once = true;	/* no longer passed */
+#else
+static void
 sentinel_ExecutorRun(QueryDesc *queryDesc,
-                     ScanDirection direction, uint64 count,bool execute_once)
+                     ScanDirection direction, uint64 count, bool execute_once)
+{
+#endif
+    QueryDesc  *prev_running_query = running_query;
+    SentinelQueryStats *prev_query_stats = sentinel_query_stats;
+
+    running_query = queryDesc;
+    sentinel_query_stats = sentinel_explain_stats(queryDesc);
+    PG_TRY();
+    {
+        sentinel_execute(queryDesc, direction, count, execute_once);
+
+        if (queryDesc->plannedstmt->parallelModeNeeded && !IsParallelWorker() &&
+            (sentinel_max_statement_rows > 0 || sentinel_max_session_rows > 0))
+            sentinel_rows_collect();
+    }
+    PG_FINALLY();
+    {
+        running_query = prev_running_query;
+        sentinel_query_stats = prev_query_stats;
+    }
+    PG_END_TRY();
+}
+
+/*
+ * Hand a query to the regular executor.
+ */
+static void
+run_regular(QueryDesc *queryDesc,
+            ScanDirection direction, uint64 count, bool execute_once)
+{
+#if PG_VERSION_NUM >= 180000
+    if (prev_ExecutorRun_hook)
+        prev_ExecutorRun_hook(queryDesc, direction, count);
+    else
+        standard_ExecutorRun(queryDesc, direction, count);
+#else
+    if (prev_ExecutorRun_hook)
+        prev_ExecutorRun_hook(queryDesc, direction, count, execute_once);
+    else
+        standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#endif
+}
+
+static void
+sentinel_execute(QueryDesc *queryDesc,
+                 ScanDirection direction, uint64 count, bool execute_once)
 {
     EState	   *estate;
     CmdType		operation;
     DestReceiver *dest;
     bool		sendTuples;
     MemoryContext oldcontext;
+    SentinelQueryState *state;
 
     /* sanity checks */
     Assert(queryDesc != NULL);
 
+    state = lookup_query_state(queryDesc);
+
+    /*
+     * Queries that cannot reach the sentinel relation take the regular
+     * executor path and pay no per-tuple cost.
+     */
+    if (state == NULL)
+    {
+        run_regular(queryDesc, direction, count, execute_once);
+        return;
+    }
+
+    TRACE_PG_SENTINEL_INSPECTION_START(queryDesc->plannedstmt->queryId);
+
+    /*
+     * In dest mode, the regular executor runs unchanged, only the tuples it
+     * sends pass through the inspecting receiver first. The destination may
+     * change between calls, e.g. with FETCH, so wrap it anew each time.
+     */
+    if (sentinel_mode == SENTINEL_MODE_DEST)
+    {
+        dest = queryDesc->dest;
+        state->receiver.pub.mydest = dest->mydest;
+        state->receiver.target = dest;
+        queryDesc->dest = &state->receiver.pub;
+
+        PG_TRY();
+        {
+            run_regular(queryDesc, direction, count, execute_once);
+        }
+        PG_FINALLY();
+        {
+            queryDesc->dest = dest;
+        }
+        PG_END_TRY();
+
+        TRACE_PG_SENTINEL_INSPECTION_DONE(queryDesc->plannedstmt->queryId,
+                                          queryDesc->estate->es_processed);
+        return;
+    }
+
     estate = queryDesc->estate;
 
     Assert(estate != NULL);
@@ -337,5 +1273,8 @@ sentinel_ExecutorRun(QueryDesc *queryDesc,
     if (queryDesc->totaltime)
         InstrStopNode(queryDesc->totaltime, estate->es_processed);
 
+    TRACE_PG_SENTINEL_INSPECTION_DONE(queryDesc->plannedstmt->queryId,
+                                      estate->es_processed);
+
     MemoryContextSwitchTo(oldcontext);
 }
@@ -0,0 +1,552 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_sentinel.h
+ *
+ * Declarations shared by the pg_sentinel source files.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+#ifndef PG_SENTINEL_H
+#define PG_SENTINEL_H
+
+#include "access/attnum.h"
+#include "executor/execdesc.h"
+#include "executor/instrument.h"
+#include "executor/tuptable.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "nodes/pg_list.h"
+#include "nodes/pathnodes.h"
+#include "nodes/plannodes.h"
+#include "port/atomics.h"
+#include "portability/instr_time.h"
+#include "storage/itemptr.h"
+#include "storage/lwlock.h"
+
+/*
+ * Static tracepoints of the provider pg_sentinel, for DTrace, SystemTap,
+ * perf or bpftrace. Like those of PostgreSQL itself, they are only compiled
+ * in if PostgreSQL was configured with --enable-dtrace, and cost a no-op
+ * instruction while nobody traces them.
+ *
+ *   inspection__start(queryid)         an inspected query starts running
+ *   inspection__done(queryid, rows)    it returns, with the rows it produced
+ *   fast__path(queryid)                a query takes the fast path
+ *   check(relid, values)               values of a tuple have been checked
+ *   hit(relid, attnum, elevel)         a sentinel value has been found
+ */
+#ifdef ENABLE_DTRACE
+#include <sys/sdt.h>
+
+#define TRACE_PG_SENTINEL_INSPECTION_START(queryid) \
+    DTRACE_PROBE1(pg_sentinel, inspection__start, queryid)
+#define TRACE_PG_SENTINEL_INSPECTION_DONE(queryid, rows) \
+    DTRACE_PROBE2(pg_sentinel, inspection__done, queryid, rows)
+#define TRACE_PG_SENTINEL_FAST_PATH(queryid) \
+    DTRACE_PROBE1(pg_sentinel, fast__path, queryid)
+#define TRACE_PG_SENTINEL_CHECK(relid, values) \
+    DTRACE_PROBE2(pg_sentinel, check, relid, values)
+#define TRACE_PG_SENTINEL_HIT(relid, attnum, elevel) \
+    DTRACE_PROBE3(pg_sentinel, hit, relid, attnum, elevel)
+#else
+#define TRACE_PG_SENTINEL_INSPECTION_START(queryid) do {} while (0)
+#define TRACE_PG_SENTINEL_INSPECTION_DONE(queryid, rows) do {} while (0)
+#define TRACE_PG_SENTINEL_FAST_PATH(queryid) do {} while (0)
+#define TRACE_PG_SENTINEL_CHECK(relid, values) do {} while (0)
+#define TRACE_PG_SENTINEL_HIT(relid, attnum, elevel) do {} while (0)
+#endif
+
+/*
+ * An immutable set of sentinel values.
+ *
+ * The set is a single flat allocation that only uses offsets internally, so
+ * it can be copied around as a blob. Values are placed with a perfect hash
+ * (hash and displace), so a probe costs one hash and at most one compare.
+ * The layout is private to sentinel_set.c.
+ */
+typedef struct SentinelSet SentinelSet;
+
+/* Flags of sentinel_set_build() */
+#define SENTINEL_SET_BLOOM		0x01	/* Bloom filter in front of the lookup */
+#define SENTINEL_SET_CONTAINS	0x02	/* match values anywhere in the data */
+
+extern SentinelSet *sentinel_set_build(List *values, int flags);
+extern bool sentinel_set_match(const SentinelSet *set,
+                               const char *data, Size len);
+extern bool sentinel_set_match_prefix(const SentinelSet *set,
+                                      const char *data, Size len);
+extern bool sentinel_set_match_exact(const SentinelSet *set,
+                                     const char *data, Size len);
+extern bool sentinel_set_match_datum(const SentinelSet *set, Datum datum);
+extern int	sentinel_set_count(const SentinelSet *set);
+extern Size sentinel_set_size(const SentinelSet *set);
+
+/*
+ * Match modes whose sentinel values are patterns rather than values. They
+ * share the flags word with those of sentinel_set_build().
+ */
+#define SENTINEL_MATCH_LIKE		0x04	/* LIKE patterns */
+#define SENTINEL_MATCH_REGEX	0x08	/* regular expressions */
+#define SENTINEL_MATCH_PATTERN	(SENTINEL_MATCH_LIKE | SENTINEL_MATCH_REGEX)
+
+/* Patterns of a column, compiled into a single matcher */
+typedef struct SentinelPattern SentinelPattern;
+
+/* sentinel_pattern.c */
+extern SentinelPattern *sentinel_pattern_compile(List *patterns, bool like,
+                                                 bool strict, MemoryContext cxt);
+extern char *sentinel_pattern_error(List *patterns, bool like);
+extern SentinelPattern *sentinel_pattern_copy(const SentinelPattern *pattern);
+extern bool sentinel_pattern_match(const SentinelPattern *pattern,
+                                   const char *data, Size len);
+
+/* How the values of a column are compared to its sentinel values */
+typedef enum SentinelCompare
+{
+    SENTINEL_COMPARE_BYTES,		/* text-like types, through the value set */
+    SENTINEL_COMPARE_WORD,		/* by-value types, as Datum words */
+    SENTINEL_COMPARE_FIXED,		/* fixed-length types, with memcmp() */
+    SENTINEL_COMPARE_EQUAL,		/* all others, with the type's equality */
+    SENTINEL_COMPARE_PATTERN	/* text-like types, through patterns */
+} SentinelCompare;
+
+/*
+ * A column holding sentinel values, and the elevel to raise on a match.
+ *
+ * Columns of types other than text and the like have their sentinel values
+ * parsed into Datums of the column's type once, when the registry is
+ * loaded, and compared with the cheapest comparison the type allows.
+ */
+typedef struct SentinelColumn
+{
+    AttrNumber	attnum;
+    int			elevel;
+    SentinelCompare compare;
+    Oid			typid;			/* InvalidOid for BYTES on unknown types */
+    int16		typlen;
+    bool		typbyval;
+    SentinelSet *values;		/* BYTES only */
+    int			ntyped;
+    Datum	   *typed;			/* WORD ascending, or EQUAL */
+    char	   *fixed;			/* FIXED, ntyped * typlen bytes, ascending */
+    Oid			collation;		/* EQUAL only */
+    FmgrInfo   *equal;			/* EQUAL only */
+    SentinelPattern *pattern;	/* PATTERN only */
+    bool		send_raw;		/* binary COPY sends the FIXED bytes as is */
+    /* the values in their text output form, as COPY sends them */
+    SentinelSet *text_values;
+    bool		text_exact;		/* whole fields only, not prefixes */
+    bool		inherited;		/* registered for an ancestor */
+    /* bitmap of the block ranges that may hold sentinels, NULL for all */
+    uint64	   *block_map;
+    BlockNumber block_map_start;
+    uint32		block_map_nbits;
+    uint8		block_map_shift;	/* each bit covers 2^shift blocks */
+    bool		by_tid;			/* sentinel rows are told by their tids */
+    /* tid keys of the sentinel rows, ascending, NULL unless by_tid applies */
+    uint64	   *row_map;
+    uint32		row_map_ntids;
+    bool		index_logged;	/* unchecked index-only scans were logged */
+} SentinelColumn;
+
+/*
+ * Check whether a tuple at the given tid may hold a sentinel value of the
+ * column. Tuples without a valid tid are always checked.
+ */
+static inline bool
+sentinel_column_covers(const SentinelColumn *column, ItemPointer tid)
+{
+    uint32		bit;
+
+    if (column->block_map == NULL || !ItemPointerIsValid(tid))
+        return true;
+
+    bit = (ItemPointerGetBlockNumberNoCheck(tid) - column->block_map_start) >>
+        column->block_map_shift;
+
+    return bit < column->block_map_nbits &&
+        (column->block_map[bit >> 6] & (UINT64CONST(1) << (bit & 63))) != 0;
+}
+
+/* The key of a tid in a row map, ordered like ItemPointerCompare() */
+static inline uint64
+sentinel_tid_key(ItemPointer tid)
+{
+    return ((uint64) ItemPointerGetBlockNumberNoCheck(tid) << 16) |
+        ItemPointerGetOffsetNumberNoCheck(tid);
+}
+
+/*
+ * Check whether the tuple at the given, valid tid may be a sentinel row of
+ * a column with a row map. This is a binary search over integers, without
+ * any access to the tuple. The map may still name the tids of dead sentinel
+ * rows, which later rows can reuse, so a tuple it names has to have its
+ * value checked as well.
+ */
+static inline bool
+sentinel_column_is_row(const SentinelColumn *column, ItemPointer tid)
+{
+    uint64		key = sentinel_tid_key(tid);
+    uint32		low = 0;
+    uint32		high = column->row_map_ntids;
+
+    while (low < high)
+    {
+        uint32		mid = low + (high - low) / 2;
+
+        if (column->row_map[mid] == key)
+            return true;
+        if (column->row_map[mid] < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return false;
+}
+
+/* sentinel_column.c */
+extern bool sentinel_column_typed(Oid relid, AttrNumber attnum);
+extern void sentinel_column_prepare(SentinelColumn *column, Oid relid,
+                                    List *values, int flags, bool strict,
+                                    MemoryContext cxt);
+extern bool sentinel_column_match_typed(const SentinelColumn *column,
+                                        Datum datum);
+extern bool sentinel_column_match_text(const SentinelColumn *column,
+                                       const char *data, Size len);
+extern bool sentinel_column_match_binary(const SentinelColumn *column,
+                                         const char *data, Size len);
+extern SentinelColumn *sentinel_column_copy(const SentinelColumn *column);
+
+/*
+ * Check whether a column of the given type can hold the sentinel values of
+ * the column, i.e. whether its values can be passed to
+ * sentinel_column_match().
+ */
+static inline bool
+sentinel_column_fits(const SentinelColumn *column, Oid typid, int16 typlen)
+{
+    if (column->compare == SENTINEL_COMPARE_BYTES)
+        return typlen == -1 && column->values != NULL;
+
+    return typid == column->typid;
+}
+
+/*
+ * Check a non-NULL value of the column. A single by-value sentinel costs a
+ * single compare.
+ */
+static inline bool
+sentinel_column_match(const SentinelColumn *column, Datum datum)
+{
+    if (column->compare == SENTINEL_COMPARE_BYTES)
+        return sentinel_set_match_datum(column->values, datum);
+
+    if (column->compare == SENTINEL_COMPARE_WORD && column->ntyped == 1)
+        return datum == column->typed[0];
+
+    return sentinel_column_match_typed(column, datum);
+}
+
+/*
+ * The sentinel columns of one relation, as found in the registry cache.
+ * Partitions and inheritance children of a registered relation have entries
+ * of their own, with the inherited columns under their own numbers.
+ *
+ * rows counts the rows the running statement read from the relation since
+ * the cache was built. Counting a row only compares it to row_check,
+ * and calls out once a row limit may have been reached.
+ */
+typedef struct SentinelRelation
+{
+    Oid			relid;			/* hash key, must be first */
+    bool		parent;			/* registered, or has children */
+    int			ncolumns;
+    SentinelColumn *columns;
+    uint64		rows;			/* rows read by the statement */
+    uint64		row_check;		/* rows at which to check the limits */
+} SentinelRelation;
+
+/* sentinel_registry.c */
+extern void sentinel_registry_init(Oid relid, AttrNumber attnum, int elevel,
+                                   List *values, int flags, SentinelSet *set);
+extern SentinelRelation *sentinel_lookup_relation(Oid relid);
+extern SentinelColumn *sentinel_lookup_column(Oid relid, AttrNumber attnum);
+extern uint64 sentinel_registry_generation(void);
+extern void sentinel_registry_accept_invalidations(void);
+
+/* sentinel_rows.c */
+extern Size sentinel_rows_shmem_size(void);
+extern void sentinel_rows_shmem_startup(void);
+extern void sentinel_rows_hook_scans(QueryDesc *queryDesc);
+extern void sentinel_rows_collect(void);
+extern void sentinel_rows_check(SentinelRelation *sentinel);
+extern void sentinel_rows_save(void);
+extern void sentinel_rows_flush(void);
+
+/*
+ * Count a row read from a sentinel relation.
+ */
+static inline void
+sentinel_count_row(SentinelRelation *sentinel)
+{
+    if (unlikely(++sentinel->rows >= sentinel->row_check))
+        sentinel_rows_check(sentinel);
+}
+
+/* sentinel_shmem.c */
+extern void sentinel_shmem_init(void);
+extern int	sentinel_shared_set_find(TransactionId xmin, ItemPointer tid);
+extern int	sentinel_shared_set_publish(TransactionId xmin, ItemPointer tid,
+                                        const SentinelSet *set);
+extern const SentinelSet *sentinel_shared_set_get(int slot);
+extern void sentinel_shared_set_release(int slot);
+
+/*
+ * Statistics, counted per backend. The order matches the columns of
+ * pg_sentinel.pg_sentinel_stats().
+ */
+typedef enum SentinelStat
+{
+    SENTINEL_STAT_INSPECTED,	/* statements that needed inspection */
+    SENTINEL_STAT_SKIPPED,		/* statements that took the fast path */
+    SENTINEL_STAT_CHECKED,		/* values compared to a sentinel set */
+    SENTINEL_STAT_HITS,			/* sentinel values found */
+    SENTINEL_STAT_FILTERED,		/* values passed over by block maps */
+    SENTINEL_STAT_ROWS,			/* rows read from sentinel relations */
+    SENTINEL_STAT_CHECK_TIME,	/* nanoseconds spent checking */
+    SENTINEL_STAT_COUNT
+} SentinelStat;
+
+typedef struct SentinelBackendStats
+{
+    pg_atomic_uint64 counters[SENTINEL_STAT_COUNT];
+} SentinelBackendStats;
+
+/*
+ * The checks of the query being run, if it runs under EXPLAIN ANALYZE or
+ * the like. instr times the inspections and counts them, counters mirror
+ * those of the backend.
+ */
+typedef struct SentinelQueryStats
+{
+    Instrumentation *instr;
+    uint64		counters[SENTINEL_STAT_COUNT];
+} SentinelQueryStats;
+
+/* sentinel_stats.c */
+extern SentinelBackendStats *sentinel_stats;
+extern SentinelQueryStats *sentinel_query_stats;
+
+extern int	sentinel_backend_slots(void);
+extern Size sentinel_stats_shmem_size(void);
+extern void sentinel_stats_shmem_startup(LWLock *lock);
+extern void sentinel_stats_attach(void);
+
+/*
+ * Add to a counter of this backend. Only this backend writes its counters,
+ * so a plain read and write suffices.
+ */
+static inline void
+sentinel_count(SentinelStat stat, uint64 n)
+{
+    pg_atomic_uint64 *counter;
+
+    if (unlikely(sentinel_stats == NULL))
+        sentinel_stats_attach();
+
+    counter = &sentinel_stats->counters[stat];
+    pg_atomic_write_u64(counter, pg_atomic_read_u64(counter) + n);
+
+    if (unlikely(sentinel_query_stats != NULL))
+        sentinel_query_stats->counters[stat] += n;
+}
+
+/*
+ * Bracket an inspection for the instrumentation of the running query.
+ */
+static inline void
+sentinel_explain_start(void)
+{
+    if (unlikely(sentinel_query_stats != NULL))
+        InstrStartNode(sentinel_query_stats->instr);
+}
+
+static inline void
+sentinel_explain_stop(void)
+{
+    if (unlikely(sentinel_query_stats != NULL))
+        InstrStopNode(sentinel_query_stats->instr, 1);
+}
+
+/*
+ * Account the time since start as time spent checking. Callers only take
+ * start if pg_sentinel.track_timing is on.
+ */
+static inline void
+sentinel_count_time(instr_time start)
+{
+    instr_time	duration;
+
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, start);
+#ifdef INSTR_TIME_GET_NANOSEC
+    sentinel_count(SENTINEL_STAT_CHECK_TIME, INSTR_TIME_GET_NANOSEC(duration));
+#else
+    sentinel_count(SENTINEL_STAT_CHECK_TIME,
+                   (uint64) INSTR_TIME_GET_MICROSEC(duration) * 1000);
+#endif
+}
+
+/* Scans of sentinel relations a plan has, see sentinel_plan_scans() */
+#define SENTINEL_SCANS_RELATION		0x01	/* scans of a single relation */
+#define SENTINEL_SCANS_INDEX_ONLY	0x02	/* index-only scans */
+#define SENTINEL_SCANS_CUSTOM		0x04	/* custom scans */
+
+/* sentinel_scan.c */
+extern void sentinel_scan_init(void);
+extern Oid	sentinel_check_function(void);
+extern void sentinel_reject_check_calls(Query *query);
+extern void sentinel_protect_plan(PlannedStmt *plannedstmt, Oid funcid,
+                                  bool parallel_only);
+extern int	sentinel_plan_scans(PlannedStmt *plannedstmt);
+extern bool sentinel_has_foreign_children(Oid relid);
+extern void sentinel_protect_rel(PlannerInfo *root, RelOptInfo *rel,
+                                 Oid relid, Oid funcid, bool inhparent);
+extern Bitmapset *sentinel_checked_columns(Plan *plan, Oid funcid);
+extern AttrNumber sentinel_index_column(IndexOnlyScan *scan, AttrNumber attnum);
+
+/* sentinel_index.c */
+extern void sentinel_protect_index_scans(QueryDesc *queryDesc, Oid funcid,
+                                         bool parallel_only);
+
+/* sentinel_explain.c */
+extern void sentinel_explain_init(void);
+extern void sentinel_explain_fini(void);
+extern void sentinel_explain_begin(QueryDesc *queryDesc);
+extern SentinelQueryStats *sentinel_explain_stats(QueryDesc *queryDesc);
+
+/* sentinel_exempt.c */
+extern Oid	sentinel_exempt_user;
+extern bool sentinel_exempt_result;
+
+extern void sentinel_exempt_init(void);
+extern void sentinel_exempt_refresh(void);
+
+/*
+ * Check whether the statements of the current user are exempt from the
+ * checks. Only a change of the user costs more than a compare.
+ */
+static inline bool
+sentinel_session_exempt(void)
+{
+    if (unlikely(GetUserId() != sentinel_exempt_user))
+        sentinel_exempt_refresh();
+
+    return sentinel_exempt_result;
+}
+
+/* sentinel_copy.c */
+extern void sentinel_copy_init(void);
+extern void sentinel_copy_fini(void);
+
+/* sentinel_map.c */
+extern List *sentinel_map_rewritten(Node *utilityStmt);
+extern void sentinel_map_refresh(List *relids);
+
+/* sentinel_hits.c */
+extern Size sentinel_hits_shmem_size(void);
+extern void sentinel_hits_shmem_startup(void);
+extern void sentinel_hits_init(void);
+extern void sentinel_hit_push(int elevel, Oid relid, AttrNumber attnum,
+                              uint64 rows);
+
+/* pg_sentinel.c */
+extern int	sentinel_shared_set_threshold;
+extern bool sentinel_track_timing;
+extern bool sentinel_check_copy;
+extern int	sentinel_hit_queue_size;
+extern int	sentinel_hit_query_size;
+extern char *sentinel_hit_database;
+extern bool sentinel_hit_log;
+extern int	sentinel_max_statement_rows;
+extern int	sentinel_max_session_rows;
+extern char *sentinel_exempt_roles;
+extern char *sentinel_exempt_databases;
+
+extern uint64 sentinel_rows_processed(void);
+extern void sentinel_report(int elevel, Oid relid, AttrNumber attnum,
+                            uint64 rows);
+
+/*
+ * Check the sentinel columns of a tuple and trigger the defensive action of
+ * the first one that holds a sentinel value. This is the check kernel of
+ * executor and dest mode, shared with the microbenchmark.
+ *
+ * Only the sentinel attributes are fetched. slot_getattr() deforms the tuple
+ * no further than the requested attribute, and not at all if that has been
+ * done already, so the check never deforms more than the sentinel column
+ * needs. Tuples outside the column's block map are not deformed at all,
+ * and neither are any tuples of a column with a row map.
+ * NULL values never match.
+ */
+static inline void
+sentinel_check_slot(SentinelRelation *sentinel, TupleTableSlot *slot)
+{
+    int			checked = 0;
+    int			i;
+    instr_time	start;
+
+    if (sentinel_track_timing)
+        INSTR_TIME_SET_CURRENT(start);
+    sentinel_explain_start();
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        SentinelColumn *column = &sentinel->columns[i];
+        Form_pg_attribute att;
+        Datum		datum;
+        bool		isnull;
+
+        if (column->attnum <= 0 ||
+            column->attnum > slot->tts_tupleDescriptor->natts)
+            continue;
+
+        att = TupleDescAttr(slot->tts_tupleDescriptor, column->attnum - 1);
+        if (!sentinel_column_fits(column, att->atttypid, att->attlen))
+            continue;
+
+        if (!sentinel_column_covers(column, &slot->tts_tid) ||
+            (column->row_map != NULL && ItemPointerIsValid(&slot->tts_tid) &&
+             !sentinel_column_is_row(column, &slot->tts_tid)))
+        {
+            sentinel_count(SENTINEL_STAT_FILTERED, 1);
+            continue;
+        }
+
+        datum = slot_getattr(slot, column->attnum, &isnull);
+        if (isnull)
+            continue;
+
+        sentinel_count(SENTINEL_STAT_CHECKED, 1);
+        checked++;
+
+        if (sentinel_column_match(column, datum))
+        {
+            sentinel_count(SENTINEL_STAT_HITS, 1);
+            sentinel_report(column->elevel, sentinel->relid, column->attnum,
+                            sentinel_rows_processed());
+        }
+    }
+
+    TRACE_PG_SENTINEL_CHECK(sentinel->relid, checked);
+    sentinel_explain_stop();
+    if (sentinel_track_timing)
+        sentinel_count_time(start);
+}
+
+#endif							/* PG_SENTINEL_H */
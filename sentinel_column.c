@@ -0,0 +1,701 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_column.c
+ *
+ * Typed sentinel values.
+ *
+ * Sentinel values are registered as text. For columns of text-like types,
+ * they are compared to the column's bytes through a sentinel set, by prefix
+ * or anywhere in the value. Columns of other types have the values parsed
+ * with the type's input function once, when the registry is loaded, and
+ * compared as whole values with the cheapest comparison the type allows:
+ * by-value types such as bigint as Datum words, fixed-length types such as
+ * uuid with memcmp(), and everything else with the type's equality function.
+ * bytea values are parsed as well, and then compared like text.
+ *
+ * COPY sends the values in text form, so for COPY, every column also carries
+ * the text output of its values.
+ *
+ * The registry cache is rebuilt in the middle of arbitrary statements, so
+ * a value that no longer parses, say after ALTER COLUMN ... TYPE, must not
+ * raise an error there. It is skipped with a LOG instead. Before
+ * PostgreSQL 16, input functions cannot report errors softly, so the values
+ * are parsed in a subtransaction then.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "access/tupmacs.h"
+#if PG_VERSION_NUM < 160000
+#include "access/xact.h"
+#endif
+#include "catalog/pg_attribute.h"
+#include "catalog/pg_type.h"
+#if PG_VERSION_NUM >= 160000
+#include "nodes/miscnodes.h"
+#endif
+#include "port/pg_bswap.h"
+#include "utils/builtins.h"
+#include "utils/datum.h"
+#include "utils/lsyscache.h"
+#include "utils/syscache.h"
+#include "utils/resowner.h"
+#include "utils/typcache.h"
+
+#include "pg_sentinel.h"
+
+/* Up to this many typed values are searched linearly */
+#define SENTINEL_LINEAR_MAX		8
+
+/* The attribute of a registered column */
+typedef struct ColumnType
+{
+    Oid			typid;
+    int32		typmod;
+    Oid			collation;
+    Oid			basetype;
+    int16		typlen;
+    bool		typbyval;
+    char		typcategory;
+} ColumnType;
+
+static bool
+column_type(Oid relid, AttrNumber attnum, ColumnType *type)
+{
+    HeapTuple	tuple;
+    Form_pg_attribute att;
+    bool		preferred;
+    int32		basetypmod;
+
+    tuple = SearchSysCache2(ATTNUM, ObjectIdGetDatum(relid),
+                            Int16GetDatum(attnum));
+    if (!HeapTupleIsValid(tuple))
+        return false;
+
+    att = (Form_pg_attribute) GETSTRUCT(tuple);
+    if (att->attisdropped)
+    {
+        ReleaseSysCache(tuple);
+        return false;
+    }
+
+    type->typid = att->atttypid;
+    type->typmod = att->atttypmod;
+    type->collation = att->attcollation;
+    type->typlen = att->attlen;
+    type->typbyval = att->attbyval;
+    ReleaseSysCache(tuple);
+
+    basetypmod = type->typmod;
+    type->basetype = getBaseTypeAndTypmod(type->typid, &basetypmod);
+    get_type_category_preferred(type->basetype, &type->typcategory, &preferred);
+
+    return true;
+}
+
+/*
+ * Pick the comparison of a type. Types whose equality is bitwise compare as
+ * words or bytes, the rest need their equality function.
+ */
+static SentinelCompare
+type_compare(const ColumnType *type)
+{
+    switch (type->basetype)
+    {
+        case BOOLOID:
+        case CHAROID:
+        case INT2OID:
+        case INT4OID:
+        case INT8OID:
+        case OIDOID:
+        case DATEOID:
+        case TIMEOID:
+        case TIMESTAMPOID:
+        case TIMESTAMPTZOID:
+            /* int8 and the like are passed by reference on 32-bit builds */
+            return type->typbyval ? SENTINEL_COMPARE_WORD : SENTINEL_COMPARE_FIXED;
+        case UUIDOID:
+        case MACADDROID:
+        case MACADDR8OID:
+            return SENTINEL_COMPARE_FIXED;
+        case BYTEAOID:
+            return SENTINEL_COMPARE_BYTES;
+    }
+
+    if (type->typlen == -1 &&
+        (type->typcategory == TYPCATEGORY_STRING ||
+         type->typcategory == TYPCATEGORY_USER))
+        return SENTINEL_COMPARE_BYTES;
+
+    return SENTINEL_COMPARE_EQUAL;
+}
+
+/*
+ * Check whether the sentinel values of a column have to be parsed, rather
+ * than compared as text. Columns that cannot be found are compared as text.
+ */
+bool
+sentinel_column_typed(Oid relid, AttrNumber attnum)
+{
+    ColumnType	type;
+
+    if (!column_type(relid, attnum, &type))
+        return false;
+
+    return type.basetype == BYTEAOID ||
+        type_compare(&type) != SENTINEL_COMPARE_BYTES;
+}
+
+/*
+ * Bring a by-value Datum into the form fetch_att() gives it, which is how it
+ * comes out of a tuple, e.g. sign-extended for an oid.
+ */
+static Datum
+normalize_word(Datum datum, int16 typlen)
+{
+    union
+    {
+        int64		align;
+        char		bytes[sizeof(Datum)];
+    }			buf;
+
+    store_att_byval(buf.bytes, datum, typlen);
+
+    return fetch_att(buf.bytes, true, typlen);
+}
+
+static int
+compare_word(const void *a, const void *b)
+{
+    Datum		da = *(const Datum *) a;
+    Datum		db = *(const Datum *) b;
+
+    return (da > db) - (da < db);
+}
+
+static int
+compare_fixed(const void *a, const void *b, void *arg)
+{
+    return memcmp(a, b, *(const int16 *) arg);
+}
+
+/*
+ * Parse one sentinel value.
+ */
+static Datum
+parse_value(text *value, const ColumnType *type, FmgrInfo *input,
+            Oid typioparam)
+{
+    return InputFunctionCall(input, text_to_cstring(value), typioparam,
+                             type->typmod);
+}
+
+#if PG_VERSION_NUM < 160000
+/*
+ * Parse sentinel values in a subtransaction. Returns false if one of them
+ * does not parse, after logging that if report is set. Query cancels are
+ * raised again.
+ *
+ * No subtransaction can be started in parallel mode. The error is caught
+ * without one there, as input functions raise their errors before they
+ * take any resources that would need releasing.
+ */
+static bool
+parse_values_guarded(List *values, const ColumnType *type, FmgrInfo *input,
+                     Oid typioparam, Datum *datums, bool report)
+{
+    MemoryContext oldcxt = CurrentMemoryContext;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    bool		subxact = !IsInParallelMode();
+    volatile bool parsed = true;
+
+    if (subxact)
+    {
+        BeginInternalSubTransaction(NULL);
+        MemoryContextSwitchTo(oldcxt);
+    }
+
+    PG_TRY();
+    {
+        ListCell   *lc;
+        int			i = 0;
+
+        foreach(lc, values)
+            datums[i++] = parse_value((text *) lfirst(lc), type, input,
+                                      typioparam);
+
+        if (subxact)
+        {
+            ReleaseCurrentSubTransaction();
+            MemoryContextSwitchTo(oldcxt);
+            CurrentResourceOwner = oldowner;
+        }
+    }
+    PG_CATCH();
+    {
+        ErrorData  *edata;
+
+        MemoryContextSwitchTo(oldcxt);
+        edata = CopyErrorData();
+        FlushErrorState();
+
+        if (subxact)
+        {
+            RollbackAndReleaseCurrentSubTransaction();
+            MemoryContextSwitchTo(oldcxt);
+            CurrentResourceOwner = oldowner;
+        }
+
+        if (edata->sqlerrcode == ERRCODE_QUERY_CANCELED)
+            ReThrowError(edata);
+
+        if (report)
+            ereport(LOG,
+                    (errmsg("pg_sentinel: ignoring a sentinel value that is not a valid %s",
+                            format_type_be(type->typid)),
+                     errdetail_internal("%s", edata->message)));
+        FreeErrorData(edata);
+        parsed = false;
+    }
+    PG_END_TRY();
+
+    return parsed;
+}
+#endif
+
+/*
+ * Parse the sentinel values of a column into datums and return how many
+ * parsed. With strict, a value that does not parse raises an error; without,
+ * it is skipped with a LOG.
+ */
+static int
+parse_values(List *values, const ColumnType *type, FmgrInfo *input,
+             Oid typioparam, bool strict, Datum *datums)
+{
+    ListCell   *lc;
+    int			ndatums = 0;
+
+    if (strict)
+    {
+        foreach(lc, values)
+            datums[ndatums++] = parse_value((text *) lfirst(lc), type, input,
+                                            typioparam);
+        return ndatums;
+    }
+
+#if PG_VERSION_NUM >= 160000
+    foreach(lc, values)
+    {
+        ErrorSaveContext escontext = {T_ErrorSaveContext};
+
+        if (!InputFunctionCallSafe(input, text_to_cstring((text *) lfirst(lc)),
+                                   typioparam, type->typmod,
+                                   (Node *) &escontext, &datums[ndatums]))
+        {
+            ereport(LOG,
+                    (errmsg("pg_sentinel: ignoring a sentinel value that is not a valid %s",
+                            format_type_be(type->typid))));
+            continue;
+        }
+        ndatums++;
+    }
+#else
+    /* one subtransaction for all values, unless some do not parse */
+    if (parse_values_guarded(values, type, input, typioparam, datums, false))
+        return list_length(values);
+
+    foreach(lc, values)
+    {
+        if (parse_values_guarded(list_make1(lfirst(lc)), type, input,
+                                 typioparam, &datums[ndatums], true))
+            ndatums++;
+    }
+#endif
+
+    return ndatums;
+}
+
+/*
+ * Set up a column whose sentinel values are patterns. Only columns of text
+ * types can have them, others are left without values.
+ */
+static void
+prepare_pattern(SentinelColumn *column, const ColumnType *type, List *values,
+                int flags, bool strict, MemoryContext cxt)
+{
+    if (type_compare(type) != SENTINEL_COMPARE_BYTES ||
+        type->basetype == BYTEAOID)
+    {
+        ereport(strict ? ERROR : LOG,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("sentinel patterns need a column of a text type, not %s",
+                        format_type_be(type->typid))));
+        return;
+    }
+
+    column->compare = SENTINEL_COMPARE_PATTERN;
+    column->typid = type->typid;
+    column->typlen = type->typlen;
+    column->typbyval = type->typbyval;
+    column->values = NULL;
+    column->text_values = NULL;
+    column->pattern = sentinel_pattern_compile(values,
+                                               (flags & SENTINEL_MATCH_LIKE) != 0,
+                                               strict, cxt);
+}
+
+/*
+ * Set up the comparison of a column from its sentinel values, a list of
+ * text. Everything kept goes to cxt. With strict, values that do not parse
+ * raise an error, which the registry trigger uses to reject them.
+ */
+void
+sentinel_column_prepare(SentinelColumn *column, Oid relid, List *values,
+                        int flags, bool strict, MemoryContext cxt)
+{
+    ColumnType	type;
+    Oid			typinput;
+    Oid			typoutput;
+    Oid			typioparam;
+    bool		typisvarlena;
+    FmgrInfo	input;
+    FmgrInfo	output;
+    Datum	   *datums;
+    List	   *texts = NIL;
+    int			ndatums;
+    MemoryContext oldcxt;
+    int			i;
+
+    if (!column_type(relid, column->attnum, &type))
+        return;
+
+    if (flags & SENTINEL_MATCH_PATTERN)
+    {
+        prepare_pattern(column, &type, values, flags, strict, cxt);
+        return;
+    }
+
+    getTypeInputInfo(type.typid, &typinput, &typioparam);
+    getTypeOutputInfo(type.typid, &typoutput, &typisvarlena);
+    fmgr_info(typinput, &input);
+    fmgr_info(typoutput, &output);
+
+    datums = palloc(sizeof(Datum) * Max(list_length(values), 1));
+    ndatums = parse_values(values, &type, &input, typioparam, strict, datums);
+
+    /* the text form of the values, as COPY writes them */
+    for (i = 0; i < ndatums; i++)
+        texts = lappend(texts,
+                        cstring_to_text(OutputFunctionCall(&output, datums[i])));
+
+    column->compare = type_compare(&type);
+    column->typid = type.typid;
+    column->typlen = type.typlen;
+    column->typbyval = type.typbyval;
+    column->collation = type.collation;
+    column->send_raw = type.basetype == UUIDOID ||
+        type.basetype == MACADDROID || type.basetype == MACADDR8OID;
+
+    oldcxt = MemoryContextSwitchTo(cxt);
+
+    switch (column->compare)
+    {
+        case SENTINEL_COMPARE_BYTES:
+            {
+                /* bytea: the parsed bytes, by prefix or anywhere */
+                List	   *bytes = NIL;
+
+                for (i = 0; i < ndatums; i++)
+                    bytes = lappend(bytes, DatumGetPointer(datums[i]));
+                column->values = sentinel_set_build(bytes, flags);
+                column->text_values = sentinel_set_build(texts, flags);
+                column->text_exact = false;
+                break;
+            }
+        case SENTINEL_COMPARE_WORD:
+            column->typed = palloc(sizeof(Datum) * Max(ndatums, 1));
+            for (i = 0; i < ndatums; i++)
+                column->typed[i] = normalize_word(datums[i], type.typlen);
+            qsort(column->typed, ndatums, sizeof(Datum), compare_word);
+            column->ntyped = ndatums;
+            break;
+        case SENTINEL_COMPARE_FIXED:
+            column->fixed = palloc(type.typlen * Max(ndatums, 1));
+            for (i = 0; i < ndatums; i++)
+                memcpy(column->fixed + i * type.typlen,
+                       DatumGetPointer(datums[i]), type.typlen);
+            qsort_arg(column->fixed, ndatums, type.typlen, compare_fixed,
+                      &type.typlen);
+            column->ntyped = ndatums;
+            break;
+        case SENTINEL_COMPARE_EQUAL:
+            {
+                TypeCacheEntry *typentry;
+
+                typentry = lookup_type_cache(type.typid, TYPECACHE_EQ_OPR_FINFO);
+                if (!OidIsValid(typentry->eq_opr_finfo.fn_oid))
+                {
+                    if (strict)
+                        ereport(ERROR,
+                                (errcode(ERRCODE_UNDEFINED_FUNCTION),
+                                 errmsg("could not identify an equality operator for type %s",
+                                        format_type_be(type.typid))));
+                    break;
+                }
+
+                column->equal = palloc(sizeof(FmgrInfo));
+                fmgr_info_copy(column->equal, &typentry->eq_opr_finfo, cxt);
+                column->typed = palloc(sizeof(Datum) * Max(ndatums, 1));
+                for (i = 0; i < ndatums; i++)
+                    column->typed[i] = datumCopy(datums[i], type.typbyval,
+                                                 type.typlen);
+                column->ntyped = ndatums;
+                break;
+            }
+        case SENTINEL_COMPARE_PATTERN:
+            /* set up by prepare_pattern() */
+            break;
+    }
+
+    if (column->compare != SENTINEL_COMPARE_BYTES)
+    {
+        column->values = NULL;
+        column->text_values = sentinel_set_build(texts, 0);
+        column->text_exact = true;
+    }
+
+    MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Check a non-NULL value of a column, for all but the cases that
+ * sentinel_column_match() handles inline.
+ */
+bool
+sentinel_column_match_typed(const SentinelColumn *column, Datum datum)
+{
+    int			low = 0;
+    int			high = column->ntyped - 1;
+    int			i;
+
+    switch (column->compare)
+    {
+        case SENTINEL_COMPARE_BYTES:
+            return sentinel_set_match_datum(column->values, datum);
+
+        case SENTINEL_COMPARE_PATTERN:
+            {
+                struct varlena *value = (struct varlena *) DatumGetPointer(datum);
+                struct varlena *unpacked = pg_detoast_datum_packed(value);
+                bool		match;
+
+                match = sentinel_pattern_match(column->pattern,
+                                               VARDATA_ANY(unpacked),
+                                               VARSIZE_ANY_EXHDR(unpacked));
+                if (unpacked != value)
+                    pfree(unpacked);
+
+                return match;
+            }
+
+        case SENTINEL_COMPARE_WORD:
+            if (column->ntyped <= SENTINEL_LINEAR_MAX)
+            {
+                for (i = 0; i < column->ntyped; i++)
+                {
+                    if (column->typed[i] == datum)
+                        return true;
+                }
+                return false;
+            }
+            while (low <= high)
+            {
+                int			mid = low + (high - low) / 2;
+
+                if (column->typed[mid] == datum)
+                    return true;
+                if (column->typed[mid] < datum)
+                    low = mid + 1;
+                else
+                    high = mid - 1;
+            }
+            return false;
+
+        case SENTINEL_COMPARE_FIXED:
+            while (low <= high)
+            {
+                int			mid = low + (high - low) / 2;
+                int			cmp = memcmp(column->fixed + mid * column->typlen,
+                                         DatumGetPointer(datum), column->typlen);
+
+                if (cmp == 0)
+                    return true;
+                if (cmp < 0)
+                    low = mid + 1;
+                else
+                    high = mid - 1;
+            }
+            return false;
+
+        case SENTINEL_COMPARE_EQUAL:
+            for (i = 0; i < column->ntyped; i++)
+            {
+                if (DatumGetBool(FunctionCall2Coll(column->equal,
+                                                   column->collation,
+                                                   datum, column->typed[i])))
+                    return true;
+            }
+            return false;
+    }
+
+    return false;
+}
+
+/*
+ * Check a value in the text form COPY sends.
+ */
+bool
+sentinel_column_match_text(const SentinelColumn *column, const char *data,
+                           Size len)
+{
+    if (column->compare == SENTINEL_COMPARE_PATTERN)
+        return sentinel_pattern_match(column->pattern, data, len);
+
+    if (column->text_exact)
+        return sentinel_set_match_exact(column->text_values, data, len);
+
+    return sentinel_set_match(column->text_values, data, len);
+}
+
+/*
+ * Check a value in the binary form COPY sends. That is the raw bytes for
+ * text and bytea, and the value in network byte order for integers and the
+ * like. Values that need their type's equality are not checked.
+ */
+bool
+sentinel_column_match_binary(const SentinelColumn *column, const char *data,
+                             Size len)
+{
+    union
+    {
+        int64		align;
+        char		bytes[sizeof(int64)];
+    }			buf;
+    uint16		u16;
+    uint32		u32;
+    uint64		u64;
+
+    switch (column->compare)
+    {
+        case SENTINEL_COMPARE_BYTES:
+            return sentinel_set_match(column->values, data, len);
+        case SENTINEL_COMPARE_PATTERN:
+            return sentinel_pattern_match(column->pattern, data, len);
+        case SENTINEL_COMPARE_EQUAL:
+            return false;
+        case SENTINEL_COMPARE_WORD:
+        case SENTINEL_COMPARE_FIXED:
+            break;
+    }
+
+    if (len != column->typlen)
+        return false;
+
+    /* uuid and the like are sent as they are stored */
+    if (column->send_raw)
+        return sentinel_column_match_typed(column, PointerGetDatum(data));
+
+    /* integers and the like, from network byte order */
+    switch (len)
+    {
+        case 1:
+            buf.bytes[0] = data[0];
+            break;
+        case 2:
+            memcpy(&u16, data, sizeof(u16));
+            u16 = pg_ntoh16(u16);
+            memcpy(buf.bytes, &u16, sizeof(u16));
+            break;
+        case 4:
+            memcpy(&u32, data, sizeof(u32));
+            u32 = pg_ntoh32(u32);
+            memcpy(buf.bytes, &u32, sizeof(u32));
+            break;
+        case 8:
+            memcpy(&u64, data, sizeof(u64));
+            u64 = pg_ntoh64(u64);
+            memcpy(buf.bytes, &u64, sizeof(u64));
+            break;
+        default:
+            return false;
+    }
+
+    /* by reference on 32-bit builds */
+    if (column->compare == SENTINEL_COMPARE_FIXED)
+        return sentinel_column_match_typed(column, PointerGetDatum(buf.bytes));
+
+    return sentinel_column_match(column, fetch_att(buf.bytes, true, len));
+}
+
+/*
+ * Copy a column with everything it references into the current memory
+ * context, for callers that must not depend on the registry cache.
+ */
+SentinelColumn *
+sentinel_column_copy(const SentinelColumn *column)
+{
+    SentinelColumn *copy = palloc(sizeof(SentinelColumn));
+    int			i;
+
+    *copy = *column;
+
+    if (column->values != NULL)
+    {
+        copy->values = palloc(sentinel_set_size(column->values));
+        memcpy(copy->values, column->values, sentinel_set_size(column->values));
+    }
+    if (column->text_values == column->values)
+        copy->text_values = copy->values;
+    else if (column->text_values != NULL)
+    {
+        copy->text_values = palloc(sentinel_set_size(column->text_values));
+        memcpy(copy->text_values, column->text_values,
+               sentinel_set_size(column->text_values));
+    }
+
+    if (column->typed != NULL)
+    {
+        copy->typed = palloc(sizeof(Datum) * Max(column->ntyped, 1));
+        for (i = 0; i < column->ntyped; i++)
+            copy->typed[i] = datumCopy(column->typed[i], column->typbyval,
+                                       column->typlen);
+    }
+    if (column->fixed != NULL)
+    {
+        copy->fixed = palloc(column->typlen * Max(column->ntyped, 1));
+        memcpy(copy->fixed, column->fixed, column->typlen * column->ntyped);
+    }
+    if (column->equal != NULL)
+    {
+        copy->equal = palloc(sizeof(FmgrInfo));
+        fmgr_info_copy(copy->equal, column->equal, CurrentMemoryContext);
+    }
+    copy->pattern = sentinel_pattern_copy(column->pattern);
+
+    /* the block map belongs to the relation, not to the values */
+    copy->block_map = NULL;
+    copy->block_map_start = 0;
+    copy->block_map_nbits = 0;
+    copy->block_map_shift = 0;
+    copy->row_map = NULL;
+    copy->row_map_ntids = 0;
+
+    return copy;
+}
@@ -0,0 +1,535 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_copy.c
+ *
+ * Checks of COPY <table> TO STDOUT.
+ *
+ * COPY of a table reads the heap itself and never runs the executor, so
+ * none of the executor hooks see its rows. Each row leaves the backend as a
+ * CopyData message of its own, though. While such a COPY runs, the
+ * putmessage method of the protocol layer is wrapped, and each row message
+ * is split into its fields in place and the sentinel fields are compared
+ * before the message is sent. This takes no allocation or copy per row, and
+ * COPY keeps its own fast path.
+ *
+ * Fields are compared the way they are sent: in text format with COPY's
+ * backslash escapes, in CSV format without the surrounding quotes, and in
+ * binary format as the raw values. Columns of types other than text and
+ * the like are matched against the output or binary send form of their
+ * sentinel values. COPY to a file or a program is written by the server
+ * itself and is not covered.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/relation.h"
+#include "catalog/namespace.h"
+#include "commands/defrem.h"
+#include "libpq/libpq.h"
+#include "port/pg_bswap.h"
+#include "tcop/utility.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+
+#include "pg_sentinel.h"
+
+/* Signature, flags and header extension length of binary COPY */
+#define BINARY_HEADER_SIZE	(11 + 4 + 4)
+
+/* A field of the copied rows that holds sentinel values */
+typedef struct CopyField
+{
+    int			field;			/* position in the row, from 0 */
+    SentinelColumn *column;		/* private copy */
+} CopyField;
+
+/* A running COPY TO STDOUT of a sentinel relation */
+typedef struct CopyWatch
+{
+    Oid			relid;
+    uint64		rows;			/* rows sent so far */
+    SentinelRelation *sentinel; /* counts the rows, valid for generation */
+    uint64		generation;
+    char		format;			/* 't'ext, 'c'sv or 'b'inary */
+    char		delim;
+    char		quote;
+    char		escape;
+    bool		skip_header;	/* the next message starts with a header */
+    int			nfields;
+    CopyField  *fields;			/* ascending by field */
+} CopyWatch;
+
+static CopyWatch *active_watch = NULL;
+static const PQcommMethods *prev_comm_methods = NULL;
+static PQcommMethods watch_comm_methods;
+
+static ProcessUtility_hook_type prev_ProcessUtility_hook = NULL;
+
+/*
+ * Find the sentinel column a column of the copied relation holds, if any.
+ * Partitions have the columns of their partitioned ancestors registered
+ * under their own numbers.
+ */
+static SentinelColumn *
+find_column(Relation rel, AttrNumber attnum)
+{
+    Form_pg_attribute att;
+    SentinelColumn *column;
+
+    if (attnum <= 0 || attnum > RelationGetNumberOfAttributes(rel))
+        return NULL;
+
+    att = TupleDescAttr(RelationGetDescr(rel), attnum - 1);
+
+    if (att->attisdropped)
+        return NULL;
+
+    column = sentinel_lookup_column(RelationGetRelid(rel), attnum);
+    if (column == NULL ||
+        !sentinel_column_fits(column, att->atttypid, att->attlen))
+        return NULL;
+
+    return column;
+}
+
+/*
+ * Set up the checks of a COPY TO STDOUT. Returns NULL unless the relation is
+ * a sentinel relation. Its rows count towards the row limits even if none of
+ * the copied columns holds sentinel values.
+ */
+static CopyWatch *
+make_watch(CopyStmt *stmt, Relation rel)
+{
+    TupleDesc	tupdesc = RelationGetDescr(rel);
+    List	   *attnums = NIL;
+    CopyWatch  *watch;
+    bool		header = false;
+    ListCell   *lc;
+    int			field = 0;
+    int			i;
+
+    if (sentinel_lookup_relation(RelationGetRelid(rel)) == NULL)
+        return NULL;
+
+    /* the columns COPY sends, in the order it sends them */
+    if (stmt->attlist == NIL)
+    {
+        for (i = 0; i < tupdesc->natts; i++)
+        {
+            Form_pg_attribute att = TupleDescAttr(tupdesc, i);
+
+            if (!att->attisdropped && !att->attgenerated)
+                attnums = lappend_int(attnums, att->attnum);
+        }
+    }
+    else
+    {
+        foreach(lc, stmt->attlist)
+            attnums = lappend_int(attnums,
+                                  get_attnum(RelationGetRelid(rel),
+                                             strVal(lfirst(lc))));
+    }
+
+    watch = palloc0(sizeof(CopyWatch));
+    watch->relid = RelationGetRelid(rel);
+    watch->fields = palloc(sizeof(CopyField) * list_length(attnums));
+
+    foreach(lc, attnums)
+    {
+        SentinelColumn *column = find_column(rel, lfirst_int(lc));
+
+        /* the registry cache may be rebuilt while COPY runs */
+        if (column != NULL)
+        {
+            CopyField  *copy = &watch->fields[watch->nfields++];
+
+            copy->field = field;
+            copy->column = sentinel_column_copy(column);
+        }
+        field++;
+    }
+
+    /* COPY itself validates the options later */
+    watch->format = 't';
+    watch->delim = '\0';
+    watch->quote = '"';
+    watch->escape = '\0';
+
+    foreach(lc, stmt->options)
+    {
+        DefElem    *def = lfirst_node(DefElem, lc);
+
+        if (strcmp(def->defname, "format") == 0)
+        {
+            char	   *format = defGetString(def);
+
+            if (strcmp(format, "csv") == 0)
+                watch->format = 'c';
+            else if (strcmp(format, "binary") == 0)
+                watch->format = 'b';
+        }
+        else if (strcmp(def->defname, "delimiter") == 0)
+            watch->delim = defGetString(def)[0];
+        else if (strcmp(def->defname, "quote") == 0)
+            watch->quote = defGetString(def)[0];
+        else if (strcmp(def->defname, "escape") == 0)
+            watch->escape = defGetString(def)[0];
+        else if (strcmp(def->defname, "header") == 0)
+        {
+            if (def->arg != NULL && IsA(def->arg, String) &&
+                pg_strcasecmp(strVal(def->arg), "match") == 0)
+                header = true;
+            else
+                header = defGetBoolean(def);
+        }
+    }
+
+    if (watch->delim == '\0')
+        watch->delim = watch->format == 'c' ? ',' : '\t';
+    if (watch->escape == '\0')
+        watch->escape = watch->quote;
+    watch->skip_header = header || watch->format == 'b';
+
+    return watch;
+}
+
+static inline void
+check_field(const CopyWatch *watch, const CopyField *field, const char *data,
+            Size len)
+{
+    bool		match;
+
+    sentinel_count(SENTINEL_STAT_CHECKED, 1);
+    TRACE_PG_SENTINEL_CHECK(watch->relid, 1);
+
+    if (watch->format == 'b')
+        match = sentinel_column_match_binary(field->column, data, len);
+    else
+        match = sentinel_column_match_text(field->column, data, len);
+
+    if (match)
+    {
+        sentinel_count(SENTINEL_STAT_HITS, 1);
+        sentinel_report(field->column->elevel, watch->relid,
+                        field->column->attnum, watch->rows);
+    }
+}
+
+/*
+ * Find the end of a text format field. COPY escapes delimiters that are part
+ * of the data with a backslash.
+ */
+static inline const char *
+text_field_end(const CopyWatch *watch, const char *p, const char *end)
+{
+    for (; p < end; p++)
+    {
+        if (*p == '\\')
+            p++;
+        else if (*p == watch->delim)
+            return p;
+    }
+
+    return end;
+}
+
+/*
+ * Find the end of a CSV format field and the data inside its quotes, if it
+ * has any.
+ */
+static inline const char *
+csv_field_end(const CopyWatch *watch, const char *p, const char *end,
+              const char **data, Size *len)
+{
+    const char *start;
+
+    if (p == end || *p != watch->quote)
+    {
+        start = p;
+        p = memchr(p, watch->delim, end - p);
+        if (p == NULL)
+            p = end;
+        *data = start;
+        *len = p - start;
+        return p;
+    }
+
+    start = ++p;
+    for (; p < end; p++)
+    {
+        if (*p == watch->escape && p + 1 < end &&
+            (p[1] == watch->quote || p[1] == watch->escape))
+            p++;
+        else if (*p == watch->quote)
+            break;
+    }
+    *data = start;
+    *len = p - start;
+
+    return Min(p + 1, end);
+}
+
+/*
+ * Check a row in text or CSV format.
+ */
+static void
+check_text_row(CopyWatch *watch, const char *p, const char *end)
+{
+    int			field;
+    int			k = 0;
+
+    /* the line end */
+    if (end > p && end[-1] == '\n')
+        end--;
+    if (end > p && end[-1] == '\r')
+        end--;
+
+    for (field = 0; k < watch->nfields; field++)
+    {
+        const char *data = p;
+        const char *next;
+        Size		len;
+
+        if (watch->format == 'c')
+            next = csv_field_end(watch, p, end, &data, &len);
+        else
+        {
+            next = text_field_end(watch, p, end);
+            len = next - p;
+        }
+
+        if (field == watch->fields[k].field)
+            check_field(watch, &watch->fields[k++], data, len);
+
+        if (next >= end)
+            break;
+        p = next + 1;
+    }
+}
+
+/*
+ * Check a row in binary format: a field count, then the fields, each a
+ * length and the data. The length of a NULL is -1, so is the field count of
+ * the trailer. Returns whether the message holds a row rather than the
+ * trailer.
+ */
+static bool
+check_binary_row(CopyWatch *watch, const char *p, const char *end)
+{
+    uint16		count;
+    int			nfields;
+    int			field;
+    int			k = 0;
+
+    if (end - p < sizeof(count))
+        return false;
+    memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+    nfields = (int16) pg_ntoh16(count);
+    if (nfields < 0)
+        return false;
+
+    for (field = 0; field < nfields && k < watch->nfields; field++)
+    {
+        uint32		size;
+        int32		len;
+
+        if (end - p < sizeof(size))
+            break;
+        memcpy(&size, p, sizeof(size));
+        p += sizeof(size);
+        len = (int32) pg_ntoh32(size);
+
+        if (len < 0)
+        {
+            if (field == watch->fields[k].field)
+                k++;
+            continue;
+        }
+
+        if (len > end - p)
+            break;
+
+        if (field == watch->fields[k].field)
+            check_field(watch, &watch->fields[k++], p, len);
+        p += len;
+    }
+
+    return true;
+}
+
+/*
+ * Count a row sent for the row limits. The registry cache entry that counts
+ * it is looked up again when the cache has been rebuilt.
+ */
+static inline void
+count_row(CopyWatch *watch)
+{
+    uint64		generation = sentinel_registry_generation();
+
+    if (watch->sentinel == NULL || watch->generation != generation)
+    {
+        watch->sentinel = sentinel_lookup_relation(watch->relid);
+        watch->generation = generation;
+    }
+
+    watch->rows++;
+    if (watch->sentinel != NULL)
+        sentinel_count_row(watch->sentinel);
+}
+
+/*
+ * putmessage method of the protocol layer while a COPY is watched. Sentinel
+ * rows are reported before they are sent.
+ */
+static int
+watch_putmessage(char msgtype, const char *s, size_t len)
+{
+    if (msgtype == 'd' && active_watch != NULL)
+    {
+        CopyWatch  *watch = active_watch;
+        const char *row = s;
+        const char *end = s + len;
+        instr_time	start;
+
+        if (sentinel_track_timing)
+            INSTR_TIME_SET_CURRENT(start);
+
+        if (watch->skip_header)
+        {
+            watch->skip_header = false;
+            if (watch->format == 'b')
+                row += Min(len, BINARY_HEADER_SIZE);
+            else
+                row = end;
+        }
+
+        if (watch->format == 'b')
+        {
+            if (check_binary_row(watch, row, end))
+                count_row(watch);
+        }
+        else if (row < end)
+        {
+            check_text_row(watch, row, end);
+            count_row(watch);
+        }
+
+        if (sentinel_track_timing)
+            sentinel_count_time(start);
+    }
+
+    return prev_comm_methods->putmessage(msgtype, s, len);
+}
+
+/*
+ * Set up the checks if the statement copies a sentinel relation to the
+ * client.
+ */
+static CopyWatch *
+begin_watch(CopyStmt *stmt)
+{
+    Oid			relid;
+    Relation	rel;
+    CopyWatch  *watch;
+
+    /* COPY with a query runs through the executor and is checked there */
+    if (stmt->relation == NULL || stmt->is_from || stmt->filename != NULL)
+        return NULL;
+
+    /* leave errors to COPY */
+    relid = RangeVarGetRelid(stmt->relation, AccessShareLock, true);
+    if (!OidIsValid(relid))
+        return NULL;
+
+    rel = relation_open(relid, NoLock);
+    watch = make_watch(stmt, rel);
+    relation_close(rel, NoLock);
+
+    sentinel_count(watch != NULL ? SENTINEL_STAT_INSPECTED :
+                   SENTINEL_STAT_SKIPPED, 1);
+
+    return watch;
+}
+
+/*
+ * ProcessUtility hook: watch the rows of COPY TO STDOUT of sentinel
+ * relations, and rebuild the maps of relations that a statement rewrites.
+ */
+static void
+sentinel_ProcessUtility(PlannedStmt *pstmt, const char *queryString,
+#if PG_VERSION_NUM >= 140000
+                        bool readOnlyTree,
+#endif
+                        ProcessUtilityContext context, ParamListInfo params,
+                        QueryEnvironment *queryEnv, DestReceiver *dest,
+                        QueryCompletion *qc)
+{
+    CopyWatch  *watch = NULL;
+    CopyWatch  *prev_watch = active_watch;
+    const PQcommMethods *methods = PqCommMethods;
+    List	   *rewritten = sentinel_map_rewritten(pstmt->utilityStmt);
+
+    if (sentinel_check_copy && IsA(pstmt->utilityStmt, CopyStmt) &&
+        !sentinel_session_exempt())
+        watch = begin_watch((CopyStmt *) pstmt->utilityStmt);
+
+    PG_TRY();
+    {
+        if (watch != NULL)
+        {
+            if (PqCommMethods != &watch_comm_methods)
+            {
+                prev_comm_methods = PqCommMethods;
+                watch_comm_methods = *PqCommMethods;
+                watch_comm_methods.putmessage = watch_putmessage;
+                PqCommMethods = &watch_comm_methods;
+            }
+            active_watch = watch;
+        }
+
+        if (prev_ProcessUtility_hook)
+            prev_ProcessUtility_hook(pstmt, queryString,
+#if PG_VERSION_NUM >= 140000
+                                     readOnlyTree,
+#endif
+                                     context, params, queryEnv, dest, qc);
+        else
+            standard_ProcessUtility(pstmt, queryString,
+#if PG_VERSION_NUM >= 140000
+                                    readOnlyTree,
+#endif
+                                    context, params, queryEnv, dest, qc);
+
+        sentinel_map_refresh(rewritten);
+    }
+    PG_FINALLY();
+    {
+        if (watch != NULL)
+        {
+            PqCommMethods = methods;
+            active_watch = prev_watch;
+            sentinel_rows_flush();
+        }
+    }
+    PG_END_TRY();
+}
+
+void
+sentinel_copy_init(void)
+{
+    prev_ProcessUtility_hook = ProcessUtility_hook;
+    ProcessUtility_hook = sentinel_ProcessUtility;
+}
+
+void
+sentinel_copy_fini(void)
+{
+    ProcessUtility_hook = prev_ProcessUtility_hook;
+}
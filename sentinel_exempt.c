@@ -0,0 +1,155 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_exempt.c
+ *
+ * Sessions exempt from the checks.
+ *
+ * pg_sentinel.exempt_roles and pg_sentinel.exempt_databases name the roles
+ * and databases, like trusted ETL or replication jobs, whose statements are
+ * not checked. The names are resolved to OIDs once per session, and whether
+ * the current user is a member of an exempt role is worked out again only
+ * when the user changes, e.g. by SET ROLE, or when role memberships change.
+ * Until then, telling whether a statement is exempt costs a compare.
+ *
+ * Superusers are not taken to be members of every role here, so they are
+ * only exempt if they are listed, like anyone else.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "commands/dbcommands.h"
+#include "miscadmin.h"
+#include "utils/acl.h"
+#include "utils/inval.h"
+#include "utils/memutils.h"
+#include "utils/syscache.h"
+#include "utils/varlena.h"
+
+#include "pg_sentinel.h"
+
+/* The user the exemption was worked out for, and the result */
+Oid			sentinel_exempt_user = InvalidOid;
+bool		sentinel_exempt_result = false;
+
+static bool names_resolved = false;
+static List *exempt_role_oids = NIL;
+static bool database_exempt = false;
+
+static void
+exempt_syscache_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+    /* roles may have been created, renamed or dropped */
+    if (cacheid == AUTHOID)
+        names_resolved = false;
+
+    sentinel_exempt_user = InvalidOid;
+}
+
+/*
+ * Split a setting into its list of names, reporting a malformed list to the
+ * server log rather than to the session.
+ */
+static List *
+split_names(const char *setting, const char *name)
+{
+    List	   *names = NIL;
+
+    if (setting == NULL || setting[0] == '\0')
+        return NIL;
+
+    if (!SplitIdentifierString(pstrdup(setting), ',', &names))
+    {
+        ereport(LOG,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid list syntax in parameter \"%s\"", name)));
+        return NIL;
+    }
+
+    return names;
+}
+
+/*
+ * Resolve the exempt roles and databases. Names that do not exist are
+ * ignored until roles are created or renamed.
+ */
+static void
+resolve_names(void)
+{
+    MemoryContext oldcxt;
+    List	   *roles;
+    ListCell   *lc;
+
+    list_free(exempt_role_oids);
+    exempt_role_oids = NIL;
+    database_exempt = false;
+
+    roles = split_names(sentinel_exempt_roles, "pg_sentinel.exempt_roles");
+    foreach(lc, roles)
+    {
+        Oid			roleid = get_role_oid((char *) lfirst(lc), true);
+
+        if (OidIsValid(roleid))
+        {
+            oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+            exempt_role_oids = lappend_oid(exempt_role_oids, roleid);
+            MemoryContextSwitchTo(oldcxt);
+        }
+    }
+
+    foreach(lc, split_names(sentinel_exempt_databases,
+                            "pg_sentinel.exempt_databases"))
+    {
+        if (get_database_oid((char *) lfirst(lc), true) == MyDatabaseId)
+            database_exempt = true;
+    }
+
+    names_resolved = true;
+}
+
+/*
+ * Work out whether the current user is exempt.
+ */
+void
+sentinel_exempt_refresh(void)
+{
+    Oid			userid = GetUserId();
+    bool		exempt;
+    ListCell   *lc;
+
+    /* the catalogs are only accessible in a transaction */
+    if (!IsTransactionState())
+    {
+        sentinel_exempt_result = false;
+        return;
+    }
+
+    if (!names_resolved)
+        resolve_names();
+
+    exempt = database_exempt;
+    foreach(lc, exempt_role_oids)
+    {
+        if (exempt)
+            break;
+        exempt = is_member_of_role_nosuper(userid, lfirst_oid(lc));
+    }
+
+    sentinel_exempt_result = exempt;
+    sentinel_exempt_user = userid;
+}
+
+void
+sentinel_exempt_init(void)
+{
+    CacheRegisterSyscacheCallback(AUTHOID, exempt_syscache_callback,
+                                  (Datum) 0);
+    CacheRegisterSyscacheCallback(AUTHMEMROLEMEM, exempt_syscache_callback,
+                                  (Datum) 0);
+}
@@ -0,0 +1,304 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_explain.c
+ *
+ * EXPLAIN (SENTINEL) shows what pg_sentinel does to a query.
+ *
+ * Scan nodes of sentinel relations list the sentinel columns they read.
+ * With ANALYZE, the plan is followed by the number of inspections, values
+ * checked, values passed over by block maps and hits, and the time spent
+ * checking if TIMING is on. The inspections are timed and counted with the
+ * executor's own instrumentation, and only while the query runs under
+ * EXPLAIN ANALYZE or the like, so other queries pay a single branch.
+ * Checks done by parallel workers are not included.
+ *
+ * Custom EXPLAIN options need PostgreSQL 18 or later; before that, this
+ * file only provides stubs.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#if PG_VERSION_NUM >= 180000
+#include "commands/defrem.h"
+#include "commands/explain.h"
+#include "commands/explain_format.h"
+#include "commands/explain_state.h"
+#include "lib/ilist.h"
+#include "parser/parsetree.h"
+#include "utils/lsyscache.h"
+#endif
+
+#include "pg_sentinel.h"
+
+#if PG_VERSION_NUM >= 180000
+
+/* The SENTINEL option of an EXPLAIN */
+typedef struct SentinelExplainOptions
+{
+    bool		sentinel;
+} SentinelExplainOptions;
+
+/*
+ * Checks of a query that runs under instrumentation. The entry lives in the
+ * query's es_query_cxt and unlinks itself when that context goes away.
+ */
+typedef struct SentinelExplainQuery
+{
+    dlist_node	node;
+    QueryDesc  *queryDesc;
+    SentinelQueryStats stats;
+    MemoryContextCallback cleanup;
+} SentinelExplainQuery;
+
+static dlist_head explained_queries = DLIST_STATIC_INIT(explained_queries);
+
+static int	explain_extension_id = -1;
+
+static explain_per_plan_hook_type prev_explain_per_plan_hook = NULL;
+static explain_per_node_hook_type prev_explain_per_node_hook = NULL;
+
+static SentinelExplainOptions *
+explain_options(ExplainState *es)
+{
+    return (SentinelExplainOptions *)
+        GetExplainExtensionState(es, explain_extension_id);
+}
+
+static void
+sentinel_option_handler(ExplainState *es, DefElem *opt, ParseState *pstate)
+{
+    SentinelExplainOptions *options = explain_options(es);
+
+    if (options == NULL)
+    {
+        options = palloc0(sizeof(SentinelExplainOptions));
+        SetExplainExtensionState(es, explain_extension_id, options);
+    }
+
+    options->sentinel = defGetBoolean(opt);
+}
+
+static void
+release_explain_query(void *arg)
+{
+    SentinelExplainQuery *query = (SentinelExplainQuery *) arg;
+
+    dlist_delete(&query->node);
+}
+
+static SentinelExplainQuery *
+lookup_explain_query(PlannedStmt *plannedstmt)
+{
+    dlist_iter	iter;
+
+    dlist_foreach(iter, &explained_queries)
+    {
+        SentinelExplainQuery *query =
+            dlist_container(SentinelExplainQuery, node, iter.cur);
+
+        if (query->queryDesc->plannedstmt == plannedstmt)
+            return query;
+    }
+
+    return NULL;
+}
+
+/*
+ * Show the sentinel columns a scan node reads.
+ */
+static void
+sentinel_explain_per_node(PlanState *planstate, List *ancestors,
+                          const char *relationship, const char *plan_name,
+                          ExplainState *es)
+{
+    SentinelExplainOptions *options = explain_options(es);
+    Plan	   *plan = planstate->plan;
+    SentinelRelation *sentinel;
+    Oid			relid;
+    List	   *columns = NIL;
+    int			i;
+
+    if (prev_explain_per_node_hook)
+        prev_explain_per_node_hook(planstate, ancestors, relationship,
+                                   plan_name, es);
+
+    if (options == NULL || !options->sentinel)
+        return;
+
+    switch (nodeTag(plan))
+    {
+        case T_SeqScan:
+        case T_SampleScan:
+        case T_IndexScan:
+        case T_IndexOnlyScan:
+        case T_BitmapHeapScan:
+        case T_TidScan:
+        case T_TidRangeScan:
+        case T_ForeignScan:
+            break;
+        default:
+            return;
+    }
+
+    /* a foreign join or aggregate pushed down scans no single relation */
+    if (((Scan *) plan)->scanrelid == 0)
+        return;
+
+    relid = rt_fetch(((Scan *) plan)->scanrelid, es->rtable)->relid;
+    sentinel = sentinel_lookup_relation(relid);
+    if (sentinel == NULL)
+        return;
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        char	   *name = get_attname(relid, sentinel->columns[i].attnum, true);
+
+        if (name != NULL)
+            columns = lappend(columns, name);
+    }
+
+    ExplainPropertyList("Sentinel Columns", columns, es);
+}
+
+/*
+ * Show what the checks of the query cost, after the plan.
+ */
+static void
+sentinel_explain_per_plan(PlannedStmt *plannedstmt, IntoClause *into,
+                          ExplainState *es, const char *queryString,
+                          ParamListInfo params, QueryEnvironment *queryEnv)
+{
+    SentinelExplainOptions *options = explain_options(es);
+    SentinelExplainQuery *query;
+    Instrumentation *instr;
+
+    if (prev_explain_per_plan_hook)
+        prev_explain_per_plan_hook(plannedstmt, into, es, queryString,
+                                   params, queryEnv);
+
+    if (options == NULL || !options->sentinel || !es->analyze)
+        return;
+
+    query = lookup_explain_query(plannedstmt);
+    if (query == NULL)
+        return;
+
+    instr = query->stats.instr;
+    InstrEndLoop(instr);
+
+    ExplainOpenGroup("Sentinel", "Sentinel", true, es);
+    if (es->format == EXPLAIN_FORMAT_TEXT)
+    {
+        ExplainIndentText(es);
+        appendStringInfoString(es->str, "Sentinel:\n");
+        es->indent++;
+    }
+
+    ExplainPropertyFloat("Inspections", NULL, instr->ntuples, 0, es);
+    ExplainPropertyUInteger("Values Checked", NULL,
+                            query->stats.counters[SENTINEL_STAT_CHECKED], es);
+    ExplainPropertyUInteger("Values Filtered", NULL,
+                            query->stats.counters[SENTINEL_STAT_FILTERED], es);
+    ExplainPropertyUInteger("Hits", NULL,
+                            query->stats.counters[SENTINEL_STAT_HITS], es);
+    if (es->timing)
+        ExplainPropertyFloat("Check Time", "ms", instr->total * 1000.0, 3, es);
+
+    if (es->format == EXPLAIN_FORMAT_TEXT)
+        es->indent--;
+    ExplainCloseGroup("Sentinel", "Sentinel", true, es);
+}
+
+/*
+ * Set up the instrumentation of the checks of a query that needs
+ * inspection and runs instrumented.
+ */
+void
+sentinel_explain_begin(QueryDesc *queryDesc)
+{
+    EState	   *estate = queryDesc->estate;
+    SentinelExplainQuery *query;
+
+    query = MemoryContextAllocZero(estate->es_query_cxt,
+                                   sizeof(SentinelExplainQuery));
+    query->queryDesc = queryDesc;
+    query->stats.instr = MemoryContextAllocZero(estate->es_query_cxt,
+                                                sizeof(Instrumentation));
+    InstrInit(query->stats.instr,
+              queryDesc->instrument_options & INSTRUMENT_TIMER);
+    query->cleanup.func = release_explain_query;
+    query->cleanup.arg = query;
+    MemoryContextRegisterResetCallback(estate->es_query_cxt, &query->cleanup);
+    dlist_push_head(&explained_queries, &query->node);
+}
+
+/*
+ * The instrumentation of the checks of a query, NULL for queries that do
+ * not run instrumented.
+ */
+SentinelQueryStats *
+sentinel_explain_stats(QueryDesc *queryDesc)
+{
+    dlist_iter	iter;
+
+    dlist_foreach(iter, &explained_queries)
+    {
+        SentinelExplainQuery *query =
+            dlist_container(SentinelExplainQuery, node, iter.cur);
+
+        if (query->queryDesc == queryDesc)
+            return &query->stats;
+    }
+
+    return NULL;
+}
+
+void
+sentinel_explain_init(void)
+{
+    explain_extension_id = GetExplainExtensionId("pg_sentinel");
+    RegisterExtensionExplainOption("sentinel", sentinel_option_handler);
+
+    prev_explain_per_plan_hook = explain_per_plan_hook;
+    explain_per_plan_hook = sentinel_explain_per_plan;
+    prev_explain_per_node_hook = explain_per_node_hook;
+    explain_per_node_hook = sentinel_explain_per_node;
+}
+
+void
+sentinel_explain_fini(void)
+{
+    explain_per_plan_hook = prev_explain_per_plan_hook;
+    explain_per_node_hook = prev_explain_per_node_hook;
+}
+
+#else							/* PG_VERSION_NUM < 180000 */
+
+void
+sentinel_explain_begin(QueryDesc *queryDesc)
+{
+}
+
+SentinelQueryStats *
+sentinel_explain_stats(QueryDesc *queryDesc)
+{
+    return NULL;
+}
+
+void
+sentinel_explain_init(void)
+{
+}
+
+void
+sentinel_explain_fini(void)
+{
+}
+
+#endif
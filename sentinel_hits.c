@@ -0,0 +1,528 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_hits.c
+ *
+ * Asynchronous reporting of sentinel hits.
+ *
+ * A backend that finds a sentinel value pushes a record of the hit into a
+ * ring buffer in shared memory and carries on with its defensive action.
+ * The pg_sentinel background worker drains the ring and writes the records
+ * out in batches, to the server log and to the table pg_sentinel.hits, so
+ * the backend never waits for I/O or for locks on the way to the client.
+ *
+ * The ring is a bounded queue of fixed-size slots with many producers and a
+ * single consumer. Every slot carries a sequence number: producers claim a
+ * position with a compare-and-swap on the head and publish the slot by
+ * advancing its sequence, the worker releases it for the next round the
+ * same way. Producers never wait; if the ring is full, the record is
+ * dropped and counted, and the worker reports the number of dropped
+ * records with its next batch.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "libpq/libpq-be.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+#include "pg_sentinel.h"
+
+/* Records the worker collects before writing them out */
+#define HIT_BATCH_SIZE		64
+
+/* Longest wait of the worker for new records, in milliseconds */
+#define HIT_NAPTIME			10000
+
+/* A sentinel hit */
+typedef struct SentinelHit
+{
+    TimestampTz time;
+    int			pid;
+    int			elevel;
+    Oid			relid;
+    AttrNumber	attnum;
+    uint64		queryid;		/* 0 if unknown */
+    uint64		rows;			/* rows the statement produced before */
+    NameData	rolname;
+    NameData	datname;
+    NameData	relname;
+    char		client_addr[64];	/* empty for local connections */
+    int			query_len;		/* of the query text, before truncation */
+    char		query[FLEXIBLE_ARRAY_MEMBER];	/* hit_query_size bytes */
+} SentinelHit;
+
+typedef struct SentinelHitSlot
+{
+    pg_atomic_uint64 sequence;
+    SentinelHit hit;
+} SentinelHitSlot;
+
+typedef struct SentinelHitRing
+{
+    pg_atomic_uint64 head;		/* next position to claim */
+    uint64		tail;			/* next position to drain, worker only */
+    pg_atomic_uint64 dropped;	/* records lost to a full ring */
+    Latch	   *worker_latch;	/* set by the worker, NULL if not running */
+    int			nslots;
+    int			query_size;
+    Size		slot_size;
+    char		slots[FLEXIBLE_ARRAY_MEMBER];
+} SentinelHitRing;
+
+static SentinelHitRing *ring = NULL;
+
+/*
+ * Wait events shown in pg_stat_activity while a backend records a hit and
+ * while the worker writes hit records out, or waits for new ones. Custom
+ * wait events need PostgreSQL 17 or later; before that, they all show up
+ * as Extension.
+ */
+static uint32
+hit_wait_event(const char *name, uint32 *event)
+{
+#if PG_VERSION_NUM >= 170000
+    if (*event == 0)
+        *event = WaitEventExtensionNew(name);
+    return *event;
+#else
+    return PG_WAIT_EXTENSION;
+#endif
+}
+
+static uint32 report_event = 0;
+static uint32 idle_event = 0;
+
+#define WAIT_EVENT_SENTINEL_HIT_REPORT \
+    hit_wait_event("SentinelHitReport", &report_event)
+#define WAIT_EVENT_SENTINEL_HIT_IDLE \
+    hit_wait_event("SentinelHitReporterMain", &idle_event)
+
+PGDLLEXPORT void pg_sentinel_hits_main(Datum main_arg);
+
+static Size
+hit_slot_size(void)
+{
+    return MAXALIGN(offsetof(SentinelHitSlot, hit) +
+                    offsetof(SentinelHit, query) + sentinel_hit_query_size);
+}
+
+static inline SentinelHitSlot *
+hit_slot(uint64 pos)
+{
+    return (SentinelHitSlot *) (ring->slots + (pos % ring->nslots) *
+                                ring->slot_size);
+}
+
+Size
+sentinel_hits_shmem_size(void)
+{
+    if (sentinel_hit_queue_size == 0)
+        return 0;
+
+    return add_size(MAXALIGN(offsetof(SentinelHitRing, slots)),
+                    mul_size(sentinel_hit_queue_size, hit_slot_size()));
+}
+
+/*
+ * Initialize the ring in shared memory. Called from the shared memory
+ * startup hook with AddinShmemInitLock held.
+ */
+void
+sentinel_hits_shmem_startup(void)
+{
+    bool		found;
+    int			i;
+
+    if (sentinel_hit_queue_size == 0)
+        return;
+
+    ring = ShmemInitStruct("pg_sentinel hits", sentinel_hits_shmem_size(),
+                           &found);
+    if (!found)
+    {
+        pg_atomic_init_u64(&ring->head, 0);
+        ring->tail = 0;
+        pg_atomic_init_u64(&ring->dropped, 0);
+        ring->worker_latch = NULL;
+        ring->nslots = sentinel_hit_queue_size;
+        ring->query_size = sentinel_hit_query_size;
+        ring->slot_size = hit_slot_size();
+        for (i = 0; i < ring->nslots; i++)
+            pg_atomic_init_u64(&hit_slot(i)->sequence, i);
+    }
+}
+
+/*
+ * Register the worker that drains the ring. Only possible while the module
+ * is preloaded.
+ */
+void
+sentinel_hits_init(void)
+{
+    BackgroundWorker worker;
+
+    if (!process_shared_preload_libraries_in_progress ||
+        sentinel_hit_queue_size == 0)
+        return;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS;
+    worker.bgw_start_time = BgWorkerStart_PostmasterStart;
+    if (sentinel_hit_database != NULL && sentinel_hit_database[0] != '\0')
+    {
+        worker.bgw_flags |= BGWORKER_BACKEND_DATABASE_CONNECTION;
+        worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    }
+    worker.bgw_restart_time = 10;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_sentinel");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_sentinel_hits_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_sentinel hit reporter");
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_sentinel hit reporter");
+
+    RegisterBackgroundWorker(&worker);
+}
+
+/*
+ * Record a hit for the worker. Does nothing if the module was not preloaded
+ * or the ring is turned off. Never waits: if the ring is full, the record is
+ * dropped.
+ */
+void
+sentinel_hit_push(int elevel, Oid relid, AttrNumber attnum, uint64 rows)
+{
+    SentinelHitSlot *slot;
+    SentinelHit *hit;
+    Latch	   *latch;
+    uint64		pos;
+    char	   *rolname;
+    char	   *datname;
+    char	   *relname;
+
+    if (ring == NULL)
+        return;
+
+    pgstat_report_wait_start(WAIT_EVENT_SENTINEL_HIT_REPORT);
+
+    /*
+     * Look everything up before claiming a slot, which must be published
+     * without fail. All of it is cached by now, so nothing reads from disk.
+     */
+    rolname = GetUserNameFromId(GetUserId(), true);
+    datname = get_database_name(MyDatabaseId);
+    relname = get_rel_name(relid);
+
+    pos = pg_atomic_read_u64(&ring->head);
+    for (;;)
+    {
+        uint64		sequence;
+
+        slot = hit_slot(pos);
+        sequence = pg_atomic_read_u64(&slot->sequence);
+
+        if (sequence == pos)
+        {
+            /* on failure, pos is set to the current head */
+            if (pg_atomic_compare_exchange_u64(&ring->head, &pos, pos + 1))
+                break;
+        }
+        else if (sequence < pos)
+        {
+            /* the slot still holds a record of the previous round */
+            pg_atomic_fetch_add_u64(&ring->dropped, 1);
+            pgstat_report_wait_end();
+            return;
+        }
+        else
+            pos = pg_atomic_read_u64(&ring->head);
+    }
+
+    hit = &slot->hit;
+    hit->time = GetCurrentTimestamp();
+    hit->pid = MyProcPid;
+    hit->elevel = elevel;
+    hit->relid = relid;
+    hit->attnum = attnum;
+#if PG_VERSION_NUM >= 140000
+    hit->queryid = (uint64) pgstat_get_my_query_id();
+#else
+    hit->queryid = 0;
+#endif
+    hit->rows = rows;
+
+    namestrcpy(&hit->rolname, rolname ? rolname : "");
+    namestrcpy(&hit->datname, datname ? datname : "");
+    namestrcpy(&hit->relname, relname ? relname : "");
+
+    if (MyProcPort != NULL && MyProcPort->remote_host != NULL)
+        strlcpy(hit->client_addr, MyProcPort->remote_host,
+                sizeof(hit->client_addr));
+    else
+        hit->client_addr[0] = '\0';
+
+    hit->query_len = debug_query_string ? strlen(debug_query_string) : 0;
+    strlcpy(hit->query, debug_query_string ? debug_query_string : "",
+            ring->query_size);
+
+    /* publish the record, then wake the worker */
+    pg_write_barrier();
+    pg_atomic_write_u64(&slot->sequence, pos + 1);
+
+    latch = ring->worker_latch;
+    if (latch != NULL)
+        SetLatch(latch);
+
+    pgstat_report_wait_end();
+}
+
+static const char *
+hit_action(int elevel)
+{
+    if (elevel >= FATAL)
+        return "fatal";
+    if (elevel >= ERROR)
+        return "error";
+
+    return "warning";
+}
+
+/*
+ * Copy up to HIT_BATCH_SIZE records out of the ring, releasing their slots.
+ * Returns the number of records copied.
+ */
+static int
+drain_ring(SentinelHit *batch)
+{
+    Size		hit_size = offsetof(SentinelHit, query) + ring->query_size;
+    int			n = 0;
+
+    while (n < HIT_BATCH_SIZE)
+    {
+        SentinelHitSlot *slot = hit_slot(ring->tail);
+
+        if (pg_atomic_read_u64(&slot->sequence) != ring->tail + 1)
+            break;
+
+        /* read the record only after seeing it published */
+        pg_read_barrier();
+        memcpy((char *) batch + n * hit_size, &slot->hit, hit_size);
+
+        /* and hand the slot over only after reading it */
+        pg_memory_barrier();
+        pg_atomic_write_u64(&slot->sequence, ring->tail + ring->nslots);
+        ring->tail++;
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Write a batch of records to the server log.
+ */
+static void
+log_hits(SentinelHit *batch, int n)
+{
+    Size		hit_size = offsetof(SentinelHit, query) + ring->query_size;
+    int			i;
+
+    for (i = 0; i < n; i++)
+    {
+        SentinelHit *hit = (SentinelHit *) ((char *) batch + i * hit_size);
+
+        ereport(LOG,
+                (errmsg("pg_sentinel hit: action=%s relation=%s(%u) attnum=%d "
+                        "role=%s database=%s client=%s pid=%d queryid=" UINT64_FORMAT
+                        " rows=" UINT64_FORMAT " at %s",
+                        hit_action(hit->elevel), NameStr(hit->relname),
+                        hit->relid, hit->attnum, NameStr(hit->rolname),
+                        NameStr(hit->datname),
+                        hit->client_addr[0] ? hit->client_addr : "local",
+                        hit->pid, hit->queryid, hit->rows,
+                        timestamptz_to_str(hit->time)),
+                 errdetail("Query: %s%s", hit->query,
+                           hit->query_len >= ring->query_size ? "..." : ""),
+                 errhidestmt(true),
+                 errhidecontext(true)));
+    }
+}
+
+/*
+ * Write a batch of records to pg_sentinel.hits, in one transaction. Returns
+ * false if the extension is not installed in the worker's database.
+ */
+static bool
+store_hits(SentinelHit *batch, int n)
+{
+    Size		hit_size = offsetof(SentinelHit, query) + ring->query_size;
+    Oid			argtypes[12] = {TIMESTAMPTZOID, INT4OID, TEXTOID, NAMEOID,
+                                NAMEOID, OIDOID, NAMEOID, INT2OID, INT8OID,
+                                TEXTOID, INT8OID, TEXTOID};
+    Datum		values[12];
+    char		nulls[12];
+    bool		installed;
+    int			i;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "storing pg_sentinel hits");
+
+    installed = OidIsValid(get_namespace_oid("pg_sentinel", true)) &&
+        OidIsValid(get_relname_relid("hits", get_namespace_oid("pg_sentinel",
+                                                                true)));
+
+    for (i = 0; installed && i < n; i++)
+    {
+        SentinelHit *hit = (SentinelHit *) ((char *) batch + i * hit_size);
+
+        memset(nulls, ' ', sizeof(nulls));
+        values[0] = TimestampTzGetDatum(hit->time);
+        values[1] = Int32GetDatum(hit->pid);
+        values[2] = CStringGetTextDatum(hit_action(hit->elevel));
+        values[3] = NameGetDatum(&hit->rolname);
+        values[4] = NameGetDatum(&hit->datname);
+        values[5] = ObjectIdGetDatum(hit->relid);
+        values[6] = NameGetDatum(&hit->relname);
+        values[7] = Int16GetDatum(hit->attnum);
+        values[8] = Int64GetDatum((int64) hit->queryid);
+        if (hit->queryid == 0)
+            nulls[8] = 'n';
+        values[9] = CStringGetTextDatum(hit->client_addr);
+        if (hit->client_addr[0] == '\0')
+            nulls[9] = 'n';
+        values[10] = Int64GetDatum((int64) hit->rows);
+        values[11] = CStringGetTextDatum(hit->query);
+
+        if (SPI_execute_with_args("INSERT INTO pg_sentinel.hits "
+                                  "(hit_time, pid, action, role, database, "
+                                  "relid, relname, attnum, query_id, "
+                                  "client_addr, rows_before, query) "
+                                  "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, "
+                                  "$9, $10, $11, $12)",
+                                  12, argtypes, values, nulls, false,
+                                  0) != SPI_OK_INSERT)
+            elog(ERROR, "could not store pg_sentinel hits");
+    }
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
+    pgstat_report_activity(STATE_IDLE, NULL);
+
+    return installed;
+}
+
+static void
+clear_worker_latch(int code, Datum arg)
+{
+    ring->worker_latch = NULL;
+}
+
+/*
+ * Main loop of the worker. Wakes up when a backend pushed a record, writes
+ * out everything in the ring, and on shutdown drains the ring once more.
+ */
+void
+pg_sentinel_hits_main(Datum main_arg)
+{
+    SentinelHit *batch;
+    bool		connected = false;
+    bool		warned = false;
+    uint64		dropped = 0;
+
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, SignalHandlerForShutdownRequest);
+    BackgroundWorkerUnblockSignals();
+
+    if (ring == NULL)
+        proc_exit(0);
+
+    if (sentinel_hit_database != NULL && sentinel_hit_database[0] != '\0')
+    {
+        BackgroundWorkerInitializeConnection(sentinel_hit_database, NULL, 0);
+        connected = true;
+    }
+
+    batch = palloc(HIT_BATCH_SIZE *
+                   (offsetof(SentinelHit, query) + ring->query_size));
+
+    on_shmem_exit(clear_worker_latch, (Datum) 0);
+    ring->worker_latch = MyLatch;
+
+    for (;;)
+    {
+        bool		shutdown = ShutdownRequestPending;
+        uint64		lost;
+        int			n;
+
+        ResetLatch(MyLatch);
+
+        if (ConfigReloadPending)
+        {
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
+        }
+
+        while ((n = drain_ring(batch)) > 0)
+        {
+            bool		stored = true;
+
+            pgstat_report_wait_start(WAIT_EVENT_SENTINEL_HIT_REPORT);
+            if (sentinel_hit_log)
+                log_hits(batch, n);
+            if (connected)
+                stored = store_hits(batch, n);
+            pgstat_report_wait_end();
+
+            if (!stored && !warned)
+            {
+                ereport(WARNING,
+                        (errmsg("pg_sentinel is not installed in database \"%s\", hits are not stored",
+                                sentinel_hit_database)));
+                warned = true;
+            }
+        }
+
+        lost = pg_atomic_read_u64(&ring->dropped);
+        if (lost != dropped)
+        {
+            ereport(LOG,
+                    (errmsg("pg_sentinel dropped " UINT64_FORMAT " hit records, the hit queue was full",
+                            lost - dropped),
+                     errhint("Consider increasing pg_sentinel.hit_queue_size.")));
+            dropped = lost;
+        }
+
+        if (shutdown)
+            break;
+
+        (void) WaitLatch(MyLatch,
+                         WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                         HIT_NAPTIME, WAIT_EVENT_SENTINEL_HIT_IDLE);
+    }
+
+    proc_exit(0);
+}
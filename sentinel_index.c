@@ -0,0 +1,363 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_index.c
+ *
+ * Checks of index-only scans of sentinel relations.
+ *
+ * An index-only scan returns the values it finds in the index, without the
+ * heap tuple, so its tuples carry no relation for the executor and dest
+ * mode checks, and sentinel columns that are not in the index are not
+ * available to scan mode checks. Instead, ExecutorStart hooks every
+ * index-only scan of a sentinel relation into the tuples it returns.
+ *
+ * A sentinel column that is an index column is checked on the index tuple,
+ * which takes no heap access at all. For any other column, the heap tuple
+ * the index entry points to is fetched, but only if the column's block map
+ * says that its block may hold a sentinel value, or its row map has the
+ * tid, so the scan keeps its visibility map driven speed for all other
+ * blocks. Without a map, such a column would cost a heap fetch per tuple,
+ * which is what the index-only scan avoids, so it is not checked, and the
+ * server log says so once. Columns the scan's quals already check, in scan
+ * and qual mode, are left to them.
+ *
+ * Like the checks in the plan, this checks the tuples a scan reads, which
+ * need not be emitted, so it only serves scan and qual mode and the scans of
+ * parallel workers. Executor and dest mode inspect the emitted tuples only,
+ * whatever the plan.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/relscan.h"
+#include "access/tableam.h"
+#include "executor/executor.h"
+#include "lib/ilist.h"
+#include "nodes/bitmapset.h"
+#include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
+#include "utils/rel.h"
+
+#include "pg_sentinel.h"
+
+/* A sentinel column an index-only scan returns tuples of */
+typedef struct IndexCheck
+{
+    SentinelColumn *column;
+    AttrNumber	indexcol;		/* InvalidAttrNumber: fetch the heap tuple */
+} IndexCheck;
+
+/*
+ * A hooked index-only scan. The entry lives in the query's es_query_cxt and
+ * unlinks itself when that context goes away.
+ */
+typedef struct SentinelIndexScan
+{
+    dlist_node	node;
+    IndexOnlyScanState *state;
+    ExecProcNodeMtd real;		/* the scan's own ExecProcNode */
+    Oid			relid;
+    Bitmapset  *qual_checked;	/* attnums the scan's quals check */
+    uint64		generation;		/* registry generation of checks */
+    int			nchecks;
+    IndexCheck *checks;
+    MemoryContextCallback cleanup;
+} SentinelIndexScan;
+
+static dlist_head index_scans = DLIST_STATIC_INIT(index_scans);
+
+/* The scan that returned the last tuple, which most likely returns the next */
+static SentinelIndexScan *last_scan = NULL;
+
+static void
+release_index_scan(void *arg)
+{
+    SentinelIndexScan *scan = (SentinelIndexScan *) arg;
+
+    if (last_scan == scan)
+        last_scan = NULL;
+    dlist_delete(&scan->node);
+}
+
+static SentinelIndexScan *
+lookup_index_scan(PlanState *pstate)
+{
+    dlist_iter	iter;
+
+    if (last_scan != NULL && (PlanState *) last_scan->state == pstate)
+        return last_scan;
+
+    dlist_foreach(iter, &index_scans)
+    {
+        SentinelIndexScan *scan =
+            dlist_container(SentinelIndexScan, node, iter.cur);
+
+        if ((PlanState *) scan->state == pstate)
+        {
+            last_scan = scan;
+            return scan;
+        }
+    }
+
+    elog(ERROR, "pg_sentinel: index-only scan not registered");
+    return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Work out the checks of a scan for the current registry cache.
+ */
+static void
+resolve_checks(SentinelIndexScan *scan, uint64 generation)
+{
+    IndexOnlyScanState *state = scan->state;
+    IndexOnlyScan *plan = (IndexOnlyScan *) state->ss.ps.plan;
+    TupleDesc	index_desc = state->ss.ss_ScanTupleSlot->tts_tupleDescriptor;
+    TupleDesc	heap_desc = RelationGetDescr(state->ss.ss_currentRelation);
+    SentinelRelation *sentinel = sentinel_lookup_relation(scan->relid);
+    int			i;
+
+    scan->generation = generation;
+    scan->nchecks = 0;
+    if (sentinel == NULL)
+        return;
+
+    scan->checks = MemoryContextAlloc(state->ss.ps.state->es_query_cxt,
+                                      sizeof(IndexCheck) * sentinel->ncolumns);
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        SentinelColumn *column = &sentinel->columns[i];
+        AttrNumber	indexcol;
+        Form_pg_attribute att;
+
+        if (bms_is_member(column->attnum, scan->qual_checked))
+            continue;
+
+        indexcol = sentinel_index_column(plan, column->attnum);
+        if (indexcol != InvalidAttrNumber)
+            att = TupleDescAttr(index_desc, indexcol - 1);
+        else if (column->block_map == NULL)
+        {
+            if (!column->index_logged)
+            {
+                column->index_logged = true;
+                ereport(LOG,
+                        (errmsg("pg_sentinel: index-only scans of \"%s\" do not check column %d",
+                                RelationGetRelationName(state->ss.ss_currentRelation),
+                                column->attnum),
+                         errdetail("The column is not in the index and has no block map."),
+                         errhint("Build a block map with pg_sentinel.pg_sentinel_rebuild_map(), or add the column to the index.")));
+            }
+            continue;
+        }
+        else if (column->attnum > 0 && column->attnum <= heap_desc->natts)
+            att = TupleDescAttr(heap_desc, column->attnum - 1);
+        else
+            continue;
+
+        if (!sentinel_column_fits(column, att->atttypid, att->attlen))
+            continue;
+
+        scan->checks[scan->nchecks].column = column;
+        scan->checks[scan->nchecks].indexcol = indexcol;
+        scan->nchecks++;
+    }
+}
+
+/*
+ * Fetch the heap tuple the current index entry points to into the scan's
+ * table slot, following its HOT chain to the version the scan sees.
+ */
+static bool
+fetch_heap_tuple(IndexOnlyScanState *state)
+{
+    IndexScanDesc scandesc = state->ioss_ScanDesc;
+    bool		call_again = false;
+    bool		all_dead = false;
+
+    return table_index_fetch_tuple(scandesc->xs_heapfetch,
+                                   &scandesc->xs_heaptid,
+                                   scandesc->xs_snapshot,
+                                   state->ioss_TableSlot,
+                                   &call_again, &all_dead);
+}
+
+/*
+ * Check the tuple an index-only scan is about to return.
+ */
+static void
+check_index_tuple(SentinelIndexScan *scan)
+{
+    IndexOnlyScanState *state = scan->state;
+    uint64		generation = sentinel_registry_generation();
+    bool		fetched = false;
+    bool		found = false;
+    int			checked = 0;
+    instr_time	start;
+    int			i;
+
+    if (scan->generation != generation)
+        resolve_checks(scan, generation);
+
+    if (scan->nchecks == 0)
+        return;
+
+    if (sentinel_track_timing)
+        INSTR_TIME_SET_CURRENT(start);
+    sentinel_explain_start();
+
+    for (i = 0; i < scan->nchecks; i++)
+    {
+        SentinelColumn *column = scan->checks[i].column;
+        Datum		datum;
+        bool		isnull;
+
+        /* rows outside the row map are passed on, without fetching them */
+        if (column->row_map != NULL &&
+            ItemPointerIsValid(&state->ioss_ScanDesc->xs_heaptid) &&
+            !sentinel_column_is_row(column, &state->ioss_ScanDesc->xs_heaptid))
+        {
+            sentinel_count(SENTINEL_STAT_FILTERED, 1);
+            continue;
+        }
+
+        if (scan->checks[i].indexcol != InvalidAttrNumber)
+            datum = slot_getattr(state->ss.ss_ScanTupleSlot,
+                                 scan->checks[i].indexcol, &isnull);
+        else
+        {
+            if (!sentinel_column_covers(column,
+                                        &state->ioss_ScanDesc->xs_heaptid))
+            {
+                sentinel_count(SENTINEL_STAT_FILTERED, 1);
+                continue;
+            }
+
+            if (!fetched)
+            {
+                fetched = true;
+                found = fetch_heap_tuple(state);
+            }
+            if (!found)
+                continue;
+
+            datum = slot_getattr(state->ioss_TableSlot, column->attnum,
+                                 &isnull);
+        }
+
+        if (isnull)
+            continue;
+
+        sentinel_count(SENTINEL_STAT_CHECKED, 1);
+        checked++;
+
+        if (sentinel_column_match(column, datum))
+        {
+            sentinel_count(SENTINEL_STAT_HITS, 1);
+            sentinel_report(column->elevel, scan->relid, column->attnum,
+                            sentinel_rows_processed());
+        }
+    }
+
+    /* drop the buffer pin, as the scan does after its own heap fetches */
+    if (fetched)
+        ExecClearTuple(state->ioss_TableSlot);
+
+    TRACE_PG_SENTINEL_CHECK(scan->relid, checked);
+    sentinel_explain_stop();
+    if (sentinel_track_timing)
+        sentinel_count_time(start);
+}
+
+/*
+ * ExecProcNode of a hooked index-only scan.
+ */
+static TupleTableSlot *
+sentinel_index_only_next(PlanState *pstate)
+{
+    SentinelIndexScan *scan = lookup_index_scan(pstate);
+    TupleTableSlot *slot = scan->real(pstate);
+
+    if (!TupIsNull(slot))
+        check_index_tuple(scan);
+
+    return slot;
+}
+
+static void
+protect_index_only_scan(IndexOnlyScanState *state, Oid funcid)
+{
+    EState	   *estate = state->ss.ps.state;
+    Oid			relid = RelationGetRelid(state->ss.ss_currentRelation);
+    SentinelIndexScan *scan;
+    MemoryContext oldcxt;
+
+    if (sentinel_lookup_relation(relid) == NULL)
+        return;
+
+    oldcxt = MemoryContextSwitchTo(estate->es_query_cxt);
+
+    scan = palloc0(sizeof(SentinelIndexScan));
+    scan->state = state;
+    scan->real = state->ss.ps.ExecProcNodeReal;
+    scan->relid = relid;
+    scan->qual_checked = OidIsValid(funcid) ?
+        sentinel_checked_columns(state->ss.ps.plan, funcid) : NULL;
+    scan->generation = sentinel_registry_generation() - 1;
+    scan->cleanup.func = release_index_scan;
+    scan->cleanup.arg = scan;
+    MemoryContextRegisterResetCallback(estate->es_query_cxt, &scan->cleanup);
+    dlist_push_head(&index_scans, &scan->node);
+
+    MemoryContextSwitchTo(oldcxt);
+
+    /* the first call still goes through ExecProcNodeFirst() */
+    ExecSetExecProcNode(&state->ss.ps, sentinel_index_only_next);
+}
+
+typedef struct ProtectContext
+{
+    Oid			funcid;			/* check function of the plan */
+    bool		protect;		/* else only below Gather and Gather Merge */
+} ProtectContext;
+
+static bool
+protect_walker(PlanState *planstate, ProtectContext *context)
+{
+    if (planstate == NULL)
+        return false;
+
+    if (context->protect && IsA(planstate, IndexOnlyScanState))
+        protect_index_only_scan((IndexOnlyScanState *) planstate,
+                                context->funcid);
+
+    if (!context->protect &&
+        (IsA(planstate, GatherState) || IsA(planstate, GatherMergeState)))
+    {
+        ProtectContext parallel = {context->funcid, true};
+
+        return planstate_tree_walker(planstate, protect_walker, &parallel);
+    }
+
+    return planstate_tree_walker(planstate, protect_walker, context);
+}
+
+/*
+ * Hook the index-only scans of sentinel relations in a query that has just
+ * been started. funcid is the check function the plan was made with. With
+ * parallel_only, only the scans of the parallel part of the plan are
+ * hooked, as in the leader in executor and dest mode.
+ */
+void
+sentinel_protect_index_scans(QueryDesc *queryDesc, Oid funcid,
+                             bool parallel_only)
+{
+    ProtectContext context = {funcid, !parallel_only};
+
+    protect_walker(queryDesc->planstate, &context);
+}
@@ -0,0 +1,604 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_map.c
+ *
+ * Block maps and row maps of sentinel relations.
+ *
+ * Sentinel rows usually sit in a few heap blocks of an otherwise large
+ * table. pg_sentinel_rebuild_map() scans the relation once and records, per
+ * registered column, the blocks that hold a sentinel value, so the checks
+ * can pass over the tuples of all other blocks after a single bit test. A
+ * trigger on the relation adds the blocks of sentinel rows that are inserted
+ * or updated later, and a map no longer applies once the relation has been
+ * rewritten, e.g. by VACUUM FULL, CLUSTER or TRUNCATE. After those,
+ * the maps of the relations they name are rebuilt right away.
+ *
+ * For columns registered by_tid, the rebuild also records the exact tids of
+ * the sentinel rows, the row map, and the checks then look a tuple's tid up
+ * before reading the column, which they only do for the tids in the map.
+ * The trigger adds the tids of new sentinel row versions, and drops a tid
+ * once it is reused for a tuple that holds no sentinel value, which can only
+ * happen through an insert or an update. That happens after the tuple is
+ * visible to others, and a map may hold the tids of deleted rows, so the
+ * map only tells which tuples need to be checked, never that one is a hit.
+ *
+ * Only tids are recorded, so maps work for any table access method. Those
+ * of columnar ones usually number rows, and their blocks are then ranges of
+ * rows, which the registry cache may coarsen further, see set_block_map().
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/tableam.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_type.h"
+#include "commands/defrem.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "executor/tuptable.h"
+#include "miscadmin.h"
+#include "nodes/parsenodes.h"
+#include "storage/bufmgr.h"
+#include "storage/procarray.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+
+#include "pg_sentinel.h"
+
+#define BLOCK_MAP_TRIGGER	"pg_sentinel_block_map"
+
+/* A column being mapped by pg_sentinel_rebuild_map() */
+typedef struct MapColumn
+{
+    SentinelColumn *column;		/* private copy */
+    Datum	   *blocks;			/* int8 block numbers, ascending */
+    int			nblocks;
+    int			maxblocks;
+    ItemPointerData *tids;		/* sentinel rows, by_tid columns only */
+    int			ntids;
+    int			maxtids;
+} MapColumn;
+
+PG_FUNCTION_INFO_V1(pg_sentinel_rebuild_map);
+PG_FUNCTION_INFO_V1(pg_sentinel_block_map_maintain);
+
+static bool
+column_fits(Relation rel, const SentinelColumn *column)
+{
+    Form_pg_attribute att;
+
+    if (column->attnum <= 0 ||
+        column->attnum > RelationGetNumberOfAttributes(rel))
+        return false;
+
+    att = TupleDescAttr(RelationGetDescr(rel), column->attnum - 1);
+
+    return !att->attisdropped &&
+        sentinel_column_fits(column, att->atttypid, att->attlen);
+}
+
+/*
+ * Store the block map and, for a by_tid column, the row map of one column
+ * in the registry.
+ */
+static void
+store_block_map(Oid relid, Oid relfilenode, MapColumn *column)
+{
+    Oid			argtypes[5] = {INT8ARRAYOID, OIDOID, REGCLASSOID, INT2OID,
+                               TIDARRAYOID};
+    Datum		values[5];
+    char		nulls[5] = {' ', ' ', ' ', ' ', 'n'};
+
+    values[0] = PointerGetDatum(construct_array(column->blocks, column->nblocks,
+                                                INT8OID, sizeof(int64),
+                                                FLOAT8PASSBYVAL,
+                                                TYPALIGN_DOUBLE));
+    values[1] = ObjectIdGetDatum(relfilenode);
+    values[2] = ObjectIdGetDatum(relid);
+    values[3] = Int16GetDatum(column->column->attnum);
+    values[4] = (Datum) 0;
+
+    if (column->tids != NULL)
+    {
+        Datum	   *tids = palloc(sizeof(Datum) * Max(column->ntids, 1));
+        int			i;
+
+        for (i = 0; i < column->ntids; i++)
+            tids[i] = ItemPointerGetDatum(&column->tids[i]);
+        values[4] = PointerGetDatum(construct_array(tids, column->ntids,
+                                                    TIDOID,
+                                                    sizeof(ItemPointerData),
+                                                    false, TYPALIGN_SHORT));
+        nulls[4] = ' ';
+    }
+
+    if (SPI_execute_with_args("UPDATE pg_sentinel.sentinels "
+                              "SET block_map = $1, block_map_relfilenode = $2, "
+                              "row_map = $5 "
+                              "WHERE relid OPERATOR(pg_catalog.=) $3 "
+                              "AND attnum OPERATOR(pg_catalog.=) $4",
+                              5, argtypes, values, nulls, false, 0) != SPI_OK_UPDATE)
+        elog(ERROR, "could not store the block map of relation %u", relid);
+}
+
+/*
+ * Install the trigger that keeps the maps of a relation current, unless it
+ * is there already. It fires in replica mode as well.
+ */
+static void
+install_trigger(Relation rel)
+{
+    Oid			argtypes[1] = {OIDOID};
+    Datum		values[1];
+    char	   *name;
+
+    values[0] = ObjectIdGetDatum(RelationGetRelid(rel));
+    if (SPI_execute_with_args("SELECT 1 FROM pg_catalog.pg_trigger "
+                              "WHERE tgrelid OPERATOR(pg_catalog.=) $1 "
+                              "AND tgname OPERATOR(pg_catalog.=) '" BLOCK_MAP_TRIGGER "'",
+                              1, argtypes, values, NULL, true, 1) != SPI_OK_SELECT)
+        elog(ERROR, "could not look up trigger \"%s\"", BLOCK_MAP_TRIGGER);
+    if (SPI_processed > 0)
+        return;
+
+    name = quote_qualified_identifier(get_namespace_name(RelationGetNamespace(rel)),
+                                      RelationGetRelationName(rel));
+
+    if (SPI_execute(psprintf("CREATE TRIGGER " BLOCK_MAP_TRIGGER
+                             " AFTER INSERT OR UPDATE ON %s FOR EACH ROW"
+                             " EXECUTE FUNCTION pg_sentinel.block_map_maintain()",
+                             name), false, 0) != SPI_OK_UTILITY ||
+        SPI_execute(psprintf("ALTER TABLE %s ENABLE ALWAYS TRIGGER "
+                             BLOCK_MAP_TRIGGER, name), false, 0) != SPI_OK_UTILITY)
+        elog(ERROR, "could not create trigger \"%s\"", BLOCK_MAP_TRIGGER);
+}
+
+/*
+ * Map the blocks of a relation that hold sentinel values of its registered
+ * columns, and the sentinel rows of its by_tid columns, and return the total
+ * number of blocks mapped. All tuple versions still present count, since
+ * older snapshots may see them, but not dead ones: those of aborted inserts
+ * may have lost their TOAST values already, and nothing can see them. Only
+ * heap tuples tell whether they are dead, so other access methods are
+ * scanned with a fresh snapshot, which misses the rows of recent deletes
+ * that older snapshots still see.
+ */
+static int64
+rebuild_maps(Oid relid)
+{
+    Relation	rel;
+    SentinelRelation *sentinel;
+    MapColumn  *columns;
+    int			ncolumns = 0;
+    TableScanDesc scan;
+    TupleTableSlot *slot;
+    Snapshot	snapshot;
+    TransactionId oldest_xmin = InvalidTransactionId;
+    bool		by_vacuum;
+    int64		total = 0;
+    int			i;
+
+    /* keep writers out until the trigger takes over */
+    rel = table_open(relid, ShareRowExclusiveLock);
+
+    if (rel->rd_rel->relkind != RELKIND_RELATION &&
+        rel->rd_rel->relkind != RELKIND_MATVIEW)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a table or materialized view",
+                        RelationGetRelationName(rel))));
+
+    sentinel = sentinel_lookup_relation(relid);
+    if (sentinel == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("relation \"%s\" has no sentinel columns",
+                        RelationGetRelationName(rel))));
+
+    /* the registry cache may be rebuilt while we scan, so copy the columns */
+    columns = palloc(sizeof(MapColumn) * sentinel->ncolumns);
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        SentinelColumn *column = &sentinel->columns[i];
+        MapColumn  *map = &columns[ncolumns];
+
+        /* only columns registered for the relation itself store a map */
+        if (column->inherited || !column_fits(rel, column))
+            continue;
+
+        map->column = sentinel_column_copy(column);
+        map->maxblocks = 16;
+        map->blocks = palloc(sizeof(Datum) * map->maxblocks);
+        map->nblocks = 0;
+        map->tids = NULL;
+        map->ntids = 0;
+        map->maxtids = 0;
+        if (column->by_tid)
+        {
+            map->maxtids = 16;
+            map->tids = palloc(sizeof(ItemPointerData) * map->maxtids);
+        }
+        ncolumns++;
+    }
+
+    /* no synchronized scan, so blocks come in ascending order */
+    slot = table_slot_create(rel, NULL);
+    by_vacuum = TTS_IS_BUFFERTUPLE(slot);
+    if (by_vacuum)
+    {
+        snapshot = SnapshotAny;
+#if PG_VERSION_NUM >= 140000
+        oldest_xmin = GetOldestNonRemovableTransactionId(rel);
+#else
+        oldest_xmin = GetOldestXmin(rel, PROCARRAY_FLAGS_VACUUM);
+#endif
+    }
+    else
+        snapshot = RegisterSnapshot(GetLatestSnapshot());
+    scan = table_beginscan_strat(rel, snapshot, 0, NULL, true, false);
+
+    while (table_scan_getnextslot(scan, ForwardScanDirection, slot))
+    {
+        BlockNumber block = ItemPointerGetBlockNumber(&slot->tts_tid);
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (by_vacuum)
+        {
+            BufferHeapTupleTableSlot *hslot = (BufferHeapTupleTableSlot *) slot;
+            HTSV_Result result;
+
+            LockBuffer(hslot->buffer, BUFFER_LOCK_SHARE);
+            result = HeapTupleSatisfiesVacuum(hslot->base.tuple, oldest_xmin,
+                                              hslot->buffer);
+            LockBuffer(hslot->buffer, BUFFER_LOCK_UNLOCK);
+
+            if (result == HEAPTUPLE_DEAD)
+                continue;
+        }
+
+        for (i = 0; i < ncolumns; i++)
+        {
+            MapColumn  *map = &columns[i];
+            Datum		datum;
+            bool		isnull;
+            bool		mapped;
+
+            /* a row map needs every sentinel row, a block map one per block */
+            mapped = map->nblocks > 0 &&
+                DatumGetInt64(map->blocks[map->nblocks - 1]) == (int64) block;
+            if (mapped && map->tids == NULL)
+                continue;
+
+            datum = slot_getattr(slot, map->column->attnum, &isnull);
+            if (isnull || !sentinel_column_match(map->column, datum))
+                continue;
+
+            if (!mapped)
+            {
+                if (map->nblocks == map->maxblocks)
+                {
+                    map->maxblocks *= 2;
+                    map->blocks = repalloc(map->blocks,
+                                           sizeof(Datum) * map->maxblocks);
+                }
+                map->blocks[map->nblocks++] = Int64GetDatum((int64) block);
+            }
+
+            if (map->tids != NULL)
+            {
+                if (map->ntids == map->maxtids)
+                {
+                    map->maxtids *= 2;
+                    map->tids = repalloc(map->tids,
+                                         sizeof(ItemPointerData) * map->maxtids);
+                }
+                map->tids[map->ntids++] = slot->tts_tid;
+            }
+        }
+    }
+
+    table_endscan(scan);
+    if (!by_vacuum)
+        UnregisterSnapshot(snapshot);
+    ExecDropSingleTupleTableSlot(slot);
+
+    SPI_connect();
+    for (i = 0; i < ncolumns; i++)
+    {
+        store_block_map(relid, rel->rd_rel->relfilenode, &columns[i]);
+        total += columns[i].nblocks;
+    }
+    install_trigger(rel);
+    SPI_finish();
+
+    table_close(rel, NoLock);
+
+    return total;
+}
+
+/*
+ * pg_sentinel_rebuild_map(regclass)
+ */
+Datum
+pg_sentinel_rebuild_map(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_INT64(rebuild_maps(PG_GETARG_OID(0)));
+}
+
+/*
+ * Apply a change to the map of one column in the registry.
+ */
+static void
+update_map(const char *sql, Oid relid, int attnum, Oid argtype, Datum arg)
+{
+    Oid			argtypes[3] = {REGCLASSOID, INT2OID, argtype};
+    Datum		values[3];
+
+    values[0] = ObjectIdGetDatum(relid);
+    values[1] = Int16GetDatum((int16) attnum);
+    values[2] = arg;
+
+    if (SPI_execute_with_args(sql, 3, argtypes, values, NULL, false, 0) != SPI_OK_UPDATE)
+        elog(ERROR, "could not update the block map of relation %u", relid);
+}
+
+/*
+ * Trigger on mapped relations.
+ *
+ * Adds the block of a new tuple version to the maps of the columns it holds
+ * a sentinel value in, and its tid to their row maps. A tid in a row map
+ * that now belongs to a tuple without a sentinel value is dropped from it.
+ * Tuples that carry no sentinel, or that land in a block already mapped of
+ * a column without a row map, cost one lookup and one check per column.
+ */
+Datum
+pg_sentinel_block_map_maintain(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
+    Relation	rel;
+    Oid			relid;
+    HeapTuple	tuple;
+    SentinelRelation *sentinel;
+    List	   *blocks = NIL;	/* columns whose block map gains the block */
+    List	   *added = NIL;	/* columns whose row map gains the tid */
+    List	   *removed = NIL;	/* columns whose row map loses the tid */
+    ListCell   *lc;
+    int			i;
+
+    if (!CALLED_AS_TRIGGER(fcinfo) ||
+        !TRIGGER_FIRED_FOR_ROW(trigdata->tg_event) ||
+        !TRIGGER_FIRED_AFTER(trigdata->tg_event))
+        ereport(ERROR,
+                (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                 errmsg("pg_sentinel_block_map_maintain: must be fired after row")));
+
+    rel = trigdata->tg_relation;
+    relid = RelationGetRelid(rel);
+    tuple = TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event) ?
+        trigdata->tg_newtuple : trigdata->tg_trigtuple;
+
+    sentinel = sentinel_lookup_relation(relid);
+    if (sentinel == NULL)
+        PG_RETURN_POINTER(NULL);
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        SentinelColumn *column = &sentinel->columns[i];
+        bool		covered;
+        bool		listed = false;
+        bool		match;
+        Datum		datum;
+        bool		isnull;
+
+        if (column->block_map == NULL)
+            continue;
+
+        covered = sentinel_column_covers(column, &tuple->t_self);
+        if (column->row_map != NULL)
+            listed = sentinel_column_is_row(column, &tuple->t_self);
+        else if (covered)
+            continue;
+
+        if (!column_fits(rel, column))
+            continue;
+
+        datum = heap_getattr(tuple, column->attnum, RelationGetDescr(rel),
+                             &isnull);
+        match = !isnull && sentinel_column_match(column, datum);
+
+        if (match && !covered)
+            blocks = lappend_int(blocks, column->attnum);
+        if (match && column->row_map != NULL && !listed)
+            added = lappend_int(added, column->attnum);
+        if (!match && listed)
+            removed = lappend_int(removed, column->attnum);
+    }
+
+    if (blocks == NIL && added == NIL && removed == NIL)
+        PG_RETURN_POINTER(NULL);
+
+    SPI_connect();
+    foreach(lc, blocks)
+        update_map("UPDATE pg_sentinel.sentinels "
+                   "SET block_map = block_map OPERATOR(pg_catalog.||) $3 "
+                   "WHERE relid OPERATOR(pg_catalog.=) $1 "
+                   "AND attnum OPERATOR(pg_catalog.=) $2 "
+                   "AND block_map IS NOT NULL "
+                   "AND NOT $3 OPERATOR(pg_catalog.=) ANY (block_map)",
+                   relid, lfirst_int(lc), INT8OID,
+                   Int64GetDatum((int64) ItemPointerGetBlockNumber(&tuple->t_self)));
+    foreach(lc, added)
+        update_map("UPDATE pg_sentinel.sentinels "
+                   "SET row_map = row_map OPERATOR(pg_catalog.||) $3 "
+                   "WHERE relid OPERATOR(pg_catalog.=) $1 "
+                   "AND attnum OPERATOR(pg_catalog.=) $2 "
+                   "AND row_map IS NOT NULL "
+                   "AND NOT $3 OPERATOR(pg_catalog.=) ANY (row_map)",
+                   relid, lfirst_int(lc), TIDOID,
+                   ItemPointerGetDatum(&tuple->t_self));
+    foreach(lc, removed)
+        update_map("UPDATE pg_sentinel.sentinels "
+                   "SET row_map = pg_catalog.array_remove(row_map, $3) "
+                   "WHERE relid OPERATOR(pg_catalog.=) $1 "
+                   "AND attnum OPERATOR(pg_catalog.=) $2 "
+                   "AND $3 OPERATOR(pg_catalog.=) ANY (row_map)",
+                   relid, lfirst_int(lc), TIDOID,
+                   ItemPointerGetDatum(&tuple->t_self));
+    SPI_finish();
+
+    PG_RETURN_POINTER(NULL);
+}
+
+/*
+ * Add a relation named by a utility statement to the list, if it has maps
+ * in use.
+ */
+static List *
+add_mapped(List *relids, RangeVar *relation)
+{
+    SentinelRelation *sentinel;
+    Oid			relid;
+    int			i;
+
+    if (relation == NULL)
+        return relids;
+
+    /* leave errors to the statement */
+    relid = RangeVarGetRelid(relation, NoLock, true);
+    if (!OidIsValid(relid) ||
+        (sentinel = sentinel_lookup_relation(relid)) == NULL)
+        return relids;
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        if (sentinel->columns[i].block_map != NULL)
+            return list_append_unique_oid(relids, relid);
+    }
+
+    return relids;
+}
+
+/*
+ * The relations with maps in use that a utility statement is about to
+ * rewrite: those named by VACUUM FULL, CLUSTER, TRUNCATE and REFRESH
+ * MATERIALIZED VIEW. Other rewrites, e.g. by ALTER TABLE, leave the maps
+ * out of use until they are rebuilt.
+ */
+List *
+sentinel_map_rewritten(Node *utilityStmt)
+{
+    List	   *relids = NIL;
+    ListCell   *lc;
+
+    switch (nodeTag(utilityStmt))
+    {
+        case T_VacuumStmt:
+            {
+                VacuumStmt *stmt = (VacuumStmt *) utilityStmt;
+                bool		full = false;
+
+                if (!stmt->is_vacuumcmd)
+                    break;
+
+                foreach(lc, stmt->options)
+                {
+                    DefElem    *opt = (DefElem *) lfirst(lc);
+
+                    if (strcmp(opt->defname, "full") == 0)
+                        full = defGetBoolean(opt);
+                }
+                if (!full)
+                    break;
+
+                foreach(lc, stmt->rels)
+                    relids = add_mapped(relids,
+                                        ((VacuumRelation *) lfirst(lc))->relation);
+                break;
+            }
+
+        case T_ClusterStmt:
+            relids = add_mapped(relids, ((ClusterStmt *) utilityStmt)->relation);
+            break;
+
+        case T_TruncateStmt:
+            foreach(lc, ((TruncateStmt *) utilityStmt)->relations)
+                relids = add_mapped(relids, (RangeVar *) lfirst(lc));
+            break;
+
+        case T_RefreshMatViewStmt:
+            relids = add_mapped(relids,
+                                ((RefreshMatViewStmt *) utilityStmt)->relation);
+            break;
+
+        default:
+            break;
+    }
+
+    return relids;
+}
+
+/*
+ * Rebuild the maps of relations that have just been rewritten. Like the
+ * trigger, this runs as the owner of the registry, since whoever may
+ * rewrite a relation need not be allowed to change the registry, and with
+ * a safe search_path, since the caller's may hold their own operators.
+ */
+void
+sentinel_map_refresh(List *relids)
+{
+    Oid			nspid;
+    Oid			registry = InvalidOid;
+    HeapTuple	tuple;
+    Oid			owner;
+    Oid			save_userid;
+    int			save_sec_context;
+    int			save_nestlevel;
+    ListCell   *lc;
+
+    if (relids == NIL)
+        return;
+
+    nspid = get_namespace_oid("pg_sentinel", true);
+    if (OidIsValid(nspid))
+        registry = get_relname_relid("sentinels", nspid);
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(registry));
+    if (!HeapTupleIsValid(tuple))
+        return;
+    owner = ((Form_pg_class) GETSTRUCT(tuple))->relowner;
+    ReleaseSysCache(tuple);
+
+    GetUserIdAndSecContext(&save_userid, &save_sec_context);
+    SetUserIdAndSecContext(owner, save_sec_context |
+                           SECURITY_LOCAL_USERID_CHANGE |
+                           SECURITY_RESTRICTED_OPERATION);
+    save_nestlevel = NewGUCNestLevel();
+    (void) set_config_option("search_path", "pg_catalog, pg_temp",
+                             PGC_USERSET, PGC_S_SESSION,
+                             GUC_ACTION_SAVE, true, 0, false);
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    foreach(lc, relids)
+    {
+        if (sentinel_lookup_relation(lfirst_oid(lc)) != NULL)
+            rebuild_maps(lfirst_oid(lc));
+    }
+
+    PopActiveSnapshot();
+    AtEOXact_GUC(false, save_nestlevel);
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+}
@@ -0,0 +1,280 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_pattern.c
+ *
+ * Sentinel values given as LIKE patterns or regular expressions.
+ *
+ * All patterns of a column are combined into a single regular expression,
+ * an alternation of the patterns, and compiled once when the registry
+ * cache is built. PostgreSQL's regex engine then matches all of them in one
+ * pass over a value, however many patterns there are. LIKE patterns are
+ * translated into anchored regular expressions first. Values are converted
+ * into a buffer of wide characters that is reused for all of them, so
+ * matching allocates nothing per value.
+ *
+ * Regular expressions are not anchored, so they match anywhere in a value
+ * unless they say otherwise. Since they are combined, they cannot use
+ * embedded options.
+ *
+ * Patterns that do not compile are rejected by the registry trigger and by
+ * the check of pg_sentinel.sentinel_value. Should they get into the cache
+ * anyway, the column is left without patterns rather than failing the
+ * rebuild.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "catalog/pg_collation.h"
+#include "lib/stringinfo.h"
+#include "mb/pg_wchar.h"
+#include "regex/regex.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "pg_sentinel.h"
+
+struct SentinelPattern
+{
+    regex_t		re;
+    char	   *source;			/* the combined regular expression */
+    MemoryContextCallback cleanup;
+};
+
+/* Wide characters of the value being matched, reused */
+static pg_wchar *match_buffer = NULL;
+static Size match_buffer_size = 0;
+
+static void
+report_regex_error(const char *message)
+{
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+             errmsg("invalid sentinel pattern: %s", message)));
+}
+
+/*
+ * Append a LIKE pattern as an anchored regular expression. Backslash
+ * escapes the next character, as in LIKE's default escape.
+ */
+static void
+append_like(StringInfo buf, const char *p)
+{
+    appendStringInfoChar(buf, '^');
+    for (; *p != '\0'; p++)
+    {
+        if (*p == '%')
+            appendStringInfoString(buf, ".*");
+        else if (*p == '_')
+            appendStringInfoChar(buf, '.');
+        else
+        {
+            if (*p == '\\' && p[1] != '\0')
+                p++;
+            if (strchr("\\^$.[]|()*+?{}", *p) != NULL)
+                appendStringInfoChar(buf, '\\');
+            appendStringInfoChar(buf, *p);
+        }
+    }
+    appendStringInfoChar(buf, '$');
+}
+
+static void
+free_pattern(void *arg)
+{
+    SentinelPattern *pattern = (SentinelPattern *) arg;
+
+    pg_regfree(&pattern->re);
+}
+
+/*
+ * Compile a combined regular expression in cxt. The regex is freed along
+ * with cxt. If it does not compile, an error is raised, or with error set,
+ * the message is put there and NULL returned.
+ */
+static SentinelPattern *
+compile_source(const char *source, MemoryContext cxt, char *error,
+               Size errsize)
+{
+    SentinelPattern *pattern;
+    MemoryContext oldcxt;
+    pg_wchar   *wide;
+    int			len;
+    int			code;
+
+    oldcxt = MemoryContextSwitchTo(cxt);
+
+    pattern = palloc(sizeof(SentinelPattern));
+    pattern->source = pstrdup(source);
+
+    wide = palloc((strlen(source) + 1) * sizeof(pg_wchar));
+    len = pg_mb2wchar_with_len(source, wide, strlen(source));
+
+    code = pg_regcomp(&pattern->re, wide, len, REG_ADVANCED | REG_NOSUB,
+                      C_COLLATION_OID);
+    pfree(wide);
+    MemoryContextSwitchTo(oldcxt);
+
+    if (code != REG_OKAY)
+    {
+        char		message[100];
+
+        pg_regerror(code, &pattern->re, message, sizeof(message));
+        pfree(pattern->source);
+        pfree(pattern);
+
+        if (error == NULL)
+            report_regex_error(message);
+        strlcpy(error, message, errsize);
+        return NULL;
+    }
+
+    pattern->cleanup.func = free_pattern;
+    pattern->cleanup.arg = pattern;
+    MemoryContextRegisterResetCallback(cxt, &pattern->cleanup);
+
+    return pattern;
+}
+
+/*
+ * The combined regular expression of a list of patterns, given as text.
+ * With like, the patterns are LIKE patterns, else regular expressions.
+ * Returns NULL for no patterns.
+ */
+static char *
+combine_patterns(List *patterns, bool like)
+{
+    StringInfoData buf;
+    ListCell   *lc;
+
+    initStringInfo(&buf);
+    foreach(lc, patterns)
+    {
+        char	   *p = text_to_cstring((text *) lfirst(lc));
+
+        if (buf.len > 0)
+            appendStringInfoChar(&buf, '|');
+        appendStringInfoString(&buf, "(?:");
+        if (like)
+            append_like(&buf, p);
+        else
+            appendStringInfoString(&buf, p);
+        appendStringInfoChar(&buf, ')');
+    }
+
+    if (buf.len == 0)
+    {
+        pfree(buf.data);
+        return NULL;
+    }
+
+    return buf.data;
+}
+
+/*
+ * Compile a list of patterns into one matcher kept in cxt. Returns NULL for
+ * no patterns. With strict, patterns that do not compile raise an error;
+ * without, they are logged and NULL is returned.
+ */
+SentinelPattern *
+sentinel_pattern_compile(List *patterns, bool like, bool strict,
+                         MemoryContext cxt)
+{
+    char	   *source = combine_patterns(patterns, like);
+    SentinelPattern *pattern;
+    char		message[100];
+
+    if (source == NULL)
+        return NULL;
+
+    if (strict)
+        return compile_source(source, cxt, NULL, 0);
+
+    pattern = compile_source(source, cxt, message, sizeof(message));
+    if (pattern == NULL)
+        ereport(LOG,
+                (errcode(ERRCODE_INVALID_REGULAR_EXPRESSION),
+                 errmsg("pg_sentinel: ignoring sentinel patterns that do not compile: %s",
+                        message)));
+    pfree(source);
+
+    return pattern;
+}
+
+/*
+ * Check that a list of patterns compiles. Returns NULL if it does, else
+ * the error message, without raising it.
+ */
+char *
+sentinel_pattern_error(List *patterns, bool like)
+{
+    char	   *source = combine_patterns(patterns, like);
+    MemoryContext cxt;
+    bool		compiled;
+    char		message[100];
+
+    if (source == NULL)
+        return NULL;
+
+    /* the regex goes away with its context */
+    cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                "pg_sentinel pattern check",
+                                ALLOCSET_SMALL_SIZES);
+    compiled = compile_source(source, cxt, message, sizeof(message)) != NULL;
+    MemoryContextDelete(cxt);
+    pfree(source);
+
+    return compiled ? NULL : pstrdup(message);
+}
+
+/*
+ * Compile a pattern anew in the current memory context, for a private copy
+ * of a column.
+ */
+SentinelPattern *
+sentinel_pattern_copy(const SentinelPattern *pattern)
+{
+    if (pattern == NULL)
+        return NULL;
+
+    return compile_source(pattern->source, CurrentMemoryContext, NULL, 0);
+}
+
+/*
+ * Check whether data, in the server encoding, matches any of the patterns.
+ */
+bool
+sentinel_pattern_match(const SentinelPattern *pattern, const char *data,
+                       Size len)
+{
+    int			wlen;
+    int			code;
+
+    if (pattern == NULL)
+        return false;
+
+    if (match_buffer_size < len + 1)
+    {
+        if (match_buffer != NULL)
+            pfree(match_buffer);
+        match_buffer_size = Max(len + 1, 1024);
+        match_buffer = MemoryContextAllocHuge(TopMemoryContext,
+                                              match_buffer_size * sizeof(pg_wchar));
+    }
+
+    wlen = pg_mb2wchar_with_len(data, match_buffer, len);
+
+    code = pg_regexec((regex_t *) &pattern->re, match_buffer, wlen, 0, NULL,
+                      0, NULL, 0);
+    if (code == REG_NOMATCH)
+        return false;
+    if (code != REG_OKAY)
+        report_regex_error(code, (regex_t *) &pattern->re);
+
+    return true;
+}
@@ -0,0 +1,885 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_registry.c
+ *
+ * Per-backend cache of the sentinel registry.
+ *
+ * Sentinel columns are configured in the extension-owned table
+ * pg_sentinel.sentinels, plus the single column given by the
+ * pg_sentinel.relation_oid and pg_sentinel.column_no settings. Each backend
+ * keeps a hash table keyed by table Oid, so looking up a relation is a
+ * single probe. The columns of a registered relation apply to all of its
+ * partitions and inheritance children, which get entries of their own, so
+ * the tuples of a leaf partition are found by the leaf's Oid just as fast.
+ * The table is rebuilt lazily, and only after a relcache invalidation for
+ * the registry, which a trigger on the registry sends whenever its contents
+ * change, or for a registered relation or one of its parents, which
+ * ATTACH PARTITION, DETACH PARTITION and the like send.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/genam.h"
+#include "access/htup_details.h"
+#include "access/table.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_type.h"
+#include "commands/trigger.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+#include "pg_sentinel.h"
+
+#define SENTINEL_SCHEMA			"pg_sentinel"
+#define SENTINEL_REGISTRY		"sentinels"
+
+/* Column numbers of pg_sentinel.sentinels */
+#define Anum_sentinels_relid	1
+#define Anum_sentinels_attnum	2
+#define Anum_sentinels_values	3
+#define Anum_sentinels_action	4
+#define Anum_sentinels_match	5
+#define Anum_sentinels_by_tid	6
+#define Anum_sentinels_block_map	7
+#define Anum_sentinels_block_map_relfilenode	8
+#define Anum_sentinels_row_map	9
+
+/* Bits of a block map at most, 128kB, before its bits cover block ranges */
+#define SENTINEL_BLOCK_MAP_MAX_BITS	(1 << 20)
+
+static HTAB *registry_hash = NULL;
+static MemoryContext registry_context = NULL;
+static List *registry_shared_sets = NIL;	/* slots of shared sets in use */
+static List *pending_shared_sets = NIL; /* slots taken during a rebuild */
+static Oid	registry_relid = InvalidOid;
+static bool registry_valid = false;
+static bool registry_has_maps = false;	/* some column has a block map */
+static bool pending_has_maps = false;	/* the same, during a rebuild */
+static uint64 registry_inval_count = 0;
+static uint64 registry_generation = 0;
+
+/* The column configured through the settings, if any */
+static Oid	static_relid = InvalidOid;
+static AttrNumber static_attnum = InvalidAttrNumber;
+static int	static_elevel = ERROR;
+static List *static_values = NIL;	/* of text */
+static int	static_flags = 0;
+static SentinelSet *static_set = NULL;
+
+PG_FUNCTION_INFO_V1(pg_sentinel_registry_changed);
+
+static void
+registry_relcache_callback(Datum arg, Oid relid)
+{
+    SentinelRelation *entry;
+
+    /*
+     * As long as the registry table has not been found, any relcache
+     * invalidation may stem from CREATE EXTENSION, so recheck then.
+     */
+    if (relid == InvalidOid || relid == registry_relid ||
+        registry_relid == InvalidOid)
+    {
+        registry_valid = false;
+        registry_inval_count++;
+        return;
+    }
+
+    /*
+     * A parent may have gained or lost children, and a relation with a block
+     * map may have been rewritten, which moves its tuples to other blocks.
+     * Reload to find the children, or recheck the map against it.
+     */
+    if (registry_valid &&
+        (entry = hash_search(registry_hash, &relid, HASH_FIND, NULL)) != NULL)
+    {
+        int			i;
+
+        if (entry->parent)
+        {
+            registry_valid = false;
+            registry_inval_count++;
+            return;
+        }
+
+        for (i = 0; i < entry->ncolumns; i++)
+        {
+            if (entry->columns[i].block_map != NULL)
+            {
+                registry_valid = false;
+                registry_inval_count++;
+                return;
+            }
+        }
+    }
+}
+
+static int
+action_elevel(const char *action)
+{
+    if (pg_strcasecmp(action, "warning") == 0)
+        return WARNING;
+    if (pg_strcasecmp(action, "error") == 0)
+        return ERROR;
+    if (pg_strcasecmp(action, "fatal") == 0)
+        return FATAL;
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("invalid sentinel action \"%s\"", action)));
+    return ERROR;				/* keep compiler quiet */
+}
+
+/*
+ * Map the match column of the registry to the flags of the value set.
+ */
+static int
+match_flags(const char *match)
+{
+    if (pg_strcasecmp(match, "prefix") == 0)
+        return 0;
+    if (pg_strcasecmp(match, "contains") == 0)
+        return SENTINEL_SET_CONTAINS;
+    if (pg_strcasecmp(match, "like") == 0)
+        return SENTINEL_MATCH_LIKE;
+    if (pg_strcasecmp(match, "regex") == 0)
+        return SENTINEL_MATCH_REGEX;
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("invalid sentinel match \"%s\"", match)));
+    return 0;					/* keep compiler quiet */
+}
+
+/*
+ * Add a sentinel column to the hash table being built. Must be called in
+ * the memory context of that hash table. The column starts out compared as
+ * text and without a block map; the result is valid until the next column
+ * is added.
+ */
+static SentinelColumn *
+add_column(HTAB *hash, Oid relid, AttrNumber attnum, int elevel,
+           SentinelSet *values)
+{
+    SentinelRelation *entry;
+    SentinelColumn *column;
+    bool		found;
+
+    entry = (SentinelRelation *) hash_search(hash, &relid, HASH_ENTER, &found);
+    if (!found)
+    {
+        entry->parent = true;
+        entry->ncolumns = 0;
+        entry->columns = palloc(sizeof(SentinelColumn));
+        entry->rows = 0;
+        entry->row_check = 1;
+    }
+    else
+        entry->columns = repalloc(entry->columns,
+                                  sizeof(SentinelColumn) * (entry->ncolumns + 1));
+
+    column = &entry->columns[entry->ncolumns++];
+    memset(column, 0, sizeof(SentinelColumn));
+    column->attnum = attnum;
+    column->elevel = elevel;
+    column->compare = SENTINEL_COMPARE_BYTES;
+    column->values = values;
+    column->text_values = values;
+
+    return column;
+}
+
+static Oid
+current_relfilenode(Oid relid)
+{
+    HeapTuple	tuple;
+    Oid			relfilenode = InvalidOid;
+
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+    if (HeapTupleIsValid(tuple))
+    {
+        relfilenode = ((Form_pg_class) GETSTRUCT(tuple))->relfilenode;
+        ReleaseSysCache(tuple);
+    }
+
+    return relfilenode;
+}
+
+/*
+ * Turn the block numbers recorded by pg_sentinel_rebuild_map() into a
+ * bitmap spanning the lowest to the highest block. Must be called in the
+ * memory context of the hash table.
+ *
+ * Table access methods other than heap may hand out tids that number rows
+ * rather than address blocks, e.g. columnar ones, so the blocks of a few
+ * sentinel rows can lie far apart. Rather than growing with the distance,
+ * the bitmap then gets coarser: each bit covers a range of blocks, which
+ * for a columnar table roughly corresponds to a stripe or chunk group, and
+ * every tuple in a range with a sentinel row is checked.
+ */
+static void
+set_block_map(SentinelColumn *column, ArrayType *array)
+{
+    Datum	   *elems;
+    bool	   *nulls;
+    int			nelems;
+    BlockNumber start = InvalidBlockNumber;
+    BlockNumber end = 0;
+    uint64		span;
+    uint32		nbits;
+    uint8		shift = 0;
+    int			i;
+
+    pending_has_maps = true;
+    deconstruct_array(array, INT8OID, sizeof(int64), FLOAT8PASSBYVAL,
+                      TYPALIGN_DOUBLE, &elems, &nulls, &nelems);
+
+    for (i = 0; i < nelems; i++)
+    {
+        BlockNumber block;
+
+        if (nulls[i])
+            continue;
+        block = (BlockNumber) DatumGetInt64(elems[i]);
+        start = Min(start, block);
+        end = Max(end, block);
+    }
+
+    /* no sentinel row at all, the map must still exclude every block */
+    if (start == InvalidBlockNumber)
+        start = end = 0;
+
+    span = (uint64) (end - start) + 1;
+    while ((span >> shift) > SENTINEL_BLOCK_MAP_MAX_BITS)
+        shift++;
+    nbits = (uint32) (((span - 1) >> shift) + 1);
+
+    column->block_map = palloc0(sizeof(uint64) * ((nbits + 63) / 64));
+    column->block_map_start = start;
+    column->block_map_nbits = nbits;
+    column->block_map_shift = shift;
+
+    for (i = 0; i < nelems; i++)
+    {
+        uint32		bit;
+
+        if (nulls[i])
+            continue;
+        bit = ((BlockNumber) DatumGetInt64(elems[i]) - start) >> shift;
+        column->block_map[bit >> 6] |= UINT64CONST(1) << (bit & 63);
+    }
+}
+
+/*
+ * The non-NULL elements of a text array, as a list of text.
+ */
+static List *
+array_values(ArrayType *array)
+{
+    Datum	   *elems;
+    bool	   *nulls;
+    int			nelems;
+    List	   *values = NIL;
+    int			i;
+
+    deconstruct_array(array, TEXTOID, -1, false, TYPALIGN_INT,
+                      &elems, &nulls, &nelems);
+    for (i = 0; i < nelems; i++)
+    {
+        if (!nulls[i])
+            values = lappend(values, DatumGetTextPP(elems[i]));
+    }
+
+    return values;
+}
+
+/*
+ * Get the set of one registry tuple.
+ *
+ * Sets with at least pg_sentinel.shared_set_threshold values are taken from
+ * shared memory, where the first backend to need them builds them, and the
+ * slots used are added to *shared_sets. Smaller sets, or large ones if
+ * shared memory is exhausted, are built into cache_cxt.
+ */
+static SentinelSet *
+registry_set(HeapTuple tuple, ArrayType *array, int flags,
+             MemoryContext cache_cxt, List **shared_sets)
+{
+    TransactionId xmin = HeapTupleHeaderGetRawXmin(tuple->t_data);
+    bool		shared;
+    List	   *values;
+    SentinelSet *set;
+    MemoryContext oldcxt;
+    int			slot = -1;
+
+    shared = sentinel_shared_set_threshold > 0 &&
+        ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array)) >= sentinel_shared_set_threshold;
+
+    if (shared)
+        slot = sentinel_shared_set_find(xmin, &tuple->t_self);
+
+    if (slot < 0)
+    {
+        values = array_values(array);
+
+        if (!shared)
+        {
+            oldcxt = MemoryContextSwitchTo(cache_cxt);
+            set = sentinel_set_build(values, flags);
+            MemoryContextSwitchTo(oldcxt);
+            return set;
+        }
+
+        set = sentinel_set_build(values, flags | SENTINEL_SET_BLOOM);
+        slot = sentinel_shared_set_publish(xmin, &tuple->t_self, set);
+
+        if (slot < 0)
+        {
+            /* no shared memory to spare, keep a private copy */
+            SentinelSet *copy = MemoryContextAlloc(cache_cxt,
+                                                   sentinel_set_size(set));
+
+            memcpy(copy, set, sentinel_set_size(set));
+            return copy;
+        }
+    }
+
+    oldcxt = MemoryContextSwitchTo(cache_cxt);
+    *shared_sets = lappend_int(*shared_sets, slot);
+    MemoryContextSwitchTo(oldcxt);
+
+    return (SentinelSet *) sentinel_shared_set_get(slot);
+}
+
+static int
+tid_key_cmp(const void *a, const void *b)
+{
+    uint64		ka = *(const uint64 *) a;
+    uint64		kb = *(const uint64 *) b;
+
+    return ka < kb ? -1 : ka > kb ? 1 : 0;
+}
+
+/*
+ * Turn the tids recorded by pg_sentinel_rebuild_map() and the trigger into
+ * the sorted keys of the column's row map. Must be called in the memory
+ * context of the hash table.
+ */
+static void
+set_row_map(SentinelColumn *column, ArrayType *array)
+{
+    Datum	   *elems;
+    bool	   *nulls;
+    int			nelems;
+    uint32		ntids = 0;
+    int			i;
+
+    deconstruct_array(array, TIDOID, sizeof(ItemPointerData), false,
+                      TYPALIGN_SHORT, &elems, &nulls, &nelems);
+
+    column->row_map = palloc(sizeof(uint64) * Max(nelems, 1));
+    for (i = 0; i < nelems; i++)
+    {
+        if (!nulls[i])
+            column->row_map[ntids++] =
+                sentinel_tid_key(DatumGetItemPointer(elems[i]));
+    }
+
+    if (ntids > 1)
+    {
+        uint32		n = 1;
+
+        qsort(column->row_map, ntids, sizeof(uint64), tid_key_cmp);
+        for (i = 1; i < ntids; i++)
+        {
+            if (column->row_map[i] != column->row_map[n - 1])
+                column->row_map[n++] = column->row_map[i];
+        }
+        ntids = n;
+    }
+
+    column->row_map_ntids = ntids;
+}
+
+/*
+ * Read the registry table into the hash table. Scratch allocations go to
+ * the current memory context, everything kept goes to cache_cxt.
+ */
+static void
+load_registry(HTAB *hash, Oid relid, MemoryContext cache_cxt,
+              List **shared_sets)
+{
+    Relation	rel;
+    TupleDesc	desc;
+    SysScanDesc scan;
+    HeapTuple	tuple;
+
+    rel = table_open(relid, AccessShareLock);
+    desc = RelationGetDescr(rel);
+    scan = systable_beginscan(rel, InvalidOid, false, NULL, 0, NULL);
+
+    while (HeapTupleIsValid(tuple = systable_getnext(scan)))
+    {
+        Datum		datum;
+        bool		isnull;
+        Oid			target;
+        AttrNumber	attnum;
+        int			elevel;
+        int			flags = 0;
+        ArrayType  *values;
+        bool		typed;
+        SentinelSet *set;
+        SentinelColumn *column;
+        ArrayType  *block_map = NULL;
+        ArrayType  *row_map = NULL;
+        bool		by_tid;
+        MemoryContext oldcxt;
+
+        datum = heap_getattr(tuple, Anum_sentinels_relid, desc, &isnull);
+        if (isnull)
+            continue;
+        target = DatumGetObjectId(datum);
+
+        datum = heap_getattr(tuple, Anum_sentinels_attnum, desc, &isnull);
+        if (isnull)
+            continue;
+        attnum = DatumGetInt16(datum);
+
+        datum = heap_getattr(tuple, Anum_sentinels_action, desc, &isnull);
+        elevel = isnull ? FATAL : action_elevel(TextDatumGetCString(datum));
+
+        datum = heap_getattr(tuple, Anum_sentinels_match, desc, &isnull);
+        if (!isnull)
+            flags |= match_flags(TextDatumGetCString(datum));
+
+        datum = heap_getattr(tuple, Anum_sentinels_by_tid, desc, &isnull);
+        by_tid = !isnull && DatumGetBool(datum);
+
+        datum = heap_getattr(tuple, Anum_sentinels_values, desc, &isnull);
+        if (isnull)
+            continue;
+        values = DatumGetArrayTypeP(datum);
+
+        /* typed values and patterns are parsed below, once the column is added */
+        typed = sentinel_column_typed(target, attnum) ||
+            (flags & SENTINEL_MATCH_PATTERN) != 0;
+        set = typed ? NULL : registry_set(tuple, values, flags, cache_cxt,
+                                          shared_sets);
+
+        /* a map of an older incarnation of the relation no longer applies */
+        datum = heap_getattr(tuple, Anum_sentinels_block_map_relfilenode,
+                             desc, &isnull);
+        if (!isnull && DatumGetObjectId(datum) == current_relfilenode(target))
+        {
+            datum = heap_getattr(tuple, Anum_sentinels_block_map, desc, &isnull);
+            if (!isnull)
+                block_map = DatumGetArrayTypeP(datum);
+
+            /* a row map is only of use along with its block map */
+            datum = heap_getattr(tuple, Anum_sentinels_row_map, desc, &isnull);
+            if (!isnull && by_tid && block_map != NULL)
+                row_map = DatumGetArrayTypeP(datum);
+        }
+
+        oldcxt = MemoryContextSwitchTo(cache_cxt);
+        column = add_column(hash, target, attnum, elevel, set);
+        column->by_tid = by_tid;
+        if (block_map != NULL)
+            set_block_map(column, block_map);
+        if (row_map != NULL)
+            set_row_map(column, row_map);
+        MemoryContextSwitchTo(oldcxt);
+
+        if (typed)
+            sentinel_column_prepare(column, target, array_values(values),
+                                    flags, false, cache_cxt);
+    }
+
+    systable_endscan(scan);
+    table_close(rel, AccessShareLock);
+}
+
+/*
+ * Check whether a relation in the hash table being built has a column.
+ */
+static bool
+has_column(HTAB *hash, Oid relid, AttrNumber attnum)
+{
+    SentinelRelation *entry;
+    int			i;
+
+    entry = (SentinelRelation *) hash_search(hash, &relid, HASH_FIND, NULL);
+    if (entry == NULL)
+        return false;
+
+    for (i = 0; i < entry->ncolumns; i++)
+    {
+        if (entry->columns[i].attnum == attnum)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Give the partitions and inheritance children of the registered relations
+ * the columns of their ancestors, matched by name. A column registered for
+ * a child itself takes precedence. Scratch allocations go to the current
+ * memory context, everything kept goes to cache_cxt.
+ */
+static void
+add_children(HTAB *hash, MemoryContext cache_cxt)
+{
+    HASH_SEQ_STATUS status;
+    SentinelRelation *entry;
+    List	   *parents = NIL;
+    ListCell   *lc;
+
+    /* only registered relations so far, children are added below */
+    hash_seq_init(&status, hash);
+    while ((entry = (SentinelRelation *) hash_seq_search(&status)) != NULL)
+        parents = lappend_oid(parents, entry->relid);
+
+    foreach(lc, parents)
+    {
+        Oid			parent = lfirst_oid(lc);
+        SentinelColumn *columns;
+        int			ncolumns;
+        List	   *children;
+        ListCell   *lc2;
+
+        /* add_column() moves the columns of the entries it adds to */
+        entry = (SentinelRelation *) hash_search(hash, &parent, HASH_FIND, NULL);
+        ncolumns = entry->ncolumns;
+        columns = palloc(sizeof(SentinelColumn) * ncolumns);
+        memcpy(columns, entry->columns, sizeof(SentinelColumn) * ncolumns);
+
+        children = find_all_inheritors(parent, NoLock, NULL);
+
+        foreach(lc2, children)
+        {
+            Oid			child = lfirst_oid(lc2);
+            bool		registered;
+            int			i;
+
+            if (child == parent)
+                continue;
+
+            registered = list_member_oid(parents, child);
+
+            for (i = 0; i < ncolumns; i++)
+            {
+                char	   *attname;
+                AttrNumber	attnum;
+                SentinelColumn *column;
+                MemoryContext oldcxt;
+
+                attname = get_attname(parent, columns[i].attnum, true);
+                if (attname == NULL)
+                    continue;
+                attnum = get_attnum(child, attname);
+                if (attnum == InvalidAttrNumber ||
+                    has_column(hash, child, attnum))
+                    continue;
+
+                /* all but the block map can be shared with the parent */
+                oldcxt = MemoryContextSwitchTo(cache_cxt);
+                column = add_column(hash, child, attnum, columns[i].elevel,
+                                    columns[i].values);
+                *column = columns[i];
+                column->attnum = attnum;
+                column->inherited = true;
+                column->block_map = NULL;
+                column->block_map_start = 0;
+                column->block_map_nbits = 0;
+                column->block_map_shift = 0;
+                column->row_map = NULL;
+                column->row_map_ntids = 0;
+                MemoryContextSwitchTo(oldcxt);
+            }
+
+            /* a leaf partition can never gain children of its own */
+            entry = (SentinelRelation *) hash_search(hash, &child, HASH_FIND, NULL);
+            if (entry != NULL && !registered)
+                entry->parent = !get_rel_relispartition(child) ||
+                    get_rel_relkind(child) == RELKIND_PARTITIONED_TABLE;
+        }
+    }
+}
+
+/*
+ * Rebuild the per-backend cache.
+ *
+ * The new cache is built in a context below the current one and only
+ * attached to CacheMemoryContext once complete, so an error half-way leaves
+ * the cache invalid rather than half-built. An invalidation arriving during
+ * the rebuild leaves it invalid as well. References on shared sets are
+ * only dropped once the cache that used them is gone.
+ */
+static void
+registry_rebuild(void)
+{
+    uint64		inval_count = registry_inval_count;
+    MemoryContext cxt;
+    MemoryContext oldcxt;
+    HASHCTL		ctl;
+    HTAB	   *hash;
+    Oid			nspid;
+    Oid			relid = InvalidOid;
+    ListCell   *lc;
+
+    pending_shared_sets = NIL;
+    pending_has_maps = false;
+    cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                "pg_sentinel registry",
+                                ALLOCSET_SMALL_SIZES);
+
+    ctl.keysize = sizeof(Oid);
+    ctl.entrysize = sizeof(SentinelRelation);
+    ctl.hcxt = cxt;
+    hash = hash_create("pg_sentinel registry", 16, &ctl,
+                       HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    PG_TRY();
+    {
+        if (OidIsValid(static_relid))
+        {
+            bool		typed = sentinel_column_typed(static_relid, static_attnum) ||
+                (static_flags & SENTINEL_MATCH_PATTERN) != 0;
+            SentinelColumn *column;
+
+            oldcxt = MemoryContextSwitchTo(cxt);
+            column = add_column(hash, static_relid, static_attnum,
+                                static_elevel, typed ? NULL : static_set);
+            MemoryContextSwitchTo(oldcxt);
+
+            if (typed)
+                sentinel_column_prepare(column, static_relid, static_values,
+                                        static_flags, false, cxt);
+        }
+
+        nspid = get_namespace_oid(SENTINEL_SCHEMA, true);
+        if (OidIsValid(nspid))
+            relid = get_relname_relid(SENTINEL_REGISTRY, nspid);
+        if (OidIsValid(relid))
+            load_registry(hash, relid, cxt, &pending_shared_sets);
+        add_children(hash, cxt);
+    }
+    PG_CATCH();
+    {
+        foreach(lc, pending_shared_sets)
+            sentinel_shared_set_release(lfirst_int(lc));
+        pending_shared_sets = NIL;
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+
+    MemoryContextSetParent(cxt, CacheMemoryContext);
+    foreach(lc, registry_shared_sets)
+        sentinel_shared_set_release(lfirst_int(lc));
+    if (registry_context != NULL)
+    {
+        sentinel_rows_save();
+        MemoryContextDelete(registry_context);
+    }
+
+    registry_context = cxt;
+    registry_shared_sets = pending_shared_sets;
+    pending_shared_sets = NIL;
+    registry_hash = hash;
+    registry_relid = relid;
+    registry_has_maps = pending_has_maps;
+    registry_valid = (inval_count == registry_inval_count);
+    registry_generation++;
+}
+
+/*
+ * Set up the registry. The column given by the settings, if any, is always
+ * part of it; its values are given both as a list of text, which must live
+ * as long as the process, and as the set built from them.
+ */
+void
+sentinel_registry_init(Oid relid, AttrNumber attnum, int elevel,
+                       List *values, int flags, SentinelSet *set)
+{
+    static_relid = relid;
+    static_attnum = attnum;
+    static_elevel = elevel;
+    static_values = values;
+    static_flags = flags;
+    static_set = set;
+
+    CacheRegisterRelcacheCallback(registry_relcache_callback, (Datum) 0);
+}
+
+/*
+ * Look up the sentinel columns of a relation, or NULL if it has none.
+ *
+ * The result is only valid until the next lookup.
+ */
+SentinelRelation *
+sentinel_lookup_relation(Oid relid)
+{
+    if (!registry_valid)
+        registry_rebuild();
+
+    return (SentinelRelation *) hash_search(registry_hash, &relid,
+                                            HASH_FIND, NULL);
+}
+
+/*
+ * Look up a single sentinel column, or NULL if it is not registered.
+ *
+ * Like sentinel_lookup_relation(), the result is only valid until the next
+ * lookup.
+ */
+SentinelColumn *
+sentinel_lookup_column(Oid relid, AttrNumber attnum)
+{
+    SentinelRelation *sentinel = sentinel_lookup_relation(relid);
+    int			i;
+
+    if (sentinel == NULL)
+        return NULL;
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        if (sentinel->columns[i].attnum == attnum)
+            return &sentinel->columns[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * Make sure the cache is valid and return its generation, which changes with
+ * every rebuild. Callers that keep pointers into the cache across calls can
+ * use it to detect that they went stale.
+ */
+uint64
+sentinel_registry_generation(void)
+{
+    if (!registry_valid)
+        registry_rebuild();
+
+    return registry_generation;
+}
+
+/*
+ * Process pending invalidations before the checks of a statement start, if
+ * the cache holds block maps. A backend that already holds the lock on a
+ * relation does not process invalidations before it scans it again, so a
+ * map could otherwise miss the block of a sentinel row committed since.
+ * Cheap when nothing is pending.
+ */
+void
+sentinel_registry_accept_invalidations(void)
+{
+    if (registry_valid && registry_has_maps)
+        AcceptInvalidationMessages();
+}
+
+/*
+ * Send a relcache invalidation for a registered relation, which also
+ * invalidates the cached plans that scan it.
+ */
+static void
+invalidate_target(HeapTuple tuple, TupleDesc desc)
+{
+    bool		isnull;
+    Datum		relid = heap_getattr(tuple, Anum_sentinels_relid, desc, &isnull);
+
+    if (!isnull && SearchSysCacheExists1(RELOID, relid))
+        CacheInvalidateRelcacheByRelid(DatumGetObjectId(relid));
+}
+
+/*
+ * Make sure the sentinel values of a registry tuple are valid values of the
+ * column's type, or patterns that compile, so loading the registry never
+ * runs into bad ones.
+ */
+static void
+validate_values(HeapTuple tuple, TupleDesc desc)
+{
+    SentinelColumn column;
+    Datum		relid;
+    Datum		attnum;
+    Datum		values;
+    Datum		match;
+    bool		isnull[4];
+    int			flags = 0;
+
+    relid = heap_getattr(tuple, Anum_sentinels_relid, desc, &isnull[0]);
+    attnum = heap_getattr(tuple, Anum_sentinels_attnum, desc, &isnull[1]);
+    values = heap_getattr(tuple, Anum_sentinels_values, desc, &isnull[2]);
+    match = heap_getattr(tuple, Anum_sentinels_match, desc, &isnull[3]);
+    if (isnull[0] || isnull[1] || isnull[2])
+        return;
+    if (!isnull[3])
+        flags = match_flags(TextDatumGetCString(match));
+
+    if ((flags & SENTINEL_MATCH_PATTERN) == 0 &&
+        !sentinel_column_typed(DatumGetObjectId(relid), DatumGetInt16(attnum)))
+        return;
+
+    memset(&column, 0, sizeof(column));
+    column.attnum = DatumGetInt16(attnum);
+    sentinel_column_prepare(&column, DatumGetObjectId(relid),
+                            array_values(DatumGetArrayTypeP(values)), flags,
+                            true, CurrentMemoryContext);
+}
+
+/*
+ * Trigger on pg_sentinel.sentinels.
+ *
+ * Sends a relcache invalidation for the registry, so every backend rebuilds
+ * its cache once the change commits. Fired per row, it also invalidates the
+ * relations whose sentinel columns changed, so plans protecting them are
+ * rebuilt as well. TRUNCATE is handled per statement and invalidates all
+ * relations.
+ */
+Datum
+pg_sentinel_registry_changed(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
+    TupleDesc	desc;
+
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                 errmsg("pg_sentinel_registry_changed: not called by trigger manager")));
+
+    desc = RelationGetDescr(trigdata->tg_relation);
+
+    if (TRIGGER_FIRED_FOR_ROW(trigdata->tg_event))
+    {
+        if (TRIGGER_FIRED_BY_INSERT(trigdata->tg_event))
+            validate_values(trigdata->tg_trigtuple, desc);
+        else if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+            validate_values(trigdata->tg_newtuple, desc);
+
+        invalidate_target(trigdata->tg_trigtuple, desc);
+        if (TRIGGER_FIRED_BY_UPDATE(trigdata->tg_event))
+            invalidate_target(trigdata->tg_newtuple, desc);
+    }
+    else if (TRIGGER_FIRED_BY_TRUNCATE(trigdata->tg_event))
+        CacheInvalidateRelcacheAll();
+
+    CacheInvalidateRelcache(trigdata->tg_relation);
+
+    PG_RETURN_POINTER(NULL);
+}
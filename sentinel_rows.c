@@ -0,0 +1,588 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_rows.c
+ *
+ * Row limits of sentinel relations.
+ *
+ * A dump of a protected table need not touch a sentinel row, but it does
+ * read a lot of rows. pg_sentinel.max_statement_rows and
+ * pg_sentinel.max_session_rows limit the rows a statement and a session may
+ * read from each sentinel relation, and trigger the defensive action when
+ * exceeded. Both are superuser settings, so they can be set per role with
+ * ALTER ROLE ... SET.
+ *
+ * Rows are counted where they leave the scans of sentinel relations, so a
+ * projection, a join or the mode of the checks makes no difference. While a
+ * limit is set, ExecutorStart hooks the scans of sentinel relations into the
+ * tuples they return; COPY TO STDOUT of a table counts the rows it sends.
+ * Rows are counted in the registry cache entry of their relation. The count
+ * is only compared to the row at which the next limit is reached, so the
+ * rows in between cost an increment and a compare. This file is called for
+ * the first row of a relation in a statement, and when a limit is reached.
+ * At statement end, the counts are added to the session totals, kept in a
+ * backend-local hash table, and published to the shared statistics at once.
+ *
+ * Parallel workers count the rows of their own scans, and hand the counts
+ * of their statement to the leader through its slot in shared memory. The
+ * leader adds them to its own once its part of the plan has run, and checks
+ * the limits then.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/parallel.h"
+#include "executor/executor.h"
+#include "lib/ilist.h"
+#include "miscadmin.h"
+#include "nodes/execnodes.h"
+#include "nodes/nodeFuncs.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/procnumber.h"
+#else
+#include "storage/backendid.h"
+#endif
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+
+#include "pg_sentinel.h"
+
+/* Relations whose counts a leader's slot holds at most */
+#define SENTINEL_WORKER_RELATIONS	8
+
+/*
+ * The rows parallel workers counted for a leader, in the leader's slot.
+ * Rows of further relations only make it into the statistics.
+ */
+typedef struct SentinelWorkerRows
+{
+    slock_t		mutex;
+    int			leader_pid;		/* whose rows these are */
+    int			nrelations;
+    Oid			relids[SENTINEL_WORKER_RELATIONS];
+    uint64		rows[SENTINEL_WORKER_RELATIONS];
+    uint64		other;			/* rows of further relations */
+} SentinelWorkerRows;
+
+typedef struct SentinelWorkerRowsState
+{
+    int			nslots;
+    SentinelWorkerRows slots[FLEXIBLE_ARRAY_MEMBER];
+} SentinelWorkerRowsState;
+
+static SentinelWorkerRowsState *worker_rows = NULL;
+
+/*
+ * A hooked scan of a sentinel relation. The entry lives in the query's
+ * es_query_cxt and unlinks itself when that context goes away.
+ */
+typedef struct SentinelRowScan
+{
+    dlist_node	node;
+    PlanState  *state;
+    ExecProcNodeMtd real;		/* the scan's own ExecProcNode */
+    Oid			relid;
+    SentinelRelation *sentinel; /* counts the rows, valid for generation */
+    uint64		generation;
+    MemoryContextCallback cleanup;
+} SentinelRowScan;
+
+static dlist_head row_scans = DLIST_STATIC_INIT(row_scans);
+
+/* The scan that returned the last tuple, which most likely returns the next */
+static SentinelRowScan *last_row_scan = NULL;
+
+/* The rows a session emitted from a sentinel relation */
+typedef struct SentinelRowCounter
+{
+    Oid			relid;			/* hash key, must be first */
+    SentinelRelation *relation; /* cache entry counting the statement, or NULL */
+    uint64		statement;		/* rows of the statement not in relation */
+    uint64		session;		/* rows of the finished statements */
+    bool		touched;		/* in touched_counters */
+} SentinelRowCounter;
+
+static HTAB *row_counters = NULL;
+
+/* The counters of the relations the running statement emitted rows from */
+static SentinelRowCounter **touched_counters = NULL;
+static int	ntouched = 0;
+static int	maxtouched = 0;
+
+static SentinelRowCounter *
+lookup_counter(Oid relid)
+{
+    SentinelRowCounter *counter;
+    bool		found;
+
+    if (row_counters == NULL)
+    {
+        HASHCTL		ctl;
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.keysize = sizeof(Oid);
+        ctl.entrysize = sizeof(SentinelRowCounter);
+        ctl.hcxt = TopMemoryContext;
+        row_counters = hash_create("pg_sentinel row counters", 16, &ctl,
+                                   HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    counter = (SentinelRowCounter *) hash_search(row_counters, &relid,
+                                                 HASH_ENTER, &found);
+    if (!found)
+    {
+        counter->relation = NULL;
+        counter->statement = 0;
+        counter->session = 0;
+        counter->touched = false;
+    }
+
+    return counter;
+}
+
+static void
+touch_counter(SentinelRowCounter *counter)
+{
+    if (counter->touched)
+        return;
+
+    if (ntouched == maxtouched)
+    {
+        maxtouched = Max(maxtouched * 2, 8);
+        if (touched_counters == NULL)
+            touched_counters = MemoryContextAlloc(TopMemoryContext,
+                                                  maxtouched * sizeof(SentinelRowCounter *));
+        else
+            touched_counters = repalloc(touched_counters,
+                                        maxtouched * sizeof(SentinelRowCounter *));
+    }
+
+    touched_counters[ntouched++] = counter;
+    counter->touched = true;
+}
+
+/* This backend's slot, or that of the leader in a parallel worker */
+static SentinelWorkerRows *
+worker_rows_slot(void)
+{
+    int			slot;
+
+    if (worker_rows == NULL)
+        return NULL;
+
+#if PG_VERSION_NUM >= 170000
+    slot = IsParallelWorker() ? ParallelLeaderProcNumber : MyProcNumber;
+#else
+    slot = (IsParallelWorker() ? ParallelLeaderBackendId : MyBackendId) - 1;
+#endif
+
+    if (slot < 0 || slot >= worker_rows->nslots)
+        return NULL;
+
+    return &worker_rows->slots[slot];
+}
+
+Size
+sentinel_rows_shmem_size(void)
+{
+    return add_size(offsetof(SentinelWorkerRowsState, slots),
+                    mul_size(sentinel_backend_slots(),
+                             sizeof(SentinelWorkerRows)));
+}
+
+/*
+ * Initialize the slots in shared memory. Called from the shared memory
+ * startup hook with AddinShmemInitLock held.
+ */
+void
+sentinel_rows_shmem_startup(void)
+{
+    bool		found;
+    int			i;
+
+    worker_rows = ShmemInitStruct("pg_sentinel worker rows",
+                                  sentinel_rows_shmem_size(), &found);
+    if (!found)
+    {
+        worker_rows->nslots = sentinel_backend_slots();
+        for (i = 0; i < worker_rows->nslots; i++)
+        {
+            SpinLockInit(&worker_rows->slots[i].mutex);
+            worker_rows->slots[i].leader_pid = 0;
+            worker_rows->slots[i].nrelations = 0;
+            worker_rows->slots[i].other = 0;
+        }
+    }
+}
+
+/*
+ * In a parallel worker, hand the rows of a relation to the leader. Must not
+ * allocate, since it runs during error cleanup as well.
+ */
+static void
+push_worker_rows(Oid relid, uint64 rows)
+{
+    SentinelWorkerRows *slot = worker_rows_slot();
+    int			i;
+
+    if (slot == NULL || rows == 0)
+        return;
+
+    SpinLockAcquire(&slot->mutex);
+
+    /* left behind by an earlier leader in this slot */
+    if (slot->leader_pid != ParallelLeaderPid)
+    {
+        slot->leader_pid = ParallelLeaderPid;
+        slot->nrelations = 0;
+        slot->other = 0;
+    }
+
+    for (i = 0; i < slot->nrelations; i++)
+    {
+        if (slot->relids[i] == relid)
+            break;
+    }
+
+    if (i < slot->nrelations)
+        slot->rows[i] += rows;
+    else if (slot->nrelations < SENTINEL_WORKER_RELATIONS)
+    {
+        slot->relids[slot->nrelations] = relid;
+        slot->rows[slot->nrelations++] = rows;
+    }
+    else
+        slot->other += rows;
+
+    SpinLockRelease(&slot->mutex);
+}
+
+/*
+ * Take the rows parallel workers handed to this backend out of its slot.
+ * Returns the number of relations.
+ */
+static int
+pull_worker_rows(Oid *relids, uint64 *rows, uint64 *other)
+{
+    SentinelWorkerRows *slot = worker_rows_slot();
+    int			n = 0;
+
+    *other = 0;
+    if (slot == NULL || IsParallelWorker())
+        return 0;
+
+    SpinLockAcquire(&slot->mutex);
+    if (slot->leader_pid == MyProcPid)
+    {
+        n = slot->nrelations;
+        memcpy(relids, slot->relids, sizeof(Oid) * n);
+        memcpy(rows, slot->rows, sizeof(uint64) * n);
+        *other = slot->other;
+    }
+    slot->nrelations = 0;
+    slot->other = 0;
+    SpinLockRelease(&slot->mutex);
+
+    return n;
+}
+
+/*
+ * Add the rows the parallel workers of the running statement have read so
+ * far to its counts, and check the limits.
+ */
+void
+sentinel_rows_collect(void)
+{
+    Oid			relids[SENTINEL_WORKER_RELATIONS];
+    uint64		rows[SENTINEL_WORKER_RELATIONS];
+    uint64		other;
+    int			n = pull_worker_rows(relids, rows, &other);
+    int			i;
+
+    if (other > 0)
+        sentinel_count(SENTINEL_STAT_ROWS, other);
+
+    for (i = 0; i < n; i++)
+    {
+        SentinelRelation *sentinel = sentinel_lookup_relation(relids[i]);
+
+        if (sentinel != NULL)
+        {
+            sentinel->rows += rows[i];
+            sentinel_rows_check(sentinel);
+        }
+        else
+        {
+            SentinelRowCounter *counter = lookup_counter(relids[i]);
+
+            touch_counter(counter);
+            counter->statement += rows[i];
+        }
+    }
+}
+
+static void
+release_row_scan(void *arg)
+{
+    SentinelRowScan *scan = (SentinelRowScan *) arg;
+
+    if (last_row_scan == scan)
+        last_row_scan = NULL;
+    dlist_delete(&scan->node);
+
+    /* the outermost statement counting rows is done */
+    if (dlist_is_empty(&row_scans))
+        sentinel_rows_flush();
+}
+
+static SentinelRowScan *
+lookup_row_scan(PlanState *pstate)
+{
+    dlist_iter	iter;
+
+    if (last_row_scan != NULL && last_row_scan->state == pstate)
+        return last_row_scan;
+
+    dlist_foreach(iter, &row_scans)
+    {
+        SentinelRowScan *scan =
+            dlist_container(SentinelRowScan, node, iter.cur);
+
+        if (scan->state == pstate)
+        {
+            last_row_scan = scan;
+            return scan;
+        }
+    }
+
+    elog(ERROR, "pg_sentinel: scan not registered");
+    return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * ExecProcNode of a hooked scan.
+ */
+static TupleTableSlot *
+sentinel_row_scan_next(PlanState *pstate)
+{
+    SentinelRowScan *scan = lookup_row_scan(pstate);
+    TupleTableSlot *slot = scan->real(pstate);
+
+    if (!TupIsNull(slot))
+    {
+        uint64		generation = sentinel_registry_generation();
+
+        if (scan->generation != generation)
+        {
+            scan->sentinel = sentinel_lookup_relation(scan->relid);
+            scan->generation = generation;
+        }
+
+        if (scan->sentinel != NULL)
+            sentinel_count_row(scan->sentinel);
+    }
+
+    return slot;
+}
+
+static void
+hook_row_scan(ScanState *state)
+{
+    EState	   *estate = state->ps.state;
+    SentinelRowScan *scan;
+
+    if (state->ss_currentRelation == NULL ||
+        sentinel_lookup_relation(RelationGetRelid(state->ss_currentRelation)) == NULL)
+        return;
+
+    scan = MemoryContextAllocZero(estate->es_query_cxt,
+                                  sizeof(SentinelRowScan));
+    scan->state = &state->ps;
+    scan->real = state->ps.ExecProcNodeReal;
+    scan->relid = RelationGetRelid(state->ss_currentRelation);
+    scan->generation = sentinel_registry_generation() - 1;
+    scan->cleanup.func = release_row_scan;
+    scan->cleanup.arg = scan;
+    MemoryContextRegisterResetCallback(estate->es_query_cxt, &scan->cleanup);
+    dlist_push_head(&row_scans, &scan->node);
+
+    /* the first call still goes through ExecProcNodeFirst() */
+    ExecSetExecProcNode(&state->ps, sentinel_row_scan_next);
+}
+
+static bool
+hook_walker(PlanState *planstate, void *context)
+{
+    if (planstate == NULL)
+        return false;
+
+    switch (nodeTag(planstate))
+    {
+        case T_SeqScanState:
+        case T_SampleScanState:
+        case T_IndexScanState:
+        case T_IndexOnlyScanState:
+        case T_BitmapHeapScanState:
+        case T_TidScanState:
+#if PG_VERSION_NUM >= 140000
+        case T_TidRangeScanState:
+#endif
+        case T_ForeignScanState:
+        case T_CustomScanState:
+            hook_row_scan((ScanState *) planstate);
+            break;
+        default:
+            break;
+    }
+
+    return planstate_tree_walker(planstate, hook_walker, context);
+}
+
+/*
+ * Hook the scans of sentinel relations in a query that has just been
+ * started, to count the rows they return. Called after the index-only scans
+ * got their checks, so the rows are counted after those.
+ */
+void
+sentinel_rows_hook_scans(QueryDesc *queryDesc)
+{
+    hook_walker(queryDesc->planstate, NULL);
+}
+
+/*
+ * Check the row limits of a relation the running statement read rows
+ * from, and set the row at which to check them next.
+ */
+void
+sentinel_rows_check(SentinelRelation *sentinel)
+{
+    SentinelRowCounter *counter = lookup_counter(sentinel->relid);
+    uint64		statement;
+    uint64		limit = PG_UINT64_MAX;
+
+    touch_counter(counter);
+    counter->relation = sentinel;
+    statement = counter->statement + sentinel->rows;
+
+    if (sentinel_max_statement_rows > 0)
+        limit = (uint64) sentinel_max_statement_rows;
+    if (sentinel_max_session_rows > 0)
+    {
+        uint64		left = 0;
+
+        if ((uint64) sentinel_max_session_rows > counter->session)
+            left = (uint64) sentinel_max_session_rows - counter->session;
+        limit = Min(limit, left);
+    }
+
+    if (limit == PG_UINT64_MAX)
+    {
+        sentinel->row_check = PG_UINT64_MAX;
+        return;
+    }
+
+    if (statement > limit)
+    {
+        int			level = WARNING;
+        int			i;
+
+        /* the strongest action of the relation's sentinel columns */
+        for (i = 0; i < sentinel->ncolumns; i++)
+            level = Max(level, sentinel->columns[i].elevel);
+
+        /* a warning is given once per statement */
+        sentinel->row_check = PG_UINT64_MAX;
+        sentinel_report(level, sentinel->relid, InvalidAttrNumber,
+                        statement - 1);
+        return;
+    }
+
+    sentinel->row_check = limit - counter->statement + 1;
+}
+
+/*
+ * Take the counts of the running statement out of the registry cache,
+ * which is about to be rebuilt. The new cache entries check the limits
+ * again on their first row.
+ */
+void
+sentinel_rows_save(void)
+{
+    int			i;
+
+    for (i = 0; i < ntouched; i++)
+    {
+        SentinelRowCounter *counter = touched_counters[i];
+
+        if (counter->relation != NULL)
+        {
+            counter->statement += counter->relation->rows;
+            counter->relation = NULL;
+        }
+    }
+}
+
+/*
+ * End of statement: add its rows to the session totals and the statistics,
+ * and start counting anew. A parallel worker hands its rows to the leader
+ * instead. Runs during error cleanup as well, so it must not allocate.
+ */
+void
+sentinel_rows_flush(void)
+{
+    Oid			relids[SENTINEL_WORKER_RELATIONS];
+    uint64		pulled[SENTINEL_WORKER_RELATIONS];
+    uint64		rows;
+    int			n;
+    int			i;
+
+    /* rows of workers that finished after the leader last collected */
+    n = pull_worker_rows(relids, pulled, &rows);
+    for (i = 0; i < n; i++)
+    {
+        SentinelRowCounter *counter = NULL;
+
+        if (row_counters != NULL)
+            counter = (SentinelRowCounter *) hash_search(row_counters,
+                                                         &relids[i],
+                                                         HASH_FIND, NULL);
+        if (counter != NULL)
+            counter->session += pulled[i];
+        rows += pulled[i];
+    }
+
+    for (i = 0; i < ntouched; i++)
+    {
+        SentinelRowCounter *counter = touched_counters[i];
+
+        if (counter->relation != NULL)
+        {
+            counter->statement += counter->relation->rows;
+            counter->relation->rows = 0;
+            counter->relation->row_check = 1;
+            counter->relation = NULL;
+        }
+
+        if (IsParallelWorker())
+            push_worker_rows(counter->relid, counter->statement);
+        else
+        {
+            counter->session += counter->statement;
+            rows += counter->statement;
+        }
+        counter->statement = 0;
+        counter->touched = false;
+    }
+    ntouched = 0;
+
+    if (rows > 0)
+        sentinel_count(SENTINEL_STAT_ROWS, rows);
+}
@@ -0,0 +1,639 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_scan.c
+ *
+ * Scan-level sentinel enforcement.
+ *
+ * After planning, every scan of a sentinel relation gets a call of
+ * pg_sentinel.sentinel_check() appended to its quals, using the real
+ * attribute number of each sentinel column. The check therefore runs once
+ * per tuple read from the sentinel relation, after the scan's own quals and
+ * before any join, sort or aggregate above it, and regardless of whether or
+ * where the column is projected. Tuples of other relations never pay for it.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "catalog/pg_attribute.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "optimizer/restrictinfo.h"
+#include "parser/parse_func.h"
+#include "parser/parsetree.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/syscache.h"
+
+#include "pg_sentinel.h"
+
+/* Cached per call site of pg_sentinel.sentinel_check() */
+typedef struct SentinelCheckCache
+{
+    uint64		generation;		/* registry generation of column */
+    SentinelColumn *column;
+    Oid			argtype;		/* type of the value argument */
+    int16		argtyplen;
+    bool		fits;			/* can the values be compared to column's? */
+} SentinelCheckCache;
+
+PG_FUNCTION_INFO_V1(pg_sentinel_check);
+
+/* OID of the check function, or InvalidOid, while check_function_valid */
+static Oid	check_function = InvalidOid;
+static bool check_function_valid = false;
+
+/*
+ * Any change to pg_proc may be the creation or the removal of the check
+ * function, e.g. by CREATE or DROP EXTENSION, so look it up again.
+ */
+static void
+check_function_callback(Datum arg, int cacheid, uint32 hashvalue)
+{
+    check_function_valid = false;
+}
+
+/*
+ * Look up pg_sentinel.sentinel_check(), or InvalidOid if the extension is
+ * not installed in the current database. The result is cached until the
+ * next change to pg_proc, so statements pay no catalog lookup for it.
+ */
+Oid
+sentinel_check_function(void)
+{
+    Oid			argtypes[4] = {ANYELEMENTOID, OIDOID, INT2OID, TIDOID};
+
+    if (!check_function_valid)
+    {
+        /* an invalidation during the lookup leaves the cache invalid */
+        check_function_valid = true;
+        check_function = LookupFuncName(list_make2(makeString("pg_sentinel"),
+                                                   makeString("sentinel_check")),
+                                        4, argtypes, true);
+    }
+
+    return check_function;
+}
+
+void
+sentinel_scan_init(void)
+{
+    CacheRegisterSyscacheCallback(PROCOID, check_function_callback, (Datum) 0);
+}
+
+static bool
+reject_check_calls_walker(Node *node, Oid *funcid)
+{
+    if (node == NULL)
+        return false;
+
+    if (IsA(node, FuncExpr))
+    {
+        if (((FuncExpr *) node)->funcid == *funcid)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                     errmsg("function pg_sentinel.sentinel_check() cannot be called directly"),
+                     errdetail("The function is only added to queries by pg_sentinel itself.")));
+    }
+
+    if (IsA(node, Query))
+        return query_tree_walker((Query *) node, reject_check_calls_walker,
+                                 (void *) funcid, 0);
+
+    return expression_tree_walker(node, reject_check_calls_walker,
+                                  (void *) funcid);
+}
+
+/*
+ * Reject a query that calls the check function itself.
+ *
+ * The function reports whatever relation and column it is given, so a
+ * direct call could probe values for being sentinel values or write forged
+ * hit records. Only the planner hook may add calls. This runs after parse
+ * analysis, which rejects views and rules calling the function when they
+ * are defined, and again on the rewritten query ahead of the planner, for
+ * the calls that parse analysis did not see, e.g. in row security policies
+ * and column defaults.
+ */
+void
+sentinel_reject_check_calls(Query *query)
+{
+    Oid			funcid = sentinel_check_function();
+
+    /* without the extension, there is nothing to call */
+    if (OidIsValid(funcid))
+        (void) reject_check_calls_walker((Node *) query, &funcid);
+}
+
+/*
+ * Build the call of the check function for one sentinel column, reading the
+ * column through the given varno and attribute number. If with_tid is set,
+ * the tuple's ctid is passed along for the block map.
+ */
+static Expr *
+make_check_call(Oid funcid, Index varno, AttrNumber varattno,
+                Oid relid, AttrNumber attnum, bool with_tid)
+{
+    HeapTuple	tuple;
+    Form_pg_attribute att;
+    Var		   *var;
+    Expr	   *tid;
+
+    tuple = SearchSysCache2(ATTNUM, ObjectIdGetDatum(relid),
+                            Int16GetDatum(attnum));
+    if (!HeapTupleIsValid(tuple))
+        return NULL;
+
+    att = (Form_pg_attribute) GETSTRUCT(tuple);
+    if (att->attisdropped)
+    {
+        ReleaseSysCache(tuple);
+        return NULL;
+    }
+
+    var = makeVar(varno, varattno, att->atttypid, att->atttypmod,
+                  att->attcollation, 0);
+    ReleaseSysCache(tuple);
+
+    if (with_tid)
+        tid = (Expr *) makeVar(varno, SelfItemPointerAttributeNumber, TIDOID,
+                               -1, InvalidOid, 0);
+    else
+        tid = (Expr *) makeNullConst(TIDOID, -1, InvalidOid);
+
+    return (Expr *) makeFuncExpr(funcid, BOOLOID,
+                                 list_make4(var,
+                                            makeConst(OIDOID, -1, InvalidOid,
+                                                      sizeof(Oid),
+                                                      ObjectIdGetDatum(relid),
+                                                      false, true),
+                                            makeConst(INT2OID, -1, InvalidOid,
+                                                      sizeof(int16),
+                                                      Int16GetDatum(attnum),
+                                                      false, true),
+                                            tid),
+                                 InvalidOid, var->varcollid,
+                                 COERCE_EXPLICIT_CALL);
+}
+
+/*
+ * For an index-only scan, find the index column that holds the given heap
+ * attribute, or InvalidAttrNumber. The indextlist Vars reference the heap
+ * columns.
+ */
+AttrNumber
+sentinel_index_column(IndexOnlyScan *scan, AttrNumber attnum)
+{
+    ListCell   *lc;
+
+    foreach(lc, scan->indextlist)
+    {
+        TargetEntry *tle = (TargetEntry *) lfirst(lc);
+
+        if (IsA(tle->expr, Var) && ((Var *) tle->expr)->varattno == attnum)
+            return tle->resno;
+    }
+
+    return InvalidAttrNumber;
+}
+
+/*
+ * Collect the attribute numbers of the columns that the quals of a scan
+ * check already, by the column the value argument reads. That is the
+ * scan's own column even for checks an inheritance child got from its
+ * parent, whose relid and attnum arguments are those of the parent.
+ */
+Bitmapset *
+sentinel_checked_columns(Plan *plan, Oid funcid)
+{
+    Bitmapset  *checked = NULL;
+    ListCell   *lc;
+
+    foreach(lc, plan->qual)
+    {
+        FuncExpr   *expr = (FuncExpr *) lfirst(lc);
+        Var		   *var;
+
+        if (!IsA(expr, FuncExpr) || expr->funcid != funcid)
+            continue;
+
+        var = (Var *) linitial(expr->args);
+        if (!IsA(var, Var))
+            continue;
+
+        /* index-only scans read the index columns */
+        if (var->varno == INDEX_VAR && IsA(plan, IndexOnlyScan))
+        {
+            TargetEntry *tle = get_tle_by_resno(((IndexOnlyScan *) plan)->indextlist,
+                                                var->varattno);
+
+            if (tle == NULL || !IsA(tle->expr, Var))
+                continue;
+            var = (Var *) tle->expr;
+        }
+
+        if (var->varattno > 0)
+            checked = bms_add_member(checked, var->varattno);
+    }
+
+    return checked;
+}
+
+/*
+ * Append the checks to a scan node, if it scans a sentinel relation. Columns
+ * that the quals of the scan check already, as in qual mode, are skipped.
+ */
+static void
+protect_scan(Scan *scan, List *rtable, Oid funcid)
+{
+    RangeTblEntry *rte = rt_fetch(scan->scanrelid, rtable);
+    SentinelRelation *sentinel;
+    Bitmapset  *checked;
+    List	   *checks = NIL;
+    int			i;
+
+    if (rte->rtekind != RTE_RELATION)
+        return;
+
+    sentinel = sentinel_lookup_relation(rte->relid);
+    if (sentinel == NULL)
+        return;
+
+    checked = sentinel_checked_columns(&scan->plan, funcid);
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        AttrNumber	attnum = sentinel->columns[i].attnum;
+        Expr	   *check;
+
+        if (bms_is_member(attnum, checked))
+            continue;
+
+        if (IsA(scan, IndexOnlyScan))
+        {
+            AttrNumber	indexcol = sentinel_index_column((IndexOnlyScan *) scan,
+                                                         attnum);
+
+            /* not in the index, checked at execution by sentinel_index.c */
+            if (indexcol == InvalidAttrNumber)
+                continue;
+            /* the index has no ctid to offer, so no block map either */
+            check = make_check_call(funcid, INDEX_VAR, indexcol,
+                                    rte->relid, attnum, false);
+        }
+        else
+            check = make_check_call(funcid, scan->scanrelid, attnum,
+                                    rte->relid, attnum,
+                                    sentinel->columns[i].block_map != NULL);
+
+        if (check != NULL)
+            checks = lappend(checks, check);
+    }
+
+    /* last, so only tuples passing the scan's own quals are checked */
+    scan->plan.qual = list_concat(scan->plan.qual, checks);
+}
+
+/*
+ * Walk a plan tree and protect its scans. If protect is false, scans are
+ * left alone until the walk enters the subplan of a Gather or Gather Merge,
+ * i.e. the part of the plan that runs in the parallel workers.
+ */
+static void
+protect_plan_tree(Plan *plan, List *rtable, Oid funcid, bool protect)
+{
+    ListCell   *lc;
+
+    if (plan == NULL)
+        return;
+
+    if (IsA(plan, Gather) || IsA(plan, GatherMerge))
+        protect = true;
+
+    switch (nodeTag(plan))
+    {
+        case T_SeqScan:
+        case T_SampleScan:
+        case T_IndexScan:
+        case T_IndexOnlyScan:
+        case T_BitmapHeapScan:
+        case T_TidScan:
+#if PG_VERSION_NUM >= 140000
+        case T_TidRangeScan:
+#endif
+            if (protect)
+                protect_scan((Scan *) plan, rtable, funcid);
+            break;
+        case T_Append:
+            foreach(lc, ((Append *) plan)->appendplans)
+                protect_plan_tree((Plan *) lfirst(lc), rtable, funcid, protect);
+            break;
+        case T_MergeAppend:
+            foreach(lc, ((MergeAppend *) plan)->mergeplans)
+                protect_plan_tree((Plan *) lfirst(lc), rtable, funcid, protect);
+            break;
+        case T_SubqueryScan:
+            protect_plan_tree(((SubqueryScan *) plan)->subplan, rtable, funcid,
+                              protect);
+            break;
+        case T_CustomScan:
+            foreach(lc, ((CustomScan *) plan)->custom_plans)
+                protect_plan_tree((Plan *) lfirst(lc), rtable, funcid, protect);
+            break;
+        default:
+            break;
+    }
+
+    protect_plan_tree(plan->lefttree, rtable, funcid, protect);
+    protect_plan_tree(plan->righttree, rtable, funcid, protect);
+}
+
+/*
+ * Inject the sentinel checks into the scans of sentinel relations. With
+ * parallel_only, only the scans run by parallel workers are protected.
+ */
+void
+sentinel_protect_plan(PlannedStmt *plannedstmt, Oid funcid, bool parallel_only)
+{
+    PlanInvalItem *inval_item;
+    ListCell   *lc;
+
+    protect_plan_tree(plannedstmt->planTree, plannedstmt->rtable, funcid,
+                      !parallel_only);
+
+    foreach(lc, plannedstmt->subplans)
+        protect_plan_tree((Plan *) lfirst(lc), plannedstmt->rtable, funcid,
+                          !parallel_only);
+
+    /* the plan now depends on the check function */
+    inval_item = makeNode(PlanInvalItem);
+    inval_item->cacheId = PROCOID;
+    inval_item->hashValue = GetSysCacheHashValue1(PROCOID,
+                                                  ObjectIdGetDatum(funcid));
+    plannedstmt->invalItems = lappend(plannedstmt->invalItems, inval_item);
+}
+
+static bool
+is_sentinel_rel(Index rti, List *rtable)
+{
+    RangeTblEntry *rte = rt_fetch(rti, rtable);
+
+    return rte->rtekind == RTE_RELATION &&
+        sentinel_lookup_relation(rte->relid) != NULL;
+}
+
+/*
+ * Walk a plan tree for the kinds of scans of sentinel relations that need
+ * more than the checks in the plan.
+ */
+static void
+plan_scans_walker(Plan *plan, List *rtable, int *scans)
+{
+    ListCell   *lc;
+
+    if (plan == NULL)
+        return;
+
+    switch (nodeTag(plan))
+    {
+        case T_SeqScan:
+        case T_SampleScan:
+        case T_IndexScan:
+        case T_BitmapHeapScan:
+        case T_TidScan:
+#if PG_VERSION_NUM >= 140000
+        case T_TidRangeScan:
+#endif
+        case T_ForeignScan:
+            if (((Scan *) plan)->scanrelid > 0 &&
+                is_sentinel_rel(((Scan *) plan)->scanrelid, rtable))
+                *scans |= SENTINEL_SCANS_RELATION;
+            break;
+        case T_IndexOnlyScan:
+            if (is_sentinel_rel(((Scan *) plan)->scanrelid, rtable))
+                *scans |= SENTINEL_SCANS_RELATION | SENTINEL_SCANS_INDEX_ONLY;
+            break;
+        case T_CustomScan:
+            {
+                CustomScan *cscan = (CustomScan *) plan;
+                int			rti = -1;
+
+                if (cscan->scan.scanrelid > 0 &&
+                    is_sentinel_rel(cscan->scan.scanrelid, rtable))
+                    *scans |= SENTINEL_SCANS_RELATION;
+
+                while ((rti = bms_next_member(cscan->custom_relids, rti)) >= 0)
+                {
+                    if (is_sentinel_rel(rti, rtable))
+                        *scans |= SENTINEL_SCANS_CUSTOM;
+                }
+
+                foreach(lc, cscan->custom_plans)
+                    plan_scans_walker((Plan *) lfirst(lc), rtable, scans);
+            }
+            break;
+        case T_Append:
+            foreach(lc, ((Append *) plan)->appendplans)
+                plan_scans_walker((Plan *) lfirst(lc), rtable, scans);
+            break;
+        case T_MergeAppend:
+            foreach(lc, ((MergeAppend *) plan)->mergeplans)
+                plan_scans_walker((Plan *) lfirst(lc), rtable, scans);
+            break;
+        case T_SubqueryScan:
+            plan_scans_walker(((SubqueryScan *) plan)->subplan, rtable, scans);
+            break;
+        default:
+            break;
+    }
+
+    plan_scans_walker(plan->lefttree, rtable, scans);
+    plan_scans_walker(plan->righttree, rtable, scans);
+}
+
+/*
+ * Find out which kinds of scans of sentinel relations a plan has, as
+ * SENTINEL_SCANS_* flags.
+ *
+ * All scans of sentinel relations get their rows counted at execution, see
+ * sentinel_rows.c, and index-only scans their tuples checked, see
+ * sentinel_index.c. Custom scan providers, such as those of columnar access
+ * methods, decide at planning time which columns they read, and need not
+ * evaluate the quals of their node at all, so the checks cannot be injected
+ * into their nodes. The output of such plans is inspected instead, as in
+ * executor mode.
+ */
+int
+sentinel_plan_scans(PlannedStmt *plannedstmt)
+{
+    int			scans = 0;
+    ListCell   *lc;
+
+    plan_scans_walker(plannedstmt->planTree, plannedstmt->rtable, &scans);
+
+    foreach(lc, plannedstmt->subplans)
+        plan_scans_walker((Plan *) lfirst(lc), plannedstmt->rtable, &scans);
+
+    return scans;
+}
+
+/*
+ * Check whether an inheritance parent has a foreign table among its
+ * descendants.
+ */
+bool
+sentinel_has_foreign_children(Oid relid)
+{
+    ListCell   *lc;
+
+    foreach(lc, find_all_inheritors(relid, NoLock, NULL))
+    {
+        if (get_rel_relkind(lfirst_oid(lc)) == RELKIND_FOREIGN_TABLE)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Add the checks to the restriction clauses of a base relation, before the
+ * planner builds its paths.
+ *
+ * The checks get the security level of the query's own quals. The check
+ * function is not leakproof, so the planner never runs them ahead of the
+ * quals of security barrier views and row security policies, and with the
+ * function's cost, they are ordered behind the cheaper quals of the scan.
+ *
+ * The restriction clauses of a child are always replaced by those of its
+ * parent, translated to the child's columns, so children get their checks
+ * from an inheritance parent (inhparent). Such checks name the parent's
+ * column and pass no tid, since the parent's block map does not apply to
+ * the children's tuples.
+ */
+void
+sentinel_protect_rel(PlannerInfo *root, RelOptInfo *rel, Oid relid, Oid funcid,
+                     bool inhparent)
+{
+    SentinelRelation *sentinel = sentinel_lookup_relation(relid);
+    int			i;
+
+    if (sentinel == NULL)
+        return;
+
+    for (i = 0; i < sentinel->ncolumns; i++)
+    {
+        AttrNumber	attnum = sentinel->columns[i].attnum;
+        Expr	   *check;
+        RestrictInfo *rinfo;
+
+        /* a ctid reference would rule out index-only scans, so only if used */
+        check = make_check_call(funcid, rel->relid, attnum, relid, attnum,
+                                !inhparent &&
+                                sentinel->columns[i].block_map != NULL);
+        if (check == NULL)
+            continue;
+
+#if PG_VERSION_NUM >= 160000
+        rinfo = make_restrictinfo(root, check, true, false, false, false,
+                                  root->qual_security_level, rel->relids,
+                                  NULL, NULL);
+#elif PG_VERSION_NUM >= 140000
+        rinfo = make_restrictinfo(root, check, true, false, false,
+                                  root->qual_security_level, rel->relids,
+                                  NULL, NULL);
+#else
+        rinfo = make_restrictinfo(check, true, false, false,
+                                  root->qual_security_level, rel->relids,
+                                  NULL, NULL);
+#endif
+
+        rel->baserestrictinfo = lappend(rel->baserestrictinfo, rinfo);
+        rel->baserestrict_min_security = Min(rel->baserestrict_min_security,
+                                             rinfo->security_level);
+    }
+}
+
+/*
+ * pg_sentinel.sentinel_check(value, relid, attnum, tid)
+ *
+ * Triggers the defensive action if value is a sentinel value of the given
+ * column, and returns true otherwise. NULL values never match. If tid is
+ * given and lies outside the column's block map, or is not in the column's
+ * row map, value is not looked at.
+ */
+Datum
+pg_sentinel_check(PG_FUNCTION_ARGS)
+{
+    SentinelCheckCache *cache = (SentinelCheckCache *) fcinfo->flinfo->fn_extra;
+    uint64		generation;
+    instr_time	start;
+
+    if (PG_ARGISNULL(0) || sentinel_session_exempt())
+        PG_RETURN_BOOL(true);
+
+    generation = sentinel_registry_generation();
+
+    if (cache == NULL)
+    {
+        cache = (SentinelCheckCache *)
+            MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+                                   sizeof(SentinelCheckCache));
+        cache->argtype = get_fn_expr_argtype(fcinfo->flinfo, 0);
+        cache->argtyplen = get_typlen(cache->argtype);
+        cache->generation = generation - 1;
+        fcinfo->flinfo->fn_extra = cache;
+    }
+
+    if (cache->generation != generation)
+    {
+        cache->column = sentinel_lookup_column(PG_GETARG_OID(1),
+                                               PG_GETARG_INT16(2));
+        cache->fits = cache->column != NULL &&
+            sentinel_column_fits(cache->column, cache->argtype,
+                                 cache->argtyplen);
+        cache->generation = generation;
+    }
+
+    if (!cache->fits)
+        PG_RETURN_BOOL(true);
+
+    if (!PG_ARGISNULL(3) &&
+        (!sentinel_column_covers(cache->column, PG_GETARG_ITEMPOINTER(3)) ||
+         (cache->column->row_map != NULL &&
+          ItemPointerIsValid(PG_GETARG_ITEMPOINTER(3)) &&
+          !sentinel_column_is_row(cache->column, PG_GETARG_ITEMPOINTER(3)))))
+    {
+        sentinel_count(SENTINEL_STAT_FILTERED, 1);
+        PG_RETURN_BOOL(true);
+    }
+
+    if (sentinel_track_timing)
+        INSTR_TIME_SET_CURRENT(start);
+    sentinel_explain_start();
+
+    sentinel_count(SENTINEL_STAT_CHECKED, 1);
+    TRACE_PG_SENTINEL_CHECK(PG_GETARG_OID(1), 1);
+
+    if (sentinel_column_match(cache->column, PG_GETARG_DATUM(0)))
+    {
+        sentinel_count(SENTINEL_STAT_HITS, 1);
+        sentinel_report(cache->column->elevel, PG_GETARG_OID(1),
+                        cache->column->attnum, sentinel_rows_processed());
+    }
+
+    sentinel_explain_stop();
+    if (sentinel_track_timing)
+        sentinel_count_time(start);
+
+    PG_RETURN_BOOL(true);
+}
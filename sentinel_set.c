@@ -0,0 +1,735 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_set.c
+ *
+ * Immutable sentinel value sets with a perfect hash.
+ *
+ * The values are placed with a hash-and-displace scheme: every value is
+ * hashed once, the hash selects a bucket and two slot hashes, and each
+ * bucket gets a displacement chosen at build time so that no two values
+ * share a slot. A lookup therefore costs one hash, one slot read and at
+ * most one compare, regardless of the number of values in the set.
+ *
+ * Large sets can additionally carry a blocked Bloom filter, derived from the
+ * same hash. Since each value maps to bits within a single cache line of the
+ * filter, a value that is not in the set is usually rejected with one memory
+ * access, without touching the slots or the values themselves.
+ *
+ * Sets built for contains matching look for the values anywhere in the
+ * data. The data is scanned a vector at a time for the leading bytes of the
+ * values, using PostgreSQL's portable SIMD primitives, and only positions
+ * whose first two bytes begin some value are probed like a prefix. In text
+ * that holds no sentinel, most vectors are therefore passed over with a few
+ * compares, no matter how many values the set has.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/detoast.h"
+#include "common/hashfn.h"
+#include "fmgr.h"
+#include "port/pg_bitutils.h"
+#if PG_VERSION_NUM >= 160000
+#include "port/simd.h"
+#define SENTINEL_USE_VECTOR8
+#endif
+
+#include "pg_sentinel.h"
+
+/* Give up on a seed after this many displacements for a single bucket */
+#define SENTINEL_MAX_DISPLACEMENT	65535
+/* Give up building the set after this many seeds */
+#define SENTINEL_MAX_SEEDS			64
+
+/* Bloom filter geometry: 512-bit blocks, 12 bits per value, 6 probes */
+#define BLOOM_BLOCK_WORDS			8
+#define BLOOM_BLOCK_BITS			(BLOOM_BLOCK_WORDS * 64)
+#define BLOOM_BITS_PER_VALUE		12
+#define BLOOM_PROBES				6
+
+/* Up to this many distinct leading bytes are searched for a vector at a time */
+#define SENTINEL_MAX_ANCHORS		4
+/* Bitmap of all pairs of leading bytes */
+#define BIGRAM_WORDS				(65536 / 64)
+
+typedef struct SentinelValue
+{
+    uint32		offset;			/* offset of the payload from the set start */
+    uint32		len;			/* payload length in bytes */
+} SentinelValue;
+
+struct SentinelSet
+{
+    uint32		size;			/* total size of the set in bytes */
+    uint32		nvalues;
+    uint32		nslots;			/* power of two, at least 2 * nvalues */
+    uint32		nbuckets;
+    uint64		seed;
+    uint32		nlengths;		/* number of distinct value lengths */
+    uint32		min_len;
+    uint32		max_len;
+    uint32		lengths_off;	/* uint32[nlengths], ascending */
+    uint32		disp_off;		/* uint16[nbuckets] */
+    uint32		slots_off;		/* uint32[nslots], value index + 1 or 0 */
+    uint32		values_off;		/* SentinelValue[nvalues] */
+    uint32		bloom_off;		/* uint64[nbloom * 8], or 0 if no filter */
+    uint32		nbloom;			/* number of filter blocks, power of two */
+    uint32		bigrams_off;	/* uint64[BIGRAM_WORDS], or 0 for prefix sets */
+    uint32		nanchors;		/* distinct leading bytes, if few enough */
+    uint8		anchors[SENTINEL_MAX_ANCHORS];
+    uint8		first_bytes[32];	/* bitmap of the values' leading bytes */
+};
+
+#define SET_ARRAY(set, type, off)	((type *) ((char *) (set) + (set)->off))
+
+/* Per-value hashes used while building the set */
+typedef struct SentinelHash
+{
+    uint64		raw;
+    uint32		bucket;
+    uint32		f;
+    uint32		g;
+} SentinelHash;
+
+static inline void
+sentinel_hash(const char *data, Size len, uint64 seed, uint32 nbuckets,
+              SentinelHash *h)
+{
+    uint64		hash = hash_bytes_extended((const unsigned char *) data,
+                                           (int) len, seed);
+
+    h->raw = hash;
+    h->bucket = (uint32) (hash >> 32) % nbuckets;
+    h->f = (uint32) hash;
+    /* an odd step keeps the displaced slots distinct modulo nslots */
+    h->g = ((uint32) (hash >> 21)) | 1;
+}
+
+static inline uint32
+sentinel_slot(const SentinelHash *h, uint32 displacement, uint32 nslots)
+{
+    return (h->f + displacement * h->g) & (nslots - 1);
+}
+
+/*
+ * Find the filter block of a hash, and the bits to test within it.
+ */
+static inline const uint64 *
+bloom_block(const uint64 *bloom, uint32 nbloom, uint64 hash)
+{
+    return bloom + ((uint32) (hash >> 40) & (nbloom - 1)) * BLOOM_BLOCK_WORDS;
+}
+
+static inline uint64
+bloom_bits(uint64 hash)
+{
+    return hash * UINT64CONST(0x9E3779B97F4A7C15);
+}
+
+static void
+bloom_add(uint64 *bloom, uint32 nbloom, uint64 hash)
+{
+    uint64	   *block = (uint64 *) bloom_block(bloom, nbloom, hash);
+    uint64		bits = bloom_bits(hash);
+    int			i;
+
+    for (i = 0; i < BLOOM_PROBES; i++)
+    {
+        uint32		bit = (uint32) (bits >> (9 * i)) & (BLOOM_BLOCK_BITS - 1);
+
+        block[bit >> 6] |= UINT64CONST(1) << (bit & 63);
+    }
+}
+
+static inline bool
+bloom_test(const uint64 *bloom, uint32 nbloom, uint64 hash)
+{
+    const uint64 *block = bloom_block(bloom, nbloom, hash);
+    uint64		bits = bloom_bits(hash);
+    int			i;
+
+    for (i = 0; i < BLOOM_PROBES; i++)
+    {
+        uint32		bit = (uint32) (bits >> (9 * i)) & (BLOOM_BLOCK_BITS - 1);
+
+        if (!(block[bit >> 6] & (UINT64CONST(1) << (bit & 63))))
+            return false;
+    }
+
+    return true;
+}
+
+static int
+compare_text(const void *a, const void *b)
+{
+    const text *ta = *(text *const *) a;
+    const text *tb = *(text *const *) b;
+    int			la = VARSIZE_ANY_EXHDR(ta);
+    int			lb = VARSIZE_ANY_EXHDR(tb);
+    int			cmp = memcmp(VARDATA_ANY(ta), VARDATA_ANY(tb), Min(la, lb));
+
+    if (cmp != 0)
+        return cmp;
+    return (la > lb) - (la < lb);
+}
+
+static int
+compare_uint32(const void *a, const void *b)
+{
+    uint32		ua = *(const uint32 *) a;
+    uint32		ub = *(const uint32 *) b;
+
+    return (ua > ub) - (ua < ub);
+}
+
+static int
+compare_bucket_size(const void *a, const void *b, void *arg)
+{
+    const int  *bucket_size = (const int *) arg;
+    int			sa = bucket_size[*(const int *) a];
+    int			sb = bucket_size[*(const int *) b];
+
+    return (sa < sb) - (sa > sb);
+}
+
+/*
+ * Try to place all values with the given seed. Returns false if some bucket
+ * could not be displaced into free slots.
+ */
+static bool
+place_values(text **values, int nvalues, uint64 seed, uint32 nbuckets,
+             uint32 nslots, uint16 *displacements, uint32 *slots)
+{
+    SentinelHash *hashes = palloc(sizeof(SentinelHash) * nvalues);
+    int		   *bucket_size = palloc0(sizeof(int) * nbuckets);
+    int		   *bucket_start = palloc0(sizeof(int) * (nbuckets + 1));
+    int		   *members = palloc(sizeof(int) * nvalues);
+    int		   *order = palloc(sizeof(int) * nbuckets);
+    uint32	   *candidate = palloc(sizeof(uint32) * nvalues);
+    bool		ok = true;
+    int			i;
+
+    memset(slots, 0, sizeof(uint32) * nslots);
+    memset(displacements, 0, sizeof(uint16) * nbuckets);
+
+    for (i = 0; i < nvalues; i++)
+    {
+        sentinel_hash(VARDATA_ANY(values[i]), VARSIZE_ANY_EXHDR(values[i]),
+                      seed, nbuckets, &hashes[i]);
+        bucket_size[hashes[i].bucket]++;
+    }
+
+    /* group the values by bucket */
+    for (i = 0; i < (int) nbuckets; i++)
+        bucket_start[i + 1] = bucket_start[i] + bucket_size[i];
+    memset(bucket_size, 0, sizeof(int) * nbuckets);
+    for (i = 0; i < nvalues; i++)
+    {
+        uint32		b = hashes[i].bucket;
+
+        members[bucket_start[b] + bucket_size[b]++] = i;
+    }
+
+    /* place the largest buckets first, while most slots are still free */
+    for (i = 0; i < (int) nbuckets; i++)
+        order[i] = i;
+    qsort_arg(order, nbuckets, sizeof(int), compare_bucket_size, bucket_size);
+
+    for (i = 0; i < (int) nbuckets && ok; i++)
+    {
+        int			b = order[i];
+        int			n = bucket_size[b];
+        uint32		d;
+
+        if (n == 0)
+            break;
+
+        for (d = 0; d <= SENTINEL_MAX_DISPLACEMENT; d++)
+        {
+            bool		fits = true;
+            int			j;
+
+            for (j = 0; j < n && fits; j++)
+            {
+                int			k;
+
+                candidate[j] = sentinel_slot(&hashes[members[bucket_start[b] + j]],
+                                             d, nslots);
+                if (slots[candidate[j]] != 0)
+                    fits = false;
+                for (k = 0; k < j && fits; k++)
+                    if (candidate[k] == candidate[j])
+                        fits = false;
+            }
+
+            if (fits)
+            {
+                displacements[b] = (uint16) d;
+                for (j = 0; j < n; j++)
+                    slots[candidate[j]] = members[bucket_start[b] + j] + 1;
+                break;
+            }
+        }
+
+        if (d > SENTINEL_MAX_DISPLACEMENT)
+            ok = false;
+    }
+
+    pfree(hashes);
+    pfree(bucket_size);
+    pfree(bucket_start);
+    pfree(members);
+    pfree(order);
+    pfree(candidate);
+
+    return ok;
+}
+
+/*
+ * Record the leading bytes of a value for contains matching. Single-byte
+ * values match whatever follows them.
+ */
+static void
+add_bigrams(SentinelSet *set, const char *data, uint32 len)
+{
+    uint64	   *bigrams = SET_ARRAY(set, uint64, bigrams_off);
+    uint32		first = (uint8) data[0];
+    uint32		i;
+
+    if (len > 1)
+    {
+        uint32		bigram = (first << 8) | (uint8) data[1];
+
+        bigrams[bigram >> 6] |= UINT64CONST(1) << (bigram & 63);
+    }
+    else
+    {
+        /* the 256 bigrams of a leading byte fill four words */
+        for (i = 0; i < 4; i++)
+            bigrams[first * 4 + i] = ~UINT64CONST(0);
+    }
+
+    for (i = 0; i < set->nanchors; i++)
+    {
+        if (set->anchors[i] == first)
+            return;
+    }
+    if (set->nanchors < SENTINEL_MAX_ANCHORS)
+        set->anchors[set->nanchors++] = first;
+    else
+        set->nanchors = SENTINEL_MAX_ANCHORS + 1;
+}
+
+/*
+ * Build a sentinel set from a list of text values.
+ *
+ * Duplicates are removed. With SENTINEL_SET_BLOOM, the set gets a Bloom
+ * filter in front of the exact lookup, which pays off for large sets. With
+ * SENTINEL_SET_CONTAINS, the set matches values anywhere in the data rather
+ * than only at its start. The result is allocated as one chunk in the
+ * current memory context.
+ */
+SentinelSet *
+sentinel_set_build(List *values, int flags)
+{
+    text	  **sorted;
+    uint32	   *lengths;
+    int			nvalues = 0;
+    int			nlengths = 0;
+    int			i;
+    uint32		nslots;
+    uint32		nbuckets;
+    uint32		nbloom = 0;
+    Size		data_size = 0;
+    Size		size;
+    SentinelSet *set;
+    SentinelValue *entries;
+    char	   *data;
+    uint64		seed;
+    ListCell   *lc;
+
+    sorted = palloc(sizeof(text *) * Max(list_length(values), 1));
+    foreach(lc, values)
+        sorted[nvalues++] = (text *) lfirst(lc);
+
+    /* sort and remove duplicates, identical values can never be separated */
+    if (nvalues > 1)
+    {
+        int			n = 1;
+
+        qsort(sorted, nvalues, sizeof(text *), compare_text);
+        for (i = 1; i < nvalues; i++)
+            if (compare_text(&sorted[n - 1], &sorted[i]) != 0)
+                sorted[n++] = sorted[i];
+        nvalues = n;
+    }
+
+    lengths = palloc(sizeof(uint32) * Max(nvalues, 1));
+    for (i = 0; i < nvalues; i++)
+    {
+        lengths[i] = VARSIZE_ANY_EXHDR(sorted[i]);
+        data_size += lengths[i];
+    }
+    if (nvalues > 1)
+    {
+        int			n = 1;
+
+        qsort(lengths, nvalues, sizeof(uint32), compare_uint32);
+        for (i = 1; i < nvalues; i++)
+            if (lengths[n - 1] != lengths[i])
+                lengths[n++] = lengths[i];
+        nlengths = n;
+    }
+    else
+        nlengths = nvalues;
+
+    nslots = pg_nextpower2_32(Max(2 * nvalues, 2));
+    nbuckets = Max((nvalues + 3) / 4, 1);
+    if ((flags & SENTINEL_SET_BLOOM) && nvalues > 0)
+        nbloom = pg_nextpower2_32((uint32) (((uint64) nvalues * BLOOM_BITS_PER_VALUE +
+                                             BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS));
+
+    size = MAXALIGN(sizeof(SentinelSet));
+    size += sizeof(uint64) * BLOOM_BLOCK_WORDS * nbloom;
+    if (flags & SENTINEL_SET_CONTAINS)
+        size += sizeof(uint64) * BIGRAM_WORDS;
+    size += MAXALIGN(sizeof(uint32) * nlengths);
+    size += MAXALIGN(sizeof(uint16) * nbuckets);
+    size += MAXALIGN(sizeof(uint32) * nslots);
+    size += MAXALIGN(sizeof(SentinelValue) * nvalues);
+    size += data_size;
+
+    if (size > PG_UINT32_MAX)
+        ereport(ERROR,
+                (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+                 errmsg("sentinel value set is too large")));
+
+    set = palloc0(size);
+    set->size = (uint32) size;
+    set->nvalues = nvalues;
+    set->nslots = nslots;
+    set->nbuckets = nbuckets;
+    set->nlengths = nlengths;
+    set->min_len = nlengths > 0 ? lengths[0] : 0;
+    set->max_len = nlengths > 0 ? lengths[nlengths - 1] : 0;
+    set->lengths_off = MAXALIGN(sizeof(SentinelSet));
+    set->disp_off = set->lengths_off + MAXALIGN(sizeof(uint32) * nlengths);
+    set->slots_off = set->disp_off + MAXALIGN(sizeof(uint16) * nbuckets);
+    set->values_off = set->slots_off + MAXALIGN(sizeof(uint32) * nslots);
+    set->nbloom = nbloom;
+    set->bloom_off = nbloom > 0 ?
+        set->values_off + MAXALIGN(sizeof(SentinelValue) * nvalues) : 0;
+    set->bigrams_off = (flags & SENTINEL_SET_CONTAINS) ?
+        set->values_off + MAXALIGN(sizeof(SentinelValue) * nvalues) +
+        sizeof(uint64) * BLOOM_BLOCK_WORDS * nbloom : 0;
+
+    memcpy(SET_ARRAY(set, uint32, lengths_off), lengths, sizeof(uint32) * nlengths);
+
+    entries = SET_ARRAY(set, SentinelValue, values_off);
+    data = (char *) entries + MAXALIGN(sizeof(SentinelValue) * nvalues) +
+        sizeof(uint64) * BLOOM_BLOCK_WORDS * nbloom;
+    if (flags & SENTINEL_SET_CONTAINS)
+        data += sizeof(uint64) * BIGRAM_WORDS;
+    for (i = 0; i < nvalues; i++)
+    {
+        entries[i].offset = (uint32) (data - (char *) set);
+        entries[i].len = VARSIZE_ANY_EXHDR(sorted[i]);
+        memcpy(data, VARDATA_ANY(sorted[i]), entries[i].len);
+        data += entries[i].len;
+
+        if (entries[i].len > 0)
+        {
+            uint8		c = (uint8) VARDATA_ANY(sorted[i])[0];
+
+            set->first_bytes[c >> 3] |= (uint8) (1 << (c & 7));
+
+            if (flags & SENTINEL_SET_CONTAINS)
+                add_bigrams(set, VARDATA_ANY(sorted[i]), entries[i].len);
+        }
+    }
+
+    /* too many leading bytes to search for them a vector at a time */
+    if (set->nanchors > SENTINEL_MAX_ANCHORS)
+        set->nanchors = 0;
+
+    for (seed = 0; seed < SENTINEL_MAX_SEEDS; seed++)
+    {
+        if (place_values(sorted, nvalues, seed, nbuckets, nslots,
+                         SET_ARRAY(set, uint16, disp_off),
+                         SET_ARRAY(set, uint32, slots_off)))
+            break;
+    }
+
+    if (seed == SENTINEL_MAX_SEEDS)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("could not build a perfect hash for %d sentinel values",
+                        nvalues)));
+    set->seed = seed;
+
+    if (nbloom > 0)
+    {
+        for (i = 0; i < nvalues; i++)
+        {
+            SentinelHash h;
+
+            sentinel_hash(VARDATA_ANY(sorted[i]), VARSIZE_ANY_EXHDR(sorted[i]),
+                          seed, nbuckets, &h);
+            bloom_add(SET_ARRAY(set, uint64, bloom_off), nbloom, h.raw);
+        }
+    }
+
+    pfree(sorted);
+    pfree(lengths);
+
+    return set;
+}
+
+/*
+ * Look up a single candidate of exactly the given length.
+ */
+static inline bool
+sentinel_set_lookup(const SentinelSet *set, const char *data, Size len)
+{
+    SentinelHash h;
+    uint32		slot;
+    const SentinelValue *value;
+
+    sentinel_hash(data, len, set->seed, set->nbuckets, &h);
+
+    if (set->nbloom > 0 &&
+        !bloom_test(SET_ARRAY(set, uint64, bloom_off), set->nbloom, h.raw))
+        return false;
+
+    slot = sentinel_slot(&h, SET_ARRAY(set, uint16, disp_off)[h.bucket],
+                         set->nslots);
+    slot = SET_ARRAY(set, uint32, slots_off)[slot];
+
+    if (slot == 0)
+        return false;
+
+    value = &SET_ARRAY(set, SentinelValue, values_off)[slot - 1];
+
+    return value->len == len &&
+        memcmp((const char *) set + value->offset, data, len) == 0;
+}
+
+/*
+ * Check whether the given data equals a value of the set.
+ */
+bool
+sentinel_set_match_exact(const SentinelSet *set, const char *data, Size len)
+{
+    if (set->nvalues == 0)
+        return false;
+
+    return sentinel_set_lookup(set, data, len);
+}
+
+/*
+ * Check whether any value of the set is a prefix of the given data.
+ *
+ * This costs one probe per distinct sentinel length that fits into the
+ * data, which is a single probe when all sentinels share one format.
+ */
+bool
+sentinel_set_match_prefix(const SentinelSet *set, const char *data, Size len)
+{
+    const uint32 *lengths;
+    uint32		i;
+
+    if (set->nvalues == 0 || len < set->min_len)
+        return false;
+
+    if (set->min_len > 0)
+    {
+        uint8		c = (uint8) data[0];
+
+        if (!(set->first_bytes[c >> 3] & (1 << (c & 7))))
+            return false;
+    }
+
+    lengths = SET_ARRAY(set, uint32, lengths_off);
+    for (i = 0; i < set->nlengths && lengths[i] <= len; i++)
+    {
+        if (sentinel_set_lookup(set, data, lengths[i]))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Check whether a value of the set starts at position i of the data.
+ */
+static inline bool
+match_at(const SentinelSet *set, const uint64 *bigrams,
+         const char *data, Size len, Size i)
+{
+    uint8		c = (uint8) data[i];
+
+    if (!(set->first_bytes[c >> 3] & (1 << (c & 7))))
+        return false;
+
+    if (i + 1 < len)
+    {
+        uint32		bigram = ((uint32) c << 8) | (uint8) data[i + 1];
+
+        if (!(bigrams[bigram >> 6] & (UINT64CONST(1) << (bigram & 63))))
+            return false;
+    }
+
+    return sentinel_set_match_prefix(set, data + i, len - i);
+}
+
+#ifdef SENTINEL_USE_VECTOR8
+static inline bool
+vector_has_anchor(const SentinelSet *set, Vector8 chunk)
+{
+    uint32		i;
+
+    for (i = 0; i < set->nanchors; i++)
+    {
+        if (vector8_has(chunk, set->anchors[i]))
+            return true;
+    }
+
+    return false;
+}
+#endif
+
+/*
+ * Check whether any value of the set occurs anywhere in the given data.
+ *
+ * Positions are only probed if the two bytes there begin some value. With
+ * few distinct leading bytes, whole vectors that hold none of them are
+ * skipped first; without SIMD support, PostgreSQL's fallback processes
+ * eight bytes at a time in a general purpose register.
+ */
+static bool
+sentinel_set_match_contains(const SentinelSet *set, const char *data, Size len)
+{
+    const uint64 *bigrams = SET_ARRAY(set, uint64, bigrams_off);
+    Size		end;
+    Size		i = 0;
+
+    if (set->nvalues == 0 || len < set->min_len)
+        return false;
+
+    /* an empty value is contained in anything */
+    if (set->min_len == 0)
+        return true;
+
+    /* no value can start beyond this */
+    end = len - set->min_len + 1;
+
+#ifdef SENTINEL_USE_VECTOR8
+    if (set->nanchors > 0)
+    {
+        for (; i + sizeof(Vector8) <= end; i += sizeof(Vector8))
+        {
+            Vector8		chunk;
+            Size		j;
+
+            vector8_load(&chunk, (const uint8 *) data + i);
+            if (!vector_has_anchor(set, chunk))
+                continue;
+
+            for (j = i; j < i + sizeof(Vector8); j++)
+            {
+                if (match_at(set, bigrams, data, len, j))
+                    return true;
+            }
+        }
+    }
+#endif
+
+    for (; i < end; i++)
+    {
+        if (match_at(set, bigrams, data, len, i))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Test raw bytes against the sentinel values, by prefix or, for a contains
+ * set, anywhere in the data.
+ */
+bool
+sentinel_set_match(const SentinelSet *set, const char *data, Size len)
+{
+    if (set->bigrams_off != 0)
+        return sentinel_set_match_contains(set, data, len);
+
+    return sentinel_set_match_prefix(set, data, len);
+}
+
+/*
+ * Test a text Datum against the sentinel values without copying it.
+ *
+ * Inline values, including those with a short varlena header, are compared
+ * in place. Only compressed or out-of-line values have to be detoasted, and
+ * that copy is freed again right away, so memory use does not grow with the
+ * number of tuples inspected. Like the former strncmp(), this matches any
+ * value that starts with one of the sentinel values, or for a contains set,
+ * any value that has one of them anywhere.
+ *
+ * A value whose raw size, as found in its TOAST pointer or compression
+ * header, is shorter than every sentinel value cannot match and is not
+ * detoasted at all. For a prefix set, only the leading bytes up to the
+ * longest sentinel value can matter, so a longer value is detoasted as a
+ * slice: an out-of-line value costs the TOAST chunks of that slice, usually
+ * one, and a compressed value is only decompressed that far.
+ */
+bool
+sentinel_set_match_datum(const SentinelSet *set, Datum datum)
+{
+    struct varlena *value = (struct varlena *) DatumGetPointer(datum);
+    struct varlena *unpacked = value;
+    bool        match;
+
+    if (VARATT_IS_EXTERNAL(value) || VARATT_IS_COMPRESSED(value))
+    {
+        Size		raw_len = toast_raw_datum_size(datum) - VARHDRSZ;
+
+        if (set->nvalues == 0 || raw_len < set->min_len)
+            return false;
+
+        if (set->bigrams_off == 0 && raw_len > set->max_len)
+            unpacked = pg_detoast_datum_slice(value, 0, set->max_len);
+        else
+            unpacked = pg_detoast_datum_packed(value);
+    }
+
+    match = sentinel_set_match(set, VARDATA_ANY(unpacked),
+                               VARSIZE_ANY_EXHDR(unpacked));
+
+    if (unpacked != value)
+        pfree(unpacked);
+
+    return match;
+}
+
+int
+sentinel_set_count(const SentinelSet *set)
+{
+    return (int) set->nvalues;
+}
+
+/*
+ * Size of the set in bytes. Since the set only uses offsets internally, it
+ * can be copied with memcpy(), e.g. into shared memory.
+ */
+Size
+sentinel_set_size(const SentinelSet *set)
+{
+    return set->size;
+}
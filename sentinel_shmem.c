@@ -0,0 +1,324 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_shmem.c
+ *
+ * Shared memory of pg_sentinel.
+ *
+ * Large sentinel sets are built once into a dynamic shared memory area and
+ * mapped by all backends, instead of every backend building and holding a
+ * copy of its own. A shared set is identified by the registry tuple it was
+ * built from, in the form of its database, xmin and tid, so any change to
+ * the registry row leads to a new set. Backends reference count the sets
+ * they use, and a set is freed as soon as its last user lets go of it.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/itemptr.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/dsa.h"
+#include "utils/memutils.h"
+
+#include "pg_sentinel.h"
+
+#define SENTINEL_MAX_SHARED_SETS	64
+
+typedef struct SentinelSharedSet
+{
+    Oid			dboid;
+    TransactionId xmin;			/* of the registry tuple */
+    ItemPointerData tid;		/* of the registry tuple */
+    int			refcount;		/* 0 for an unused entry */
+    dsa_pointer set;
+} SentinelSharedSet;
+
+typedef struct SentinelSharedState
+{
+    LWLock	   *lock;			/* protects everything below */
+    int			tranche_id;		/* of the area's locks */
+    dsa_handle	area;
+    SentinelSharedSet sets[SENTINEL_MAX_SHARED_SETS];
+} SentinelSharedState;
+
+static SentinelSharedState *shared = NULL;
+static dsa_area *area = NULL;
+
+/* References to shared sets held by this backend */
+static int	local_refs[SENTINEL_MAX_SHARED_SETS];
+static bool exit_callback_registered = false;
+
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+
+static Size
+sentinel_shmem_size(void)
+{
+    return MAXALIGN(sizeof(SentinelSharedState));
+}
+
+static void
+sentinel_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+#endif
+
+    RequestAddinShmemSpace(sentinel_shmem_size());
+    RequestAddinShmemSpace(sentinel_stats_shmem_size());
+    RequestAddinShmemSpace(sentinel_hits_shmem_size());
+    RequestAddinShmemSpace(sentinel_rows_shmem_size());
+    RequestNamedLWLockTranche("pg_sentinel", 2);
+}
+
+static void
+sentinel_shmem_startup(void)
+{
+    bool		found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+
+    shared = ShmemInitStruct("pg_sentinel", sentinel_shmem_size(), &found);
+    if (!found)
+    {
+        memset(shared, 0, sentinel_shmem_size());
+        shared->lock = &(GetNamedLWLockTranche("pg_sentinel"))->lock;
+        shared->tranche_id = LWLockNewTrancheId();
+        shared->area = DSA_HANDLE_INVALID;
+    }
+
+    sentinel_stats_shmem_startup(&(GetNamedLWLockTranche("pg_sentinel"))[1].lock);
+    sentinel_hits_shmem_startup();
+    sentinel_rows_shmem_startup();
+
+    LWLockRelease(AddinShmemInitLock);
+}
+
+/*
+ * Set up the shared memory. Only possible while the module is preloaded.
+ */
+void
+sentinel_shmem_init(void)
+{
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+
+#if PG_VERSION_NUM >= 150000
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = sentinel_shmem_request;
+#else
+    sentinel_shmem_request();
+#endif
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = sentinel_shmem_startup;
+}
+
+/*
+ * Attach to the shared area, creating it on first use. Must be called with
+ * the lock held exclusively.
+ */
+static bool
+attach_area(void)
+{
+    MemoryContext oldcxt;
+
+    if (area != NULL)
+        return true;
+
+    LWLockRegisterTranche(shared->tranche_id, "pg_sentinel");
+
+    oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    if (shared->area == DSA_HANDLE_INVALID)
+    {
+        area = dsa_create(shared->tranche_id);
+        dsa_pin(area);
+        shared->area = dsa_get_handle(area);
+    }
+    else
+        area = dsa_attach(shared->area);
+    dsa_pin_mapping(area);
+    MemoryContextSwitchTo(oldcxt);
+
+    return true;
+}
+
+static void
+release_all_refs(int code, Datum arg)
+{
+    int			i;
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    for (i = 0; i < SENTINEL_MAX_SHARED_SETS; i++)
+    {
+        SentinelSharedSet *entry = &shared->sets[i];
+
+        if (local_refs[i] == 0)
+            continue;
+
+        entry->refcount -= local_refs[i];
+        local_refs[i] = 0;
+        if (entry->refcount == 0)
+        {
+            dsa_free(area, entry->set);
+            entry->set = InvalidDsaPointer;
+        }
+    }
+    LWLockRelease(shared->lock);
+}
+
+/*
+ * Take a reference on a shared set. Must be called with the lock held
+ * exclusively.
+ */
+static void
+acquire_ref(int slot)
+{
+    if (!exit_callback_registered)
+    {
+        before_shmem_exit(release_all_refs, (Datum) 0);
+        exit_callback_registered = true;
+    }
+
+    shared->sets[slot].refcount++;
+    local_refs[slot]++;
+}
+
+static int
+find_set(TransactionId xmin, ItemPointer tid)
+{
+    int			i;
+
+    for (i = 0; i < SENTINEL_MAX_SHARED_SETS; i++)
+    {
+        SentinelSharedSet *entry = &shared->sets[i];
+
+        if (entry->refcount > 0 && entry->dboid == MyDatabaseId &&
+            entry->xmin == xmin && ItemPointerEquals(&entry->tid, tid))
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Look up the shared set built from the given registry tuple, and take a
+ * reference on it. Returns the set's slot, or -1 if there is none yet.
+ */
+int
+sentinel_shared_set_find(TransactionId xmin, ItemPointer tid)
+{
+    int			slot;
+
+    if (shared == NULL)
+        return -1;
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    slot = find_set(xmin, tid);
+    if (slot >= 0)
+    {
+        attach_area();
+        acquire_ref(slot);
+    }
+    LWLockRelease(shared->lock);
+
+    return slot;
+}
+
+/*
+ * Copy a set built from the given registry tuple into shared memory, and
+ * take a reference on it. If another backend published the same set in the
+ * meantime, that one is used. Returns the set's slot, or -1 if shared
+ * memory is not available or all slots are in use.
+ */
+int
+sentinel_shared_set_publish(TransactionId xmin, ItemPointer tid,
+                            const SentinelSet *set)
+{
+    int			slot;
+
+    if (shared == NULL)
+        return -1;
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+
+    attach_area();
+
+    slot = find_set(xmin, tid);
+    if (slot < 0)
+    {
+        int			i;
+
+        for (i = 0; i < SENTINEL_MAX_SHARED_SETS; i++)
+        {
+            if (shared->sets[i].refcount == 0)
+            {
+                slot = i;
+                break;
+            }
+        }
+
+        if (slot >= 0)
+        {
+            SentinelSharedSet *entry = &shared->sets[slot];
+            Size		size = sentinel_set_size(set);
+
+            entry->set = dsa_allocate_extended(area, size, DSA_ALLOC_HUGE);
+            memcpy(dsa_get_address(area, entry->set), set, size);
+            entry->dboid = MyDatabaseId;
+            entry->xmin = xmin;
+            entry->tid = *tid;
+        }
+    }
+
+    if (slot >= 0)
+        acquire_ref(slot);
+
+    LWLockRelease(shared->lock);
+
+    return slot;
+}
+
+/*
+ * Map a shared set. Only valid while this backend holds a reference.
+ */
+const SentinelSet *
+sentinel_shared_set_get(int slot)
+{
+    Assert(local_refs[slot] > 0);
+
+    return (const SentinelSet *) dsa_get_address(area, shared->sets[slot].set);
+}
+
+/*
+ * Drop a reference on a shared set, freeing it when it was the last one.
+ */
+void
+sentinel_shared_set_release(int slot)
+{
+    SentinelSharedSet *entry = &shared->sets[slot];
+
+    Assert(local_refs[slot] > 0);
+
+    LWLockAcquire(shared->lock, LW_EXCLUSIVE);
+    local_refs[slot]--;
+    if (--entry->refcount == 0)
+    {
+        dsa_free(area, entry->set);
+        entry->set = InvalidDsaPointer;
+    }
+    LWLockRelease(shared->lock);
+}
@@ -0,0 +1,215 @@
+/*-------------------------------------------------------------------------
+ *
+ * sentinel_stats.c
+ *
+ * Statistics about the work pg_sentinel does.
+ *
+ * Every backend counts into a slot of its own in shared memory, padded to a
+ * cache line, so counting needs neither locks nor atomic read-modify-write
+ * operations and backends never contend for a cache line. Readers sum up all
+ * slots. A reset does not touch the counters, it records their current
+ * values as the new baseline instead, so it cannot race with the writers.
+ *
+ * Copyright 2016, 2022 Ernst-Georg Schmid
+ *
+ * Distributed under The PostgreSQL License
+ * see License file for terms
+ *-------------------------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "postmaster/autovacuum.h"
+#include "replication/walsender.h"
+#if PG_VERSION_NUM >= 170000
+#include "storage/procnumber.h"
+#else
+#include "storage/backendid.h"
+#endif
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+
+#include "pg_sentinel.h"
+
+typedef union SentinelStatsSlot
+{
+    SentinelBackendStats stats;
+    char		pad[PG_CACHE_LINE_SIZE];
+} SentinelStatsSlot;
+
+typedef struct SentinelStatsState
+{
+    LWLock	   *lock;			/* serializes resets */
+    int			nslots;
+    uint64	   *baseline;		/* nslots * SENTINEL_STAT_COUNT values */
+    SentinelStatsSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} SentinelStatsState;
+
+static SentinelStatsState *stats_state = NULL;
+
+/* Counters of this backend, either its shared slot or a private fallback */
+SentinelBackendStats *sentinel_stats = NULL;
+static SentinelBackendStats private_stats;
+
+/* Checks of the running query, while EXPLAIN ANALYZE wants them */
+SentinelQueryStats *sentinel_query_stats = NULL;
+
+PG_FUNCTION_INFO_V1(pg_sentinel_stats);
+PG_FUNCTION_INFO_V1(pg_sentinel_stats_reset);
+
+/*
+ * The number of backends with a slot of their own, indexed by ProcNumber or
+ * BackendId - 1.
+ */
+int
+sentinel_backend_slots(void)
+{
+#if PG_VERSION_NUM >= 150000
+    return MaxBackends;
+#else
+    return MaxConnections + autovacuum_max_workers + 1 +
+        max_worker_processes + max_wal_senders;
+#endif
+}
+
+Size
+sentinel_stats_shmem_size(void)
+{
+    Size		size;
+
+    size = add_size(offsetof(SentinelStatsState, slots),
+                    mul_size(sentinel_backend_slots(), sizeof(SentinelStatsSlot)));
+    size = add_size(size, mul_size(mul_size(sentinel_backend_slots(),
+                                            SENTINEL_STAT_COUNT),
+                                   sizeof(uint64)));
+
+    return size;
+}
+
+/*
+ * Initialize the statistics in shared memory. Called from the shared memory
+ * startup hook with AddinShmemInitLock held.
+ */
+void
+sentinel_stats_shmem_startup(LWLock *lock)
+{
+    bool		found;
+    int			i;
+    int			j;
+
+    stats_state = ShmemInitStruct("pg_sentinel stats",
+                                  sentinel_stats_shmem_size(), &found);
+    if (!found)
+    {
+        stats_state->lock = lock;
+        stats_state->nslots = sentinel_backend_slots();
+        stats_state->baseline = (uint64 *) &stats_state->slots[stats_state->nslots];
+        for (i = 0; i < stats_state->nslots; i++)
+        {
+            for (j = 0; j < SENTINEL_STAT_COUNT; j++)
+            {
+                pg_atomic_init_u64(&stats_state->slots[i].stats.counters[j], 0);
+                stats_state->baseline[i * SENTINEL_STAT_COUNT + j] = 0;
+            }
+        }
+    }
+}
+
+/*
+ * Find the slot of this backend. Processes without one, or a module that
+ * was not preloaded, count into private memory.
+ */
+void
+sentinel_stats_attach(void)
+{
+    int			slot;
+    int			j;
+
+#if PG_VERSION_NUM >= 170000
+    slot = MyProcNumber;
+#else
+    slot = MyBackendId - 1;
+#endif
+
+    if (stats_state != NULL && slot >= 0 && slot < stats_state->nslots)
+    {
+        sentinel_stats = &stats_state->slots[slot].stats;
+        return;
+    }
+
+    for (j = 0; j < SENTINEL_STAT_COUNT; j++)
+        pg_atomic_init_u64(&private_stats.counters[j], 0);
+    sentinel_stats = &private_stats;
+}
+
+/*
+ * pg_sentinel_stats()
+ *
+ * Returns the counters summed up over all backends, since the last reset.
+ */
+Datum
+pg_sentinel_stats(PG_FUNCTION_ARGS)
+{
+    TupleDesc	tupdesc;
+    Datum		values[SENTINEL_STAT_COUNT];
+    bool		nulls[SENTINEL_STAT_COUNT] = {0};
+    uint64		totals[SENTINEL_STAT_COUNT] = {0};
+    int			i;
+    int			j;
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    if (stats_state == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_sentinel must be loaded via shared_preload_libraries")));
+
+    LWLockAcquire(stats_state->lock, LW_SHARED);
+    for (i = 0; i < stats_state->nslots; i++)
+    {
+        for (j = 0; j < SENTINEL_STAT_COUNT; j++)
+            totals[j] += pg_atomic_read_u64(&stats_state->slots[i].stats.counters[j]) -
+                stats_state->baseline[i * SENTINEL_STAT_COUNT + j];
+    }
+    LWLockRelease(stats_state->lock);
+
+    for (j = 0; j < SENTINEL_STAT_COUNT; j++)
+        values[j] = Int64GetDatum((int64) totals[j]);
+
+    /* report the time in milliseconds, like pg_stat_statements */
+    values[SENTINEL_STAT_CHECK_TIME] =
+        Float8GetDatum((double) totals[SENTINEL_STAT_CHECK_TIME] / 1000000.0);
+
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/*
+ * pg_sentinel_stats_reset()
+ */
+Datum
+pg_sentinel_stats_reset(PG_FUNCTION_ARGS)
+{
+    int			i;
+    int			j;
+
+    if (stats_state == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_sentinel must be loaded via shared_preload_libraries")));
+
+    LWLockAcquire(stats_state->lock, LW_EXCLUSIVE);
+    for (i = 0; i < stats_state->nslots; i++)
+    {
+        for (j = 0; j < SENTINEL_STAT_COUNT; j++)
+            stats_state->baseline[i * SENTINEL_STAT_COUNT + j] =
+                pg_atomic_read_u64(&stats_state->slots[i].stats.counters[j]);
+    }
+    LWLockRelease(stats_state->lock);
+
+    PG_RETURN_VOID();
+}
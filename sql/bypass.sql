@@ -0,0 +1,23 @@
+--
+-- Only statements that reference a sentinel relation are inspected, and
+-- the decision is made once per plan
+--
+CREATE TABLE plain (id int, name text);
+INSERT INTO plain VALUES (1, 'canary-0001');
+CREATE TABLE guarded (id int, name text);
+INSERT INTO guarded VALUES (1, 'alice'), (2, 'canary-0001');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('guarded', 2, '{canary-0001}', 'error');
+SELECT pg_sentinel.pg_sentinel_stats_reset() IS NOT NULL AS reset;
+-- not inspected, whatever it returns
+SELECT * FROM plain;
+SELECT * FROM guarded WHERE id = 1;
+-- the statement reading the statistics is not inspected either
+SELECT statements_inspected, statements_skipped FROM pg_sentinel.stats;
+-- views and prepared statements of sentinel relations are inspected
+CREATE VIEW guarded_view AS SELECT * FROM guarded;
+SELECT * FROM guarded_view WHERE id = 2;
+PREPARE guarded_by_id(int) AS SELECT * FROM guarded WHERE id = $1;
+EXECUTE guarded_by_id(1);
+EXECUTE guarded_by_id(2);
+SELECT statements_inspected, statements_skipped FROM pg_sentinel.stats;
@@ -0,0 +1,13 @@
+--
+-- Only pg_sentinel may add calls of its check function to a query
+--
+CREATE TABLE probed (id int, name text);
+INSERT INTO probed VALUES (1, 'alice');
+SELECT pg_sentinel.sentinel_check(1, 0, 1::int2, '(0,1)'::tid);
+SELECT * FROM probed
+WHERE pg_sentinel.sentinel_check(name, 0, 2::int2, ctid);
+SELECT 1 AS probe WHERE EXISTS
+    (SELECT pg_sentinel.sentinel_check(name, 0, 2::int2, ctid) FROM probed);
+-- views calling it are rejected when they are defined
+CREATE VIEW probe AS
+SELECT pg_sentinel.sentinel_check(name, 0, 2::int2, ctid) FROM probed;
@@ -0,0 +1,19 @@
+--
+-- COPY TO STDOUT of sentinel relations
+--
+CREATE TABLE exports (id int, code text, note text);
+INSERT INTO exports VALUES (1, 'canary-0001', 'planted'), (2, 'plain', 'regular');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('exports', 2, '{canary-0001}', 'error');
+COPY exports TO STDOUT;
+COPY exports TO STDOUT WITH (FORMAT csv);
+COPY exports (note, code) TO STDOUT WITH (FORMAT csv);
+-- columns that are not copied are not checked
+COPY exports (id, note) TO STDOUT;
+-- a query is checked like any other
+COPY (SELECT * FROM exports WHERE id = 2) TO STDOUT;
+COPY (SELECT * FROM exports) TO STDOUT;
+-- superusers may turn the check off, e.g. for pg_dump
+SET pg_sentinel.check_copy = off;
+COPY exports TO STDOUT;
+RESET pg_sentinel.check_copy;
@@ -0,0 +1,26 @@
+--
+-- Exempt roles, see pg_sentinel.exempt_roles in regress.conf
+--
+CREATE ROLE regress_sentinel_exempt;
+CREATE ROLE regress_sentinel_member IN ROLE regress_sentinel_exempt;
+CREATE ROLE regress_sentinel_reader;
+CREATE TABLE secrets (id int, secret text);
+INSERT INTO secrets VALUES (1, 'canary-0001');
+GRANT SELECT ON secrets TO regress_sentinel_exempt, regress_sentinel_reader;
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('secrets', 2, '{canary-0001}', 'error');
+-- the role names are resolved once per session
+\c -
+-- superusers are only exempt if listed
+SELECT * FROM secrets;
+SET ROLE regress_sentinel_exempt;
+SELECT * FROM secrets;
+COPY secrets TO STDOUT;
+-- members of an exempt role are exempt as well
+SET ROLE regress_sentinel_member;
+SELECT * FROM secrets;
+SET ROLE regress_sentinel_reader;
+SELECT * FROM secrets;
+COPY secrets TO STDOUT;
+RESET ROLE;
+SELECT * FROM secrets;
@@ -0,0 +1,12 @@
+--
+-- EXPLAIN (SENTINEL), on PostgreSQL 18 and later
+--
+CREATE TABLE xp (id int, name text);
+CREATE TABLE xp_plain (id int, name text);
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('xp', 2, '{canary-0001}', 'error');
+EXPLAIN (COSTS OFF) SELECT * FROM xp;
+EXPLAIN (SENTINEL, COSTS OFF)
+SELECT * FROM xp WHERE id = 1;
+EXPLAIN (SENTINEL, COSTS OFF)
+SELECT * FROM xp_plain;
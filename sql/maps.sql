@@ -0,0 +1,36 @@
+--
+-- Block maps and row maps
+--
+CREATE TABLE mapped (id int, v text) WITH (fillfactor = 10);
+INSERT INTO mapped SELECT g, 'value-' || g FROM generate_series(1, 1000) g;
+INSERT INTO mapped VALUES (1001, 'canary-0001');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('mapped', 2, '{canary-0001}', 'error');
+SELECT pg_sentinel.pg_sentinel_rebuild_map('mapped') AS blocks;
+SELECT pg_sentinel.pg_sentinel_stats_reset() IS NOT NULL AS reset;
+-- blocks without sentinel rows are passed over
+SELECT * FROM mapped WHERE id = 1;
+SELECT * FROM mapped WHERE id = 1001;
+SELECT tuples_checked, tuples_filtered, hits FROM pg_sentinel.stats;
+-- the trigger adds the blocks of new sentinel rows
+UPDATE mapped SET v = 'canary-0001' WHERE id = 2;
+SELECT * FROM mapped WHERE id = 2;
+SELECT pg_sentinel.pg_sentinel_stats_reset() IS NOT NULL AS reset;
+SELECT * FROM mapped WHERE id = 1;
+SELECT tuples_checked, tuples_filtered, hits FROM pg_sentinel.stats;
+-- with by_tid, only the rows of the map are checked
+UPDATE pg_sentinel.sentinels SET by_tid = true
+WHERE relid = 'mapped'::regclass;
+SELECT pg_sentinel.pg_sentinel_rebuild_map('mapped') > 0 AS mapped;
+SELECT pg_sentinel.pg_sentinel_stats_reset() IS NOT NULL AS reset;
+SELECT * FROM mapped WHERE id = 1;
+SELECT * FROM mapped WHERE id = 2;
+SELECT tuples_checked, tuples_filtered, hits FROM pg_sentinel.stats;
+-- a rewrite rebuilds the maps
+VACUUM FULL mapped;
+SELECT * FROM mapped WHERE id = 2;
+SELECT * FROM mapped WHERE id = 1001;
+SELECT * FROM mapped WHERE id = 1;
+-- only relations with sentinel columns have maps
+CREATE TABLE unmapped (id int);
+SELECT pg_sentinel.pg_sentinel_rebuild_map('unmapped');
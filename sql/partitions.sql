@@ -0,0 +1,27 @@
+--
+-- The columns of a partitioned table apply to its partitions
+--
+CREATE TABLE orders (id int, region text, ref text) PARTITION BY LIST (region);
+CREATE TABLE orders_eu PARTITION OF orders FOR VALUES IN ('eu');
+CREATE TABLE orders_us PARTITION OF orders FOR VALUES IN ('us');
+INSERT INTO orders VALUES (1, 'eu', 'ref-1'), (2, 'us', 'canary-0001');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('orders', 3, '{canary-0001}', 'error');
+SELECT * FROM orders WHERE id = 1;
+SELECT * FROM orders;
+SELECT * FROM orders_us;
+-- columns are matched by name, and attaching a partition applies them
+CREATE TABLE orders_apac (ref text, id int, region text);
+INSERT INTO orders_apac VALUES ('canary-0001', 3, 'apac');
+SELECT * FROM orders_apac;
+ALTER TABLE orders ATTACH PARTITION orders_apac FOR VALUES IN ('apac');
+SELECT * FROM orders_apac;
+ALTER TABLE orders DETACH PARTITION orders_apac;
+SELECT * FROM orders_apac;
+-- inheritance children as well
+CREATE TABLE orders_archive (id int, region text, ref text);
+CREATE TABLE orders_archive_2020 () INHERITS (orders_archive);
+INSERT INTO orders_archive_2020 VALUES (4, 'eu', 'canary-0001');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('orders_archive', 3, '{canary-0001}', 'error');
+SELECT * FROM orders_archive_2020;
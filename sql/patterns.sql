@@ -0,0 +1,26 @@
+--
+-- Sentinel values given as LIKE patterns and regular expressions
+--
+CREATE TABLE identities (id int, email text, card text);
+INSERT INTO identities VALUES
+    (1, 'alice@example.com', '5500000000000004'),
+    (2, 'trap@canary.example.net', '5500000000000005'),
+    (3, 'bob@example.com', '4111110000000001'),
+    (4, 'trap@canary.example.net.example.com', '41111100000000012');
+INSERT INTO pg_sentinel.sentinels
+    (relid, attnum, sentinel_values, action, match)
+VALUES ('identities', 2, '{%@canary.example.net}', 'error', 'like'),
+       ('identities', 3, ARRAY['^411111[0-9]{10}$'], 'error', 'regex');
+SELECT * FROM identities WHERE id = 1;
+SELECT * FROM identities WHERE id = 2;
+SELECT * FROM identities WHERE id = 3;
+-- LIKE patterns match whole values, anchored expressions as well
+SELECT * FROM identities WHERE id = 4;
+-- patterns that do not compile are rejected
+UPDATE pg_sentinel.sentinels SET sentinel_values = '{(unbalanced}'
+WHERE relid = 'identities'::regclass AND attnum = 3;
+-- patterns only apply to text columns
+CREATE TABLE numbered (id int);
+INSERT INTO pg_sentinel.sentinels
+    (relid, attnum, sentinel_values, action, match)
+VALUES ('numbered', 1, '{1%}', 'error', 'like');
@@ -0,0 +1,41 @@
+--
+-- The sentinel registry
+--
+CREATE EXTENSION pg_sentinel;
+CREATE TABLE customers (id int, name text, note text);
+INSERT INTO customers VALUES
+    (1, 'alice', 'regular'),
+    (2, 'bob', 'regular'),
+    (3, 'canary-0001', 'planted');
+-- nothing registered yet
+SELECT * FROM customers;
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('customers', 2, '{canary-0001,canary-0002}', 'error');
+-- the change applies as soon as it is committed
+SELECT * FROM customers WHERE id < 3;
+SELECT * FROM customers;
+SELECT * FROM customers WHERE id = 3;
+-- values match by prefix
+INSERT INTO customers VALUES (4, 'canary-0002-b', 'planted');
+SELECT * FROM customers WHERE id = 4;
+-- a warning lets the row through
+UPDATE pg_sentinel.sentinels SET action = 'warning'
+WHERE relid = 'customers'::regclass;
+SELECT * FROM customers WHERE id = 3;
+-- changes that are rolled back do not apply
+BEGIN;
+UPDATE pg_sentinel.sentinels SET action = 'error'
+WHERE relid = 'customers'::regclass;
+ROLLBACK;
+SELECT * FROM customers WHERE id = 3;
+-- invalid entries
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('customers', 3, '{x}', 'panic');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, match)
+VALUES ('customers', 3, '{x}', 'suffix');
+-- other columns of the relation do not matter
+INSERT INTO customers VALUES (5, 'carol', 'canary-0001');
+SELECT * FROM customers WHERE id = 5;
+-- removing the entry ends the checks
+DELETE FROM pg_sentinel.sentinels WHERE relid = 'customers'::regclass;
+SELECT * FROM customers WHERE id = 3;
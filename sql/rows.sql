@@ -0,0 +1,33 @@
+--
+-- Row limits
+--
+CREATE TABLE ledger (id int, entry text);
+INSERT INTO ledger SELECT g, 'entry-' || g FROM generate_series(1, 5) g;
+CREATE TABLE branches (id int);
+INSERT INTO branches VALUES (1), (2);
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('ledger', 2, '{canary-0001}', 'error');
+SET pg_sentinel.max_statement_rows = 3;
+SELECT * FROM ledger WHERE id <= 3;
+SELECT * FROM ledger;
+-- rows are counted as the scans read them, whatever the query makes of them
+SELECT count(*) FROM ledger;
+SELECT b.id FROM branches b JOIN ledger l ON l.id = b.id;
+-- other relations are not limited
+SELECT count(*) FROM branches, generate_series(1, 10);
+-- a cursor counts as one statement
+BEGIN;
+DECLARE ledger_cursor CURSOR FOR SELECT * FROM ledger;
+FETCH 2 FROM ledger_cursor;
+FETCH 2 FROM ledger_cursor;
+ROLLBACK;
+-- COPY counts the rows it sends, whatever columns it lists
+COPY ledger (id) TO STDOUT;
+RESET pg_sentinel.max_statement_rows;
+-- the session limit counts the rows of all statements
+\c -
+SET pg_sentinel.max_session_rows = 4;
+SELECT * FROM ledger WHERE id <= 3;
+SELECT * FROM ledger WHERE id <= 3;
+RESET pg_sentinel.max_session_rows;
+SELECT * FROM ledger WHERE id <= 3;
@@ -0,0 +1,34 @@
+--
+-- Sentinel values of columns of other types than text
+--
+CREATE TABLE accounts (id bigint, token uuid, balance numeric, code bigint);
+INSERT INTO accounts VALUES
+    (1, 'a0eebc99-9c0b-4ef8-bb6d-6bb9bd380a11', 10.00, 1),
+    (42, 'b0eebc99-9c0b-4ef8-bb6d-6bb9bd380a12', 20.00, 2),
+    (3, 'c0eebc99-9c0b-4ef8-bb6d-6bb9bd380a13', 30.00, 3),
+    (4, 'd0eebc99-9c0b-4ef8-bb6d-6bb9bd380a14', 1234.50, 4);
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('accounts', 1, '{42}', 'error'),
+       ('accounts', 2, '{C0EEBC99-9C0B-4EF8-BB6D-6BB9BD380A13}', 'error'),
+       ('accounts', 3, '{1234.5}', 'warning');
+SELECT * FROM accounts WHERE id = 1;
+-- by-value types compare as machine words
+SELECT * FROM accounts WHERE id = 42;
+-- fixed-length types compare byte by byte, values are parsed
+SELECT * FROM accounts WHERE id = 3;
+-- other types compare with their equality operator
+SELECT * FROM accounts WHERE id = 4;
+-- values the type does not accept are rejected
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('accounts', 4, '{abc}', 'error');
+-- values that stop parsing later are skipped, the cache is still built
+CREATE TABLE altered (id int, code text);
+INSERT INTO altered VALUES (1, 'abc'), (2, 'xyz');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('altered', 2, '{abc}', 'error');
+SELECT * FROM altered WHERE id = 1;
+ALTER TABLE altered ALTER COLUMN code TYPE int USING length(code);
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('altered', 1, '{7}', 'error');
+SELECT * FROM altered;
+SELECT * FROM accounts WHERE id = 42;
@@ -0,0 +1,102 @@
+# Copyright 2016, 2022 Ernst-Georg Schmid
+#
+# Distributed under The PostgreSQL License
+# see License file for terms
+
+# The checks in each of pg_sentinel.mode, which can only be set at server
+# start, so every mode gets a server of its own.
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+foreach my $mode (qw(executor dest scan qual))
+{
+	my $node = PostgreSQL::Test::Cluster->new("mode_$mode");
+	$node->init;
+	$node->append_conf(
+		'postgresql.conf', qq(
+shared_preload_libraries = 'pg_sentinel'
+pg_sentinel.mode = '$mode'
+pg_sentinel.sentinel_message = 'sentinel hit'
+pg_sentinel.abort_statement_only = on
+max_parallel_workers_per_gather = 0
+));
+	$node->start;
+
+	$node->safe_psql(
+		'postgres', q(
+CREATE EXTENSION pg_sentinel;
+CREATE TABLE customers (id int, name text);
+INSERT INTO customers SELECT g, 'name-' || g FROM generate_series(1, 100) g;
+INSERT INTO customers VALUES (101, 'canary-0001');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('customers', 2, '{canary-0001}', 'error');
+CREATE INDEX customers_name ON customers (name);
+VACUUM ANALYZE customers;
+));
+
+	my $scans = $mode eq 'scan' || $mode eq 'qual';
+	my ($ret, $stdout, $stderr);
+
+	is($node->safe_psql('postgres', 'SELECT * FROM customers WHERE id = 1'),
+		'1|name-1', "$mode: rows without sentinel values pass");
+
+	($ret, $stdout, $stderr) =
+	  $node->psql('postgres', 'SELECT * FROM customers');
+	isnt($ret, 0, "$mode: a sentinel row fails the statement");
+	like($stderr, qr/ERROR:  sentinel hit/, "$mode: a hit reports the message");
+
+	# the session survives, abort_statement_only is set
+	is($node->safe_psql('postgres', 'SELECT 1'), '1', "$mode: server is up");
+
+	# only the scans see the rows that an aggregate consumes
+	($ret, $stdout, $stderr) =
+	  $node->psql('postgres', 'SELECT count(*) FROM customers');
+	if ($scans)
+	{
+		like($stderr, qr/sentinel hit/, "$mode: rows read by scans are checked");
+	}
+	else
+	{
+		is($stdout, '101', "$mode: only rows emitted are checked");
+	}
+
+	my $plan =
+	  $node->safe_psql('postgres', 'EXPLAIN (COSTS OFF) SELECT * FROM customers');
+	if ($scans)
+	{
+		like($plan, qr/sentinel_check/, "$mode: the check is in the plan");
+	}
+	else
+	{
+		unlike($plan, qr/sentinel_check/, "$mode: the plan is left alone");
+	}
+
+	($ret, $stdout, $stderr) = $node->psql('postgres',
+		q(SELECT pg_sentinel.sentinel_check(1, 0, 1::int2, '(0,1)'::tid)));
+	like(
+		$stderr,
+		qr/function pg_sentinel.sentinel_check\(\) cannot be called directly/,
+		"$mode: direct calls of the check are rejected");
+
+	# index-only scans return their tuples without a relation
+	if ($scans)
+	{
+		($ret, $stdout, $stderr) = $node->psql(
+			'postgres', q(
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+SELECT name FROM customers WHERE name >= 'canary';
+));
+		like($stderr, qr/sentinel hit/,
+			"$mode: index-only scans are checked");
+	}
+
+	$node->stop;
+}
+
+done_testing();
@@ -0,0 +1,89 @@
+# Copyright 2016, 2022 Ernst-Georg Schmid
+#
+# Distributed under The PostgreSQL License
+# see License file for terms
+
+# Hits and row limits in parallel workers.
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('parallel');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q(
+shared_preload_libraries = 'pg_sentinel'
+pg_sentinel.sentinel_message = 'sentinel hit'
+pg_sentinel.abort_statement_only = on
+max_worker_processes = 16
+max_parallel_workers = 8
+));
+$node->start;
+
+$node->safe_psql(
+	'postgres', q(
+CREATE EXTENSION pg_sentinel;
+CREATE TABLE guarded (id int, name text);
+INSERT INTO guarded SELECT g, 'name-' || g FROM generate_series(1, 10000) g;
+INSERT INTO guarded VALUES (10001, 'canary-0001');
+CREATE TABLE counted (id int, name text);
+INSERT INTO counted SELECT g, 'name-' || g FROM generate_series(1, 10000) g;
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('guarded', 2, '{canary-0001}', 'error'),
+       ('counted', 2, '{canary-0001}', 'error');
+ANALYZE guarded, counted;
+));
+
+# only the workers scan, so whatever is checked is checked by them
+my $parallel = q(
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+SET parallel_leader_participation = off;
+);
+
+like(
+	$node->safe_psql(
+		'postgres', $parallel . 'EXPLAIN (COSTS OFF) SELECT * FROM guarded'),
+	qr/Gather/,
+	'the scan runs in parallel workers');
+
+my ($ret, $stdout, $stderr) =
+  $node->psql('postgres', $parallel . 'SELECT * FROM guarded');
+like($stderr, qr/ERROR:  sentinel hit/, 'a worker reports a hit');
+
+# tuples lose their relation in the tuple queue, workers check them
+($ret, $stdout, $stderr) =
+  $node->psql('postgres', $parallel . 'SELECT count(*) FROM guarded');
+like($stderr, qr/ERROR:  sentinel hit/,
+	'rows consumed below the Gather are checked');
+
+is( $node->safe_psql(
+		'postgres', $parallel . 'SELECT count(*) FROM counted WHERE id <= 100'),
+	'100',
+	'rows without sentinel values pass');
+
+# the leader adds up the rows its workers read
+($ret, $stdout, $stderr) = $node->psql('postgres',
+	$parallel
+	  . 'SET pg_sentinel.max_statement_rows = 5000;'
+	  . 'SELECT count(*) FROM counted');
+like($stderr, qr/ERROR:  sentinel hit/,
+	'rows read by workers count towards the limit');
+
+is( $node->safe_psql(
+		'postgres',
+		$parallel
+		  . 'SET pg_sentinel.max_statement_rows = 20000;'
+		  . 'SELECT count(*) FROM counted'),
+	'10000',
+	'statements within the limit pass');
+
+$node->stop;
+
+done_testing();
@@ -0,0 +1,56 @@
+# Copyright 2016, 2022 Ernst-Georg Schmid
+#
+# Distributed under The PostgreSQL License
+# see License file for terms
+
+# The hit reporter, a background worker that logs hits and stores them in
+# pg_sentinel.hits.
+
+use strict;
+use warnings;
+
+use PostgreSQL::Test::Cluster;
+use PostgreSQL::Test::Utils;
+use Test::More;
+
+my $node = PostgreSQL::Test::Cluster->new('hits');
+$node->init;
+$node->append_conf(
+	'postgresql.conf', q(
+shared_preload_libraries = 'pg_sentinel'
+pg_sentinel.sentinel_message = 'sentinel hit'
+pg_sentinel.hit_database = 'postgres'
+pg_sentinel.hit_log = on
+));
+$node->start;
+
+$node->safe_psql(
+	'postgres', q(
+CREATE EXTENSION pg_sentinel;
+CREATE TABLE customers (id int, name text);
+INSERT INTO customers VALUES (1, 'alice'), (2, 'canary-0001');
+INSERT INTO pg_sentinel.sentinels (relid, attnum, sentinel_values, action)
+VALUES ('customers', 2, '{canary-0001}', 'warning');
+));
+
+my ($ret, $stdout, $stderr) =
+  $node->psql('postgres', 'SELECT * FROM customers WHERE id = 2');
+is($stdout, '2|canary-0001', 'a warning lets the row through');
+like($stderr, qr/WARNING:  sentinel hit/, 'the hit is reported');
+
+$node->poll_query_until('postgres', 'SELECT count(*) = 1 FROM pg_sentinel.hits')
+  or die 'timed out waiting for the hit record';
+
+is( $node->safe_psql(
+		'postgres', 'SELECT relname, attnum, action FROM pg_sentinel.hits'),
+	'customers|2|warning',
+	'the hit is stored');
+
+like(
+	slurp_file($node->logfile),
+	qr/pg_sentinel hit: action=warning relation=customers/,
+	'the hit is logged');
+
+$node->stop;
+
+done_testing();